@@ -0,0 +1,236 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+
+#include "glimac/BBox.hpp"
+
+#include "common.h"
+
+/**
+ * @brief Dynamic bounding volume hierarchy over items identified by their index,
+ * each leaf holding one item.\n
+ * build() makes the tree from scratch with the surface area heuristic (SAH),
+ * insert() adds an item to the existing tree, and refit() follows the moving items
+ * in O(n): it grows the boxes bottom-up and rotates the children and grandchildren
+ * of each node when it lowers the SAH cost, so that the tree stays good as the items move.
+ * The tree is only built again when its cost exceeds RebuildRatio times the cost of the last build
+ */
+class BVH
+{
+public:
+	/**
+	 * @brief Result of a box test during a query
+	 */
+	enum Overlap {
+		/**
+		 * @brief The whole subtree is skipped
+		 */
+		Outside,
+		/**
+		 * @brief The children are tested
+		 */
+		Intersects,
+		/**
+		 * @brief Every item of the subtree is visited without further test
+		 */
+		Contains
+	};
+
+	BVH();
+
+	void clear();
+	/**
+	 * @brief Build the tree over the items 0 to bounds.size() - 1 with a binned SAH
+	 */
+	void build(const std::vector<glimac::BBox3f>& bounds);
+	/**
+	 * @brief Add the item to the tree, as the sibling of the node which minimizes the cost
+	 * of the insertion. The item index must be itemCount()
+	 */
+	void insert(uint item, const glimac::BBox3f& bounds);
+	/**
+	 * @brief Update the tree with the new bounds of the items, bounds.size() being itemCount().
+	 * @return true if the tree was built again
+	 */
+	bool refit(const std::vector<glimac::BBox3f>& bounds);
+
+	uint itemCount() const;
+	/**
+	 * @return the sum of the areas of the internal nodes relative to the area of the root,
+	 * the SAH cost with the traversal cost as unit
+	 */
+	float cost() const;
+	/**
+	 * @return the number of times the tree was built since the start
+	 */
+	uint buildCount() const;
+
+	/**
+	 * @brief Traverse the tree: test(const glimac::BBox3f&) returns an Overlap for a node,
+	 * visit(uint item, bool contained) is called for every item in a node which isn't Outside,
+	 * contained being true when an ancestor was Contains
+	 */
+	template <typename Test, typename Visit>
+	void query(const Test& test, const Visit& visit) const;
+	/**
+	 * @brief Call visit(uint item) for every item whose box overlaps the box
+	 */
+	template <typename Visit>
+	void overlap(const glimac::BBox3f& box, const Visit& visit) const;
+	/**
+	 * @brief Find the closest item along the ray, the nearest children being visited first.
+	 * hit(uint item, float& distance) tests the item itself, lowers distance and returns true
+	 * when it is hit closer than distance
+	 * @return the item hit, or -1 if no item is hit before maxDistance
+	 */
+	template <typename Hit>
+	int raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+				const Hit& hit) const;
+
+	/**
+	 * @brief The tree is built again when refit() makes its cost exceed this ratio
+	 * times the cost after the last build
+	 */
+	static constexpr float RebuildRatio = 1.5f;
+
+private:
+	struct Node
+	{
+		glimac::BBox3f bounds;
+		int parent;
+		int left;
+		int right;
+		/**
+		 * @brief Item of a leaf, -1 for an internal node
+		 */
+		int item;
+
+		bool isLeaf() const;
+	};
+
+	/**
+	 * @brief Build the subtree of the items first to last - 1 of buildItems, reordering them
+	 * @return the index of the subtree root
+	 */
+	int buildRange(const std::vector<glimac::BBox3f>& bounds, uint first, uint last, int parent);
+	int makeLeaf(uint item, const glimac::BBox3f& bounds, int parent);
+	/**
+	 * @brief Swap the child of node with a grandchild on the other side when it lowers the
+	 * area of the other child the most
+	 */
+	void rotate(int node);
+	/**
+	 * @brief Grow the boxes from the node up to the root
+	 */
+	void refitAncestors(int node);
+	/**
+	 * @return the distance where the ray enters the box, or a negative value if it misses it
+	 * before maxDistance
+	 */
+	static float intersectRay(const glimac::BBox3f& box, const glm::vec3& origin,
+							  const glm::vec3& inverseDirection, float maxDistance);
+	static float area(const glimac::BBox3f& box);
+
+	std::vector<Node> nodes;
+	int root;
+	/**
+	 * @brief Leaf of each item
+	 */
+	std::vector<int> leaves;
+	float builtCost;
+	uint builds;
+
+	/**
+	 * @brief Scratch buffers of the build and the traversals
+	 */
+	std::vector<uint> buildItems;
+	std::vector<glm::vec3> buildCentroids;
+	std::vector<int> refitOrder;
+	mutable std::vector<int> stack;
+};
+
+template <typename Test, typename Visit>
+void BVH::query(const Test& test, const Visit& visit) const
+{
+	if (root < 0)
+		return;
+	// the sign of the index pushed tells whether an ancestor contained the subtree
+	stack.clear();
+	stack.push_back(root + 1);
+	while (!stack.empty())
+	{
+		int entry = stack.back();
+		stack.pop_back();
+		bool contained = entry < 0;
+		const Node& node = nodes[contained ? -entry - 1 : entry - 1];
+		if (!contained)
+		{
+			Overlap overlap = test(node.bounds);
+			if (overlap == Outside)
+				continue;
+			contained = overlap == Contains;
+		}
+		if (node.isLeaf())
+		{
+			visit(uint(node.item), contained);
+			continue;
+		}
+		stack.push_back(contained ? -node.right - 1 : node.right + 1);
+		stack.push_back(contained ? -node.left - 1 : node.left + 1);
+	}
+}
+
+template <typename Visit>
+void BVH::overlap(const glimac::BBox3f& box, const Visit& visit) const
+{
+	query([&box](const glimac::BBox3f& bounds)
+	{
+		return glimac::conjoint(bounds, box) ? Intersects : Outside;
+	},
+	[&visit](uint item, bool)
+	{
+		visit(item);
+	});
+}
+
+template <typename Hit>
+int BVH::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+				 const Hit& hit) const
+{
+	int closest = -1;
+	if (root < 0)
+		return closest;
+	glm::vec3 inverseDirection = 1.f / direction;
+	float distance = maxDistance;
+	stack.clear();
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+		if (intersectRay(node.bounds, origin, inverseDirection, distance) < 0)
+			continue;
+		if (node.isLeaf())
+		{
+			if (hit(uint(node.item), distance))
+				closest = node.item;
+			continue;
+		}
+		float left = intersectRay(nodes[node.left].bounds, origin, inverseDirection, distance);
+		float right = intersectRay(nodes[node.right].bounds, origin, inverseDirection, distance);
+		// the nearest child is on top of the stack
+		if (left >= 0 && right >= 0)
+		{
+			stack.push_back(left < right ? node.right : node.left);
+			stack.push_back(left < right ? node.left : node.right);
+		}
+		else if (left >= 0)
+			stack.push_back(node.left);
+		else if (right >= 0)
+			stack.push_back(node.right);
+	}
+	return closest;
+}
+
+#endif // BVH_H
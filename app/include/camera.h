@@ -39,7 +39,8 @@ public:
 	/**
 	 * @brief getProjectionMatrix
 	 * This function to process a specific screen projection according to attributes.\n
-	 * By default, it returns perspective matrix according to FoV, near and far
+	 * By default, it returns perspective matrix according to FoV, near and far,
+	 * or with reverseZ an infinite perspective mapping near to depth 1 and infinity to depth 0
 	 * @return The projection matrix processed according to the attributes
 	 */
 	virtual glm::mat4 getProjectionMatrix(float viewWidth, float viewHeight) const;
@@ -49,7 +50,16 @@ public:
 	 */
 	float FoV;
 	float near;
+	/**
+	 * @brief far plane, unused with reverseZ
+	 */
 	float far;
+	/**
+	 * @brief Use a reverse-Z projection, for a depth range [0, 1] set with glClipControl
+	 * and a floating-point depth buffer: the float precision near 0 compensates the
+	 * perspective one near the far plane, so a single small near plane fits every distance
+	 */
+	bool reverseZ;
 };
 
 /**
@@ -107,4 +117,21 @@ private:
 
 };
 
+/**
+ * @brief
+ * Camera frozen from another one: it keeps its view matrix, field of view and planes.\n
+ * The simulation thread publishes it in the frame snapshots so that the render thread
+ * never reads the cameras being updated
+ */
+class FixedCamera : public BaseCamera
+{
+public:
+	FixedCamera();
+	explicit FixedCamera(const BaseCamera& camera);
+
+	virtual glm::mat4 getViewMatrix() const;
+
+	glm::mat4 viewMatrix;
+};
+
 #endif // CAMERA_H
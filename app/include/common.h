@@ -16,7 +16,10 @@ typedef uint32_t uint;
  */
 struct Mesh {
 	Mesh(uint indexOffset, uint indexCount, int materialIndex)
-		: indexOffset(indexOffset), indexCount(indexCount), materialId(materialIndex)
+		: indexOffset(indexOffset), indexCount(indexCount), materialId(materialIndex),
+		  boundingCenter(0,0,0), boundingRadius(0), occluderRadius(0), edgeLength(0), coarserMesh(-1),
+		  sphereImpostor(-1), firstMeshlet(0), meshletCount(0), indexType(GL_UNSIGNED_INT),
+		  indexByteOffset(indexOffset * sizeof(GLuint)), baseVertex(0), positionDecode(1)
 	{}
 	Mesh()
 		: Mesh(0,0,-1)
@@ -27,7 +30,26 @@ struct Mesh {
 	 */
 	void draw() const
 	{
-		glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, (void*) (indexOffset*sizeof(GLuint)));
+		glDrawElementsBaseVertex(GL_TRIANGLES, indexCount, indexType, indexPointer(indexOffset), baseVertex);
+	}
+
+	/**
+	 * @brief draw instanceCount instances of the mesh, the per instance attributes being read
+	 * from the index baseInstance of their buffer
+	 */
+	void draw(GLuint baseInstance, GLsizei instanceCount = 1) const
+	{
+		glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, indexCount, indexType, indexPointer(indexOffset),
+													  instanceCount, baseVertex, baseInstance);
+	}
+
+	/**
+	 * @return the offset in the index buffer of the index i of the mesh, i counting
+	 * from the first index of the scene as indexOffset
+	 */
+	const GLvoid* indexPointer(uint i) const
+	{
+		return (const GLvoid*) (indexByteOffset + (i - indexOffset) * (indexType == GL_UNSIGNED_SHORT ? 2 : 4));
 	}
 
 	/**
@@ -43,6 +65,50 @@ struct Mesh {
 	 * in the scene material buffer. Otherwise materialId is -1
 	 */
 	int materialId; // -1 if no material assigned
+	/**
+	 * @brief Sphere around the vertices of the mesh, in model space,
+	 * centered on their bounding box
+	 */
+	glm::vec3 boundingCenter;
+	float boundingRadius;
+	/**
+	 * @brief Radius of a sphere around boundingCenter inside the mesh, which can hide
+	 * the instances behind it. 0 if the mesh is open or doesn't contain the center
+	 */
+	float occluderRadius;
+	/**
+	 * @brief Mean length of the longest edge of the triangles, in model space,
+	 * which decides the level of detail drawn
+	 */
+	float edgeLength;
+	/**
+	 * @brief Less detailed mesh drawn instead of this one when its edges are small on screen,
+	 * -1 at the end of the level of detail chain (see Scene::setLodChain)
+	 */
+	int coarserMesh;
+	/**
+	 * @brief Quad drawing the mesh as a ray-traced sphere when the renderer uses impostors,
+	 * -1 if the mesh isn't the unit sphere (see Scene::setSphereImpostor)
+	 */
+	int sphereImpostor;
+	/**
+	 * @brief Range of the clusters of the mesh in the scene meshlets, which cover its indices
+	 * in order. No meshlet if the mesh is small enough to be a single one
+	 */
+	uint firstMeshlet;
+	uint meshletCount;
+	/**
+	 * @brief Type and offset in bytes of the indices in the index buffer, relative to baseVertex.
+	 * Set by Scene::initializeBuffers, 16 bits indices being used for the packed vertices when they fit
+	 */
+	GLenum indexType;
+	size_t indexByteOffset;
+	GLint baseVertex;
+	/**
+	 * @brief Matrix from the positions of the vertex buffer to the model space, which the renderers
+	 * multiply to the model matrix: the box of the quantized positions, identity for float ones
+	 */
+	glm::mat4 positionDecode;
 };
 
 /**
@@ -67,12 +133,16 @@ struct Texture
 	 * @brief Texture target (GL_TEXTURE_2D, GL_TEXTURE_3D, ...)
 	 */
 	GLenum target;
+	/**
+	 * @brief Mean color of the image, the color of the texture seen from far away
+	 */
+	glm::vec3 meanColor;
 
 	/**
 	 * @brief Empty constructor, used for allocation
 	 */
 	Texture() :
-		textureId(0), samplerId(0), target(GL_TEXTURE_2D)
+		textureId(0), samplerId(0), target(GL_TEXTURE_2D), meanColor(1)
 	{}
 
 	/**
@@ -81,7 +151,7 @@ struct Texture
 	 */
 	Texture(const glimac::FilePath& filepath) :
 		image(glimac::loadImage(filepath)), textureId(0), samplerId(0),
-		target(GL_TEXTURE_2D)
+		target(GL_TEXTURE_2D), meanColor(1)
 	{
 		if (!image)
 			throw std::runtime_error("Can't load texture:" + filepath.str());
@@ -92,7 +162,7 @@ struct Texture
 	 */
 	Texture(const Texture& other) :
 		image(nullptr), textureId(other.textureId),
-		samplerId(other.samplerId), target(other.target)
+		samplerId(other.samplerId), target(other.target), meanColor(other.meanColor)
 	{}
 
 	/**
@@ -104,20 +174,40 @@ struct Texture
 	{
 		if (!image.get())
 			throw std::runtime_error("The texture has no image reference");
-		glGenTextures(1, &textureId);
-		glBindTexture(target, textureId);
-		glTexStorage2D(target, 1, GL_RGB32F,
-									 image->getWidth(), image->getHeight());
-		glTexSubImage2D(target, 0, 0, 0,
-										image->getWidth(), image->getHeight(),
-										GL_RGBA, GL_FLOAT, image->getPixels());
-		glBindTexture(target, 0);
-
-		glGenSamplers(1, &samplerId);
+		if (glimac::hasDirectStateAccess())
+		{
+			glCreateTextures(target, 1, &textureId);
+			glTextureStorage2D(textureId, 1, GL_RGB32F,
+							   image->getWidth(), image->getHeight());
+			glTextureSubImage2D(textureId, 0, 0, 0,
+								image->getWidth(), image->getHeight(),
+								GL_RGBA, GL_FLOAT, image->getPixels());
+			glCreateSamplers(1, &samplerId);
+		}
+		else
+		{
+			glGenTextures(1, &textureId);
+			glBindTexture(target, textureId);
+			glTexStorage2D(target, 1, GL_RGB32F,
+										 image->getWidth(), image->getHeight());
+			glTexSubImage2D(target, 0, 0, 0,
+											image->getWidth(), image->getHeight(),
+											GL_RGBA, GL_FLOAT, image->getPixels());
+			glBindTexture(target, 0);
+			glGenSamplers(1, &samplerId);
+		}
+
 		glSamplerParameteri(samplerId, GL_TEXTURE_MIN_FILTER, filterParam);
 		glSamplerParameteri(samplerId, GL_TEXTURE_MAG_FILTER, filterParam);
 		glSamplerParameteri(samplerId, GL_TEXTURE_WRAP_S, wrapParam);
 		glSamplerParameteri(samplerId, GL_TEXTURE_WRAP_T, wrapParam);
+
+		size_t pixelCount = size_t(image->getWidth()) * image->getHeight();
+		glm::dvec3 sum(0);
+		for (size_t i = 0; i < pixelCount; ++i)
+			sum += glm::dvec3(image->getPixels()[i]);
+		if (pixelCount)
+			meanColor = glm::vec3(sum / double(pixelCount));
 		image.release();
 	}
 
@@ -193,29 +283,46 @@ struct SkyTexture : public Texture
 		if (!images[0].get())
 			throw std::runtime_error("The texture has no image reference");
 
-		glGenTextures(1, &textureId);
-		glBindTexture(target, textureId);
+		if (glimac::hasDirectStateAccess())
+		{
+			// the cube map is seen as 6 layers, ordered +X, -X, +Y, -Y, +Z, -Z
+			static const int faceImages[6] = {2, 3, 0, 1, 4, 5};
+			glCreateTextures(target, 1, &textureId);
+			glTextureStorage2D(textureId, 1, GL_RGBA32F,
+							   images[0]->getWidth(), images[0]->getHeight());
+			for (int face=0; face<6; ++face)
+				glTextureSubImage3D(textureId, 0, 0, 0, face,
+									images[0]->getWidth(), images[0]->getHeight(), 1,
+									GL_RGBA, GL_FLOAT, images[faceImages[face]]->getPixels());
+			glCreateSamplers(1, &samplerId);
+		}
+		else
+		{
+			glGenTextures(1, &textureId);
+			glBindTexture(target, textureId);
+
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, 0, GL_RGBA32F,
+									 images[0]->getWidth(), images[0]->getHeight(),
+					0, GL_RGBA, GL_FLOAT, images[3]->getPixels());
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_RGBA32F,
+									 images[0]->getWidth(), images[0]->getHeight(),
+							0, GL_RGBA, GL_FLOAT, images[2]->getPixels());
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, 0, GL_RGBA32F,
+									 images[0]->getWidth(), images[0]->getHeight(),
+							0, GL_RGBA, GL_FLOAT, images[1]->getPixels());
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, 0, GL_RGBA32F,
+									 images[0]->getWidth(), images[0]->getHeight(),
+							0, GL_RGBA, GL_FLOAT, images[0]->getPixels());
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, 0, GL_RGBA32F,
+									 images[0]->getWidth(), images[0]->getHeight(),
+							0, GL_RGBA, GL_FLOAT, images[5]->getPixels());
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, 0, GL_RGBA32F,
+									 images[0]->getWidth(), images[0]->getHeight(),
+							0, GL_RGBA, GL_FLOAT, images[4]->getPixels());
+			glBindTexture(target, 0);
+			glGenSamplers(1, &samplerId);
+		}
 
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, 0, GL_RGBA32F,
-								 images[0]->getWidth(), images[0]->getHeight(),
-				0, GL_RGBA, GL_FLOAT, images[3]->getPixels());
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_RGBA32F,
-								 images[0]->getWidth(), images[0]->getHeight(),
-						0, GL_RGBA, GL_FLOAT, images[2]->getPixels());
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, 0, GL_RGBA32F,
-								 images[0]->getWidth(), images[0]->getHeight(),
-						0, GL_RGBA, GL_FLOAT, images[1]->getPixels());
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, 0, GL_RGBA32F,
-								 images[0]->getWidth(), images[0]->getHeight(),
-						0, GL_RGBA, GL_FLOAT, images[0]->getPixels());
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, 0, GL_RGBA32F,
-								 images[0]->getWidth(), images[0]->getHeight(),
-						0, GL_RGBA, GL_FLOAT, images[5]->getPixels());
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, 0, GL_RGBA32F,
-								 images[0]->getWidth(), images[0]->getHeight(),
-						0, GL_RGBA, GL_FLOAT, images[4]->getPixels());
-
-		glGenSamplers(1, &samplerId);
 		glSamplerParameteri(samplerId, GL_TEXTURE_MIN_FILTER, filterParam);
 		glSamplerParameteri(samplerId, GL_TEXTURE_MAG_FILTER, filterParam);
 		glSamplerParameteri(samplerId, GL_TEXTURE_WRAP_S, wrapParam);
@@ -333,9 +440,13 @@ struct Instance
 	 * @brief id in the scene material buffer if the material is overrided, -1 otherwise
 	 */
 	int materialId; // -1 if no material assigned
+	/**
+	 * @brief id in the scene terrains of the surface drawn when seen from close, -1 if none
+	 */
+	int terrainId;
 
 	Instance(int meshId)
-		: meshId(meshId), materialId(-1)
+		: meshId(meshId), materialId(-1), terrainId(-1)
 	{}
 };
 
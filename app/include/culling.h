@@ -0,0 +1,77 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <vector>
+
+#include "bvh.h"
+#include "common.h"
+
+/**
+ * @brief World bounding spheres stored by component, so that the culling loads
+ * the same component of several spheres in a SIMD register.
+ * The arrays are padded to a multiple of FrustumCuller::Batch
+ */
+struct SphereSoA
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> z;
+	std::vector<float> radius;
+	size_t count;
+
+	SphereSoA();
+
+	void resize(size_t count);
+	void set(size_t i, const glm::vec3& center, float radius);
+	glm::vec3 center(size_t i) const;
+};
+
+/**
+ * @brief Test bounding spheres against the six planes of one or several frustums.\n
+ * The spheres are tested by batches of 8 with AVX, 4 with SSE, or one by one,
+ * according to the instruction sets enabled at compile time
+ */
+class FrustumCuller
+{
+public:
+	/**
+	 * @brief Number of spheres the padding of SphereSoA allows to load at once
+	 */
+	static const size_t Batch = 8;
+
+	void clear();
+	/**
+	 * @brief Add the frustum of a view projection matrix, for a depth range [0, 1]
+	 * set with glClipControl if zeroToOne, [-1, 1] otherwise
+	 */
+	void addFrustum(const glm::mat4& viewProjMatrix, bool zeroToOne);
+	size_t frustumCount() const;
+
+	/**
+	 * @brief Write in visible the indices of the spheres in at least one frustum, in increasing order
+	 */
+	void cull(const SphereSoA& spheres, std::vector<uint>& visible) const;
+	/**
+	 * @return true if the sphere is in at least one frustum
+	 */
+	bool isVisible(const glm::vec3& center, float radius) const;
+	/**
+	 * @return Contains if the box is entirely in one of the frustums, Outside if it is
+	 * outside of every frustum, Intersects otherwise
+	 */
+	BVH::Overlap classify(const glimac::BBox3f& box) const;
+
+	/**
+	 * @return the instruction set used by cull()
+	 */
+	static const char* instructionSet();
+
+private:
+	/**
+	 * @brief Six planes per frustum, the normal in xyz pointing inside and normalized
+	 * (except the far plane of an infinite projection, which is 0 with a positive w)
+	 */
+	std::vector<glm::vec4> planes;
+};
+
+#endif // CULLING_H
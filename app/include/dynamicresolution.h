@@ -0,0 +1,72 @@
+#ifndef DYNAMICRESOLUTION_H
+#define DYNAMICRESOLUTION_H
+
+#include "common.h"
+
+/**
+ * @brief Scale of the offscreen resolution driven by the GPU frame time.\n
+ * Each frame is bracketed by beginFrame() and endFrame(): two timestamp queries whose
+ * result is read QueryCount frames later, so that the CPU never waits for it.
+ * Every AdjustPeriod frames, the scale is set so that the averaged frame time reaches the target,
+ * the GPU time being assumed proportional to the pixel count
+ */
+class DynamicResolution
+{
+public:
+	DynamicResolution();
+	~DynamicResolution();
+
+	void setEnabled(bool enabled);
+	bool isEnabled() const;
+	/**
+	 * @brief Limits of the scale applied to the width and the height of the view
+	 */
+	void setBounds(float minScale, float maxScale);
+	/**
+	 * @brief GPU time per frame to reach in ms
+	 */
+	void setTargetFrameTime(float frameTime);
+
+	/**
+	 * @return the current scale, a multiple of ScaleStep between the bounds, 1 when disabled
+	 */
+	float scale() const;
+	/**
+	 * @return the averaged GPU time per frame in ms
+	 */
+	float frameTime() const;
+
+	void beginFrame();
+	void endFrame();
+
+private:
+	DynamicResolution(const DynamicResolution&);
+	DynamicResolution& operator=(const DynamicResolution&);
+
+	void adjust();
+
+	static const uint QueryCount = 3;
+	static const uint AdjustPeriod = 15;
+	/**
+	 * @brief The scale changes by steps, the offscreen textures being
+	 * reallocated each time it changes
+	 */
+	static constexpr float ScaleStep = 1.f / 16.f;
+
+	bool enabled;
+	float minScale;
+	float maxScale;
+	float targetFrameTime;
+	float m_scale;
+	float m_frameTime;
+	uint frameSamples;
+
+	/**
+	 * @brief timestamps of the start and the end of the frames in flight
+	 */
+	GLuint queries[QueryCount][2];
+	bool pending[QueryCount];
+	uint frame;
+};
+
+#endif // DYNAMICRESOLUTION_H
@@ -0,0 +1,56 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include <vector>
+
+#include "common.h"
+
+/**
+ * @brief Cluster of neighbour triangles of a mesh, culled on its own by the renderers.\n
+ * Its triangles are contiguous in the index buffer, so that the visible clusters of a mesh
+ * are drawn with one multi-draw call. The bounds are in model space
+ */
+struct Meshlet
+{
+	/**
+	 * @brief Limits of a cluster, the sizes of the meshlets of the GPU mesh pipelines
+	 */
+	static const uint MaxVertices = 64;
+	static const uint MaxTriangles = 124;
+
+	/**
+	 * @brief Offset of the first index in the index buffer and number of indices
+	 */
+	uint indexOffset;
+	uint indexCount;
+	/**
+	 * @brief Sphere around the vertices of the cluster
+	 */
+	glm::vec3 center;
+	float radius;
+	/**
+	 * @brief Cone around the normals of the triangles: every triangle faces away from the eye
+	 * when dot(center - eye, coneAxis) >= coneCutoff * length(center - eye) + radius.
+	 * coneCutoff is 1 when the cluster can't be culled this way
+	 */
+	glm::vec3 coneAxis;
+	float coneCutoff;
+
+	/**
+	 * @return true if every triangle of the cluster faces away from the eye, in model space
+	 */
+	bool isBackFacing(const glm::vec3& eye) const;
+};
+
+/**
+ * @brief Split the triangles of the mesh in meshlets, writing their indices in meshletIndex
+ * grouped by meshlet and appending the meshlets, with index offsets in meshletIndex.\n
+ * The triangles are gathered greedily: the next triangle of a meshlet shares the most vertices
+ * with it, then is the closest to its center.
+ * The back faces are drawn, so the cones only cull the meshes which are closed:
+ * those of an open mesh never do, their back can be seen through its holes
+ */
+void buildMeshlets(const glimac::Geometry::Vertex* vertices, const unsigned int* index, uint indexCount,
+				   std::vector<unsigned int>& meshletIndex, std::vector<Meshlet>& meshlets);
+
+#endif // MESHLET_H
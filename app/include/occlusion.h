@@ -0,0 +1,92 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <vector>
+
+#include "glimac/ThreadPool.hpp"
+
+#include "common.h"
+
+class Scene;
+
+/**
+ * @brief Software occlusion culling of the scene instances on the CPU.\n
+ * The largest occluders of the view are rasterized as discs in a low resolution buffer
+ * of view depths, then a pyramid keeps the farthest depth of each 2x2 block of the level below.
+ * Each instance is hidden when its nearest depth is behind every texel of the level
+ * where its screen rectangle covers at most 2x2 texels.
+ * Everything is conservative: the disc of an occluder is inside the silhouette of its
+ * inner sphere and its depth is behind the visible surface, while the rectangle and
+ * the depth of an instance bound its sphere.
+ * The rasterization, the pyramid and the tests are split between the threads of the pool
+ */
+class OcclusionCuller
+{
+public:
+	/**
+	 * @brief Size of the depth buffer, a power of two on each axis
+	 */
+	static const int Width = 256;
+	static const int Height = 128;
+	static const uint MaxOccluders = 16;
+	/**
+	 * @brief Smallest ratio of the occluder radius to its distance, about a degree
+	 */
+	static constexpr float MinOccluderSize = 0.02f;
+
+	OcclusionCuller();
+
+	/**
+	 * @brief Rasterize the occluders among the items, then remove the hidden ones,
+	 * keeping the order of the others. The items are scene instance indices,
+	 * meshIds giving the mesh drawn for each instance.
+	 * The projection must be a symmetric perspective
+	 */
+	void cull(const Scene& scene, const std::vector<uint>& meshIds, const glm::mat4& viewMatrix,
+			  const glm::mat4& projMatrix, glimac::ThreadPool& threadPool, std::vector<uint>& items);
+
+	/**
+	 * @return the number of occluders rasterized by the last cull()
+	 */
+	size_t occluderCount() const;
+
+private:
+	/**
+	 * @brief Ellipse in pixels covered by an occluder, and the view depth behind it
+	 */
+	struct Occluder
+	{
+		glm::vec2 center;
+		glm::vec2 radius;
+		float depth;
+	};
+
+	void selectOccluders(const Scene& scene, const std::vector<uint>& meshIds, const std::vector<uint>& items);
+	/**
+	 * @brief Clear the rows first to last - 1 of the depth buffer and draw the occluders in them
+	 */
+	void rasterize(int first, int last);
+	void buildPyramid(glimac::ThreadPool& threadPool);
+	bool isHidden(const glm::vec3& center, float radius) const;
+
+	glm::mat4 viewMatrix;
+	/**
+	 * @brief Scale from the view plane at depth 1 to the pixels, and the pixel center of the view
+	 */
+	glm::vec2 pixelScale;
+	glm::vec2 pixelCenter;
+
+	std::vector<Occluder> occluders;
+	/**
+	 * @brief Level 0 is the depth buffer, each level being half the size of the previous one
+	 */
+	std::vector<std::vector<float>> levels;
+	std::vector<glm::ivec2> levelSizes;
+	/**
+	 * @brief Scratch arrays of the selection and the tests
+	 */
+	std::vector<std::pair<float, Occluder>> candidates;
+	std::vector<char> hidden;
+};
+
+#endif // OCCLUSION_H
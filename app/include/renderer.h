@@ -1,11 +1,35 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "glimac/Program.hpp"
+#include "glimac/ProgramBuilder.hpp"
+#include "glimac/StreamBuffer.hpp"
+#include "common.h"
+#include "culling.h"
+#include "occlusion.h"
 
 class Scene;
 class BaseCamera;
-class Material;
+class Terrain;
+
+/**
+ * @brief A camera drawn in a rectangle of the target, the projection taking its aspect ratio
+ */
+struct View
+{
+	const BaseCamera* camera;
+	/**
+	 * @brief x, y, width and height in the pixels of the target
+	 */
+	glm::ivec4 viewport;
+
+	glm::mat4 getViewMatrix() const;
+	glm::mat4 getProjectionMatrix() const;
+};
 
 /**
  * @brief Base class for rendering a scene. Use a the normal shading
@@ -16,14 +40,16 @@ public:
 	Renderer();
 
 	/**
-	 * @brief Initialize the shaders and the uniform
+	 * @brief Initialize the shaders and the uniform, waiting for the shaders compilation.\n
+	 * To build the shaders of several renderers at once, call loadProgram for each one with the
+	 * same builder, then glimac::ProgramBuilder::finish, then loadUniforms
 	 */
 	void initialize();
 	/**
-	 * @brief Initialize the shaders. Override this function to change the shaders to use
-	 * with glimac::loadProgram
+	 * @brief Submit the shaders to the builder. Override this function to change the shaders to use.\n
+	 * The programs are not ready before builder.finish()
 	 */
-	virtual void loadProgram();
+	virtual void loadProgram(glimac::ProgramBuilder& builder);
 	/**
 	 * @brief Initialize shaders uniforms. Override this function for getting the uniforms according
 	 * to the loaded shaders
@@ -31,13 +57,83 @@ public:
 	virtual void loadUniforms();
 
 	/**
-	 * @brief render the scene according to the camera view.
+	 * @brief render the scene according to the views.
 	 * Override this function to render according to the shaders\n
-	 * Draw each mesh instance of the scene by setting shaders uniform
+	 * Draw each mesh instance of the scene by setting shaders uniform.
+	 * A single view covers the viewport already set, several views set their own viewports
+	 */
+	virtual void render(const Scene& scene, const std::vector<View>& views) const;
+	/**
+	 * @brief Draw only the depth of the instances, the color writes being masked.
+	 * Called before render() when the depth prepass is enabled
 	 */
-	virtual void render(const Scene& scene, const BaseCamera &camera) const;
+	virtual void renderDepth(const Scene& scene, const std::vector<View>& views) const;
+
+	/**
+	 * @brief With a depth prepass, render() tests the depths written by renderDepth()
+	 * without writing them, so that each pixel is shaded once
+	 */
+	void setDepthPrepass(bool enabled);
+	bool hasDepthPrepass() const;
+	/**
+	 * @brief With occlusion culling, the instances hidden by the largest ones are not drawn
+	 */
+	void setOcclusionCulling(bool enabled);
+	bool hasOcclusionCulling() const;
+	/**
+	 * @brief With sphere impostors, the meshes which have one (see Scene::setSphereImpostor)
+	 * are drawn as a quad where the fragments ray-trace the exact sphere
+	 */
+	void setSphereImpostors(bool enabled);
+	bool hasSphereImpostors() const;
+
+	/**
+	 * @brief Instances tested and culled by the renderer over several frames,
+	 * occluded counting the culled instances hidden by others
+	 */
+	struct CullingStats
+	{
+		uint frames;
+		size_t tested;
+		size_t culled;
+		size_t occluded;
+		/**
+		 * @brief Triangles submitted, with the levels of detail drawn
+		 */
+		size_t triangles;
+		/**
+		 * @brief Visible instances drawn as point sprites
+		 */
+		size_t sprites;
+		/**
+		 * @brief Meshlets of the drawn meshes tested, and culled as back-facing or out of the frustums
+		 */
+		size_t meshlets;
+		size_t meshletsCulled;
+		/**
+		 * @brief Frames where the streamed instances waited for the GPU to release their region,
+		 * and the time waited in milliseconds
+		 */
+		uint streamStalls;
+		double streamStallTime;
+	};
+	/**
+	 * @return the culling counters since the last call, then reset them.
+	 * By default, nothing is culled
+	 */
+	virtual CullingStats takeCullingStats();
 
 protected:
+	/**
+	 * @brief Depth test passing the nearer fragments, or the fragments as near with orEqual,
+	 * according to the depth direction of the camera projection
+	 */
+	static GLenum depthFunc(const BaseCamera& camera, bool orEqual = false);
+
+	bool depthPrepass;
+	bool occlusionCulling;
+	bool sphereImpostors;
+
 	/**
 	 * @brief shaders loaded in the GPU by glimac::loadProgram
 	 */
@@ -64,124 +160,551 @@ protected:
 class LightRenderer : public Renderer
 {
 public:
+	/**
+	 * @brief Shader features, each one is a bit of the permutation mask given to
+	 * glimac::ProgramPermutations and enables the define of the same index in featureNames
+	 */
+	enum Feature {
+		KaTexture = 1 << 0,
+		KdTexture = 1 << 1,
+		KsTexture = 1 << 2,
+		NormalTexture = 1 << 3,
+		InstanceBuffer = 1 << 4,
+		VertexPulling = 1 << 5,
+		DepthOnly = 1 << 6,
+		MultiView = 1 << 7,
+		SphereImpostor = 1 << 8,
+		PackedVertices = 1 << 9,
+		SteepPointFalloff = 1 << 10
+	};
+
+	/**
+	 * @brief Maximal number of materials in uMaterialBlock, above the uniforms path is used
+	 */
+	static const uint MaxMaterials = 256;
+	/**
+	 * @brief Maximal number of views drawn in a single pass, MAX_VIEWS in light.vs.glsl
+	 */
+	static const uint MaxViews = 4;
+	/**
+	 * @brief Levels of detail: an instance is drawn with the coarsest mesh of its chain whose
+	 * longest edges are below LodEdgePixels on screen. A level is left only when it is
+	 * LodHysteresis past the threshold, so that an instance near it doesn't switch every frame
+	 */
+	static constexpr float LodEdgePixels = 12.f;
+	static constexpr float LodHysteresis = 0.25f;
+	static const uint MaxLodLevels = 8;
+	/**
+	 * @brief Distance to the eye, in radii, below which a sphere is drawn with its mesh
+	 * rather than with its impostor, whose quad needs the eye outside of the sphere
+	 */
+	static constexpr float ImpostorMinDistance = 1.01f;
+	/**
+	 * @brief Radius on screen, in pixels, below which an instance is drawn as a point sprite
+	 * in every view: its disc is then smaller than a pixel
+	 */
+	static constexpr float PointSpritePixels = 0.5f;
+	/**
+	 * @brief Radius on screen, in pixels, above which a body with a terrain is drawn with it.
+	 * Only with a single view, the terrain choosing its chunks for one eye
+	 */
+	static constexpr float TerrainPixels = 256.f;
+
 	LightRenderer();
+	virtual ~LightRenderer();
 
-	virtual void loadProgram();
+	/**
+	 * @brief Load the light shader sources and submit the permutations without material feature
+	 * of the frames with a single view, and the depth only one of the terrains.
+	 * The other permutations are compiled on demand
+	 */
+	virtual void loadProgram(glimac::ProgramBuilder& builder);
+	/**
+	 * @brief Get the uniforms of the permutation without feature
+	 */
 	virtual void loadUniforms();
-	virtual void render(const Scene& scene, const BaseCamera &camera) const;
+	/**
+	 * @brief Draw the instances sorted by permutation. If the driver supports persistent buffers,
+	 * the matrices and the material index of each instance are streamed in instanceStream
+	 * and the materials in a uniform block, otherwise they are set with uniforms before each draw.
+	 * With storage buffers, the streamed instances and the vertices are pulled by the shaders.\n
+	 * With several views and viewport arrays, each packet is drawn once with an instance per view,
+	 * the shader selecting the viewport of the view. Otherwise the packets are drawn again
+	 * for each view, reusing the streamed instances
+	 */
+	virtual void render(const Scene& scene, const std::vector<View>& views) const;
+	/**
+	 * @brief Prepare the frame and draw the packets front to back with the depth only permutation,
+	 * then the impostors with the one writing their traced depth.
+	 * The following render() reuses the packets
+	 */
+	virtual void renderDepth(const Scene& scene, const std::vector<View>& views) const;
+
+	/**
+	 * @brief Bind the textures of the material. By default, the textures are not used
+	 */
+	virtual void bindMaterial(const Material& m, const Scene &scene) const;
+	/**
+	 * @return the Feature mask needed to draw the material. By default, no feature.
+	 * Called by the worker threads preparing the packets, it must not use GL
+	 */
+	virtual uint materialFeatures(const Material& m) const;
+	/**
+	 * @return the Feature mask of the lighting model, added to every lit permutation.
+	 * By default, no feature: the point light falls off with the distance
+	 */
+	virtual uint shadingFeatures() const;
+	/**
+	 * @return the material as seen from far away, the point sprites using its colors.
+	 * By default, the material itself.
+	 * Called by the worker threads preparing the packets, it must not use GL
+	 */
+	virtual Material distantMaterial(const Material& m, const Scene& scene) const;
+
+	/**
+	 * @return the instances outside every view frustum, counted by prepareFrame()
+	 */
+	virtual CullingStats takeCullingStats();
+
+	/**
+	 * @brief defines used by the shaders for each Feature bit
+	 */
+	static const std::vector<std::string> featureNames;
 
 protected:
 	/**
-	 * @brief id of the uniform uVMatrix, the View matrix which is a matrix 4x4
+	 * @brief Data of an instance read by light.vs.glsl with USE_INSTANCE_BUFFER,
+	 * in the Scene::InstanceModelMatrix, InstanceNormalMatrix and InstanceMaterialIndex attributes
+	 */
+	struct InstanceData
+	{
+		glm::mat4 modelMatrix;
+		/**
+		 * @brief columns of the transposed inverse of the model matrix 3x3, w unused
+		 */
+		glm::vec4 normalMatrix[3];
+		/**
+		 * @brief index in uMaterialBlock
+		 */
+		GLint materialIndex;
+		GLint padding[3];
+	};
+
+	/**
+	 * @brief Vertex of the point sprite batch, read by point.vs.glsl
+	 */
+	struct PointSprite
+	{
+		/**
+		 * @brief world center in xyz, radius in w
+		 */
+		glm::vec4 sphere;
+		glm::vec3 kd;
+		glm::vec3 ka;
+	};
+
+	/**
+	 * @brief Material as stored in uMaterialBlock (std140 layout)
+	 */
+	struct MaterialData
+	{
+		glm::vec4 ka;
+		glm::vec4 kd;
+		glm::vec4 ksShininess;
+	};
+
+	/**
+	 * @brief Everything needed to draw an instance, prepared by the worker threads
+	 * so that the GL thread only sets the state and submits the draw
+	 */
+	struct DrawPacket
+	{
+		/**
+		 * @brief Feature mask of the permutation, the packets are drawn sorted by it
+		 */
+		uint features;
+		uint meshId;
+		/**
+		 * @brief Surface drawn instead of the mesh, on the uniforms path, nullptr if none
+		 */
+		const Terrain* terrain;
+		/**
+		 * @brief Index ranges of the visible meshlets when some meshlets of the mesh are culled,
+		 * adjacent ones being merged. The whole mesh is drawn otherwise
+		 */
+		bool clustered;
+		std::vector<GLsizei> clusterCounts;
+		std::vector<const GLvoid*> clusterOffsets;
+		std::vector<GLint> clusterBaseVertices;
+		uint meshletsCulled;
+		const Material* material;
+		/**
+		 * @brief Distance of the instance origin to the camera plane, for the front to back order
+		 */
+		float depth;
+		/**
+		 * @brief Data written in instanceStream when the instances are streamed
+		 */
+		InstanceData instance;
+		/**
+		 * @brief World matrices set with uniforms otherwise, without and with the position decoding,
+		 * and their product with the matrices of the view being drawn
+		 */
+		glm::mat4 modelMatrix;
+		glm::mat4 decodedMatrix;
+		glm::mat4 MVMatrix;
+		glm::mat4 MVPMatrix;
+		glm::mat4 normalMatrix;
+	};
+
+	/**
+	 * @brief Program of a permutation with its uniforms ids. The ids are given at link time
+	 * so every permutation has its own set
+	 */
+	struct Variant
+	{
+		const glimac::Program* program;
+
+		GLint uMVPMatrix;
+		GLint uMVMatrix;
+		GLint uNormalMatrix;
+		/**
+		 * @brief id of the uniform uVMatrix, the View matrix which is a matrix 4x4
+		 */
+		GLint uVMatrix;
+		/**
+		 * @brief id of the uniform uPMatrix, the Projection matrix (instance buffer permutations only)
+		 */
+		GLint uPMatrix;
+		/**
+		 * @brief ids of the view and projection matrices of each view, and of their count
+		 * (multi-view permutations only)
+		 */
+		GLint uVMatrices;
+		GLint uPMatrices;
+		GLint uViewCount;
+		/**
+		 * @brief id of the uniform uZeroToOneDepth, telling the impostors how to write their depth
+		 */
+		GLint uZeroToOneDepth;
+		/**
+		 * @brief id of the uniform uPixelScale, the pixels covered by a unit at distance 1
+		 * (point sprites only)
+		 */
+		GLint uPixelScale;
+
+		/**
+		 * @brief ids of the uniforms of the directional light (direction, color and power)
+		 */
+		GLint uDirectionalLightDir;
+		GLint uDirectionalLightColor;
+		GLint uDirectionalLightPower;
+
+		/**
+		 * @brief ids of the uniforms of the point light (position, color and power)
+		 */
+		GLint uPointLightPos;
+		GLint uPointLightColor;
+		GLint uPointLightPower;
+
+		/**
+		 * @brief ids of the uniforms of the ambiant light (color and power)
+		 */
+		GLint uAmbiantLightColor;
+		GLint uAmbiantLightPower;
+
+		// Material
+		GLint uKa;
+		GLint uKd;
+		GLint uKs;
+		GLint uShininess;
+	};
+
+	/**
+	 * @brief Texture unit of each material texture, set once in the sampler uniforms
+	 * when a permutation is built
 	 */
-	GLint uVMatrix;
+	enum TextureUnit {
+		KaTextureUnit = 0,
+		KdTextureUnit,
+		KsTextureUnit,
+		NormalTextureUnit
+	};
 
 	/**
-	 * @brief id of the uniform uDirectionalLightDir,
-	 * the direction of the directional light which is a vector 3
+	 * @brief Uniform block binding point of uMaterialBlock
 	 */
-	GLint uDirectionalLightDir;
+	static const GLuint MaterialBinding = 0;
 	/**
-	 * @brief id of the uniform uDirectionalLightColor,
-	 * the color of the directional light which is a vector 3
+	 * @brief Binding index of instanceStream in the scene VAO, used by the direct state access path
 	 */
-	GLint uDirectionalLightColor;
+	static const GLuint InstanceBinding = 1;
 	/**
-	 * @brief id of the uniform uDirectionalLightPower,
-	 * the power of the directional light which is a float
+	 * @brief Shader storage binding point of instanceStream when the vertices are pulled
 	 */
-	GLint uDirectionalLightPower;
+	static const GLuint InstanceStorageBinding = 1;
+	/**
+	 * @brief Number of instances prepared by a worker at once
+	 */
+	static const size_t PacketGrain = 64;
 
 	/**
-	 * @brief id of the uniform uPointLightPos,
-	 * the position of the point light which is a vector 3
+	 * @return the features of the permutations drawing streamed instances:
+	 * InstanceBuffer, and VertexPulling when storage buffers and draw parameters are supported
+	 */
+	uint streamFeatures() const;
+	/**
+	 * @return the base features of the frames drawing the scene in viewCount views:
+	 * streamFeatures() when the materials fit in uMaterialBlock, PackedVertices with the packed
+	 * vertex format, and MultiView when the views are drawn in a single pass
+	 */
+	uint frameFeatures(const Scene& scene, size_t viewCount) const;
+	/**
+	 * @return the number of times the packets are drawn, once per view without MultiView
 	 */
-	GLint uPointLightPos;
+	size_t viewPasses() const;
 	/**
-	 * @brief id of the uniform uPointLightColor,
-	 * the color of the point light which is a vector 3
+	 * @brief Before drawing the packets of a view pass: set the viewport of the view,
+	 * and compute its matrices in the packets on the uniforms path. The packets are culled
+	 * and sorted once for every view
 	 */
-	GLint uPointLightColor;
+	void beginViewPass(size_t view) const;
 	/**
-	 * @brief id of the uniform uPointLightPower,
-	 * the power of the point light which is a float
+	 * @brief Compute the MV, MVP and normal matrices of the packet for the view
 	 */
-	GLint uPointLightPower;
+	static void setViewMatrices(DrawPacket& packet, const glm::mat4& viewMatrix, const glm::mat4& projMatrix);
+	/**
+	 * @brief Draw a streamed packet, once per view with MultiView
+	 */
+	void drawStreamed(const Scene& scene, const DrawPacket& packet, GLuint index) const;
+	/**
+	 * @brief Test the meshlets of the packet mesh against the eyes of the views and their frustums,
+	 * filling the ranges of the packet if some are culled. Called by the worker threads
+	 */
+	void cullMeshlets(const Scene& scene, const Instance& instance, const glm::mat4& modelMatrix,
+					  DrawPacket& packet) const;
 
 	/**
-	 * @brief id of the uniform uAmbiantLightColor,
-	 * the color of the directional light which is a vector 3
+	 * @return the permutation enabling features, built and cached the first time
+	 */
+	const Variant& variant(uint features) const;
+	/**
+	 * @brief Get the uniforms ids of the program of the variant
+	 */
+	static void loadVariantUniforms(Variant& v);
+	/**
+	 * @brief Use the program of the permutation and set the lights, the view and projection matrices
 	 */
-	GLint uAmbiantLightColor;
+	void useVariant(const Variant& v, const Scene& scene, const glm::mat4& viewMatrix,
+					const glm::mat4& projMatrix) const;
 	/**
-	 * @brief id of the uniform uAmbiantLightPower,
-	 * the power of the ambiant light which is a float
+	 * @brief Set the matrices and the material colors of the packet, then draw it
 	 */
-	GLint uAmbiantLightPower;
+	void drawPacket(const Variant& v, const Scene& scene, const DrawPacket& packet) const;
+	/**
+	 * @brief Upload the point sprites and draw them over the view, or over every view with MultiView,
+	 * then bind the frame again for the next view pass
+	 */
+	void drawSprites(const Scene& scene, size_t view) const;
+	/**
+	 * @brief Matrices and features of the frame, set by prepareFrame().
+	 * viewMatrix and projMatrix are the ones of the first view, which decides the draw order
+	 */
+	struct Frame
+	{
+		glm::mat4 viewMatrix;
+		glm::mat4 projMatrix;
+		std::vector<glm::mat4> viewMatrices;
+		std::vector<glm::mat4> projMatrices;
+		std::vector<glm::ivec4> viewports;
+		/**
+		 * @brief World position of the camera of each view
+		 */
+		std::vector<glm::vec3> eyes;
+		/**
+		 * @brief Depth range [0, 1] of the reverse-Z cameras
+		 */
+		bool zeroToOneDepth;
+		uint baseFeatures;
+		/**
+		 * @brief true between renderDepth() and render(), which then reuses the packets
+		 */
+		bool prepared;
+	};
 
-	// Material
-	GLint uKa;
-	GLint uKd;
-	GLint uKs;
-	GLint uShininess;
-};
+	/**
+	 * @brief Prepare the packets of the frame and upload the streamed instances
+	 */
+	void prepareFrame(const Scene& scene, const std::vector<View>& views) const;
+	/**
+	 * @brief Bind the scene VAO matching the frame features, and the viewports of the views
+	 * with MultiView
+	 */
+	void bindFrame(const Scene& scene) const;
 
-/**
- * @brief Rendering the scene with the bling-phong model and with the textures
- */
-class TextureAndLightRenderer : public LightRenderer
-{
-public:
-	TextureAndLightRenderer();
+	/**
+	 * @brief Update the level of detail of every instance in lodLevels and lodMeshes,
+	 * from its size in the view where it is the largest, which is kept in screenRadii
+	 */
+	void selectLods(const Scene& scene, const std::vector<View>& views) const;
+	/**
+	 * @brief Cull the scene instances against the frustums of every view with the scene hierarchy,
+	 * and against the occluders of the view when there is a single view,
+	 * then fill packets from the visible ones on the thread pool,
+	 * and sort them by permutation and front to back in order, and front to back only in depthOrder.
+	 * The spheres which have an impostor use it when the eye of every view is outside of them,
+	 * and the instances smaller than a pixel go to the point sprites instead of the packets.
+	 * The bodies seen from close enough draw their loaded terrain with the uniforms path.
+	 * The meshes split in meshlets only draw their visible ones.
+	 * Only the data of the chosen path (streamed or uniforms) are computed
+	 */
+	void preparePackets(const Scene& scene, const glm::mat4& viewMatrix, const glm::mat4& projMatrix,
+						uint baseFeatures) const;
 
-	virtual void loadProgram();
-	virtual void loadUniforms();
-	virtual void render(const Scene& scene, const BaseCamera &camera) const;
+	/**
+	 * @brief Every program compiled from light.vs.glsl and light.fs.glsl.
+	 * Mutable because render() builds the permutations missing on first use
+	 */
+	mutable glimac::ProgramPermutations permutations;
+	/**
+	 * @brief Uniforms ids of the built permutations, indexed by mask
+	 */
+	mutable std::map<uint, Variant> variants;
 
-	void bindMaterial(const Material& m, const Scene &scene) const;
-protected:
-	//Material
 	/**
-	 * @brief id of the uniform uUseKaTexture,
-	 * boolean which says whether or not we use the ambiant texture
+	 * @brief Write the data of the packets in instanceStream in draw order, only the changed ones
+	 * being copied, and the scene materials in materialBuffer when their count changed
+	 */
+	void uploadInstances(const Scene& scene) const;
+	/**
+	 * @brief Set the instance attributes of the scene VAO to read instanceStream
+	 */
+	void attachInstanceBuffer(const Scene& scene) const;
+
+	/**
+	 * @brief True if the driver supports persistent buffers and base instance drawing
+	 */
+	bool instanceBuffer;
+	/**
+	 * @brief True if the streamed instances and the scene vertices are read
+	 * from storage buffers rather than from VAO attributes
+	 */
+	bool vertexPulling;
+	/**
+	 * @brief True if the vertex shader can select the viewport (viewport arrays and
+	 * GL_ARB_shader_viewport_layer_array), with vertex pulling to index the instances
+	 */
+	bool multiView;
+	/**
+	 * @brief Base features of the permutations submitted by loadProgram(),
+	 * those of the frames with a single view
+	 */
+	uint programFeatures;
+	/**
+	 * @brief Instances data of the current frame and of the frames the GPU may still draw.
+	 * Mutable as render() writes it every frame
+	 */
+	mutable glimac::StreamArray<InstanceData> instanceStream;
+	/**
+	 * @brief Uniform buffer of the materials, and the number of materials it holds.
+	 * The materials don't change after loading, the buffer is only written when their count does
 	 */
-	GLint uUseKaTexture;
+	mutable GLuint materialBuffer;
+	mutable uint uploadedMaterials;
 	/**
-	 * @brief id of the uniform uUseKdTexture,
-	 * boolean which says whether or not we use the diffuse texture
+	 * @brief VAO and buffer where the instance attributes were last attached
 	 */
-	GLint uUseKdTexture;
+	mutable GLuint attachedVAO;
+	mutable GLuint attachedBuffer;
+
 	/**
-	 * @brief id of the uniform uUseKsTexture,
-	 * boolean which says whether or not we use the specular texture
+	 * @brief Per frame arrays, kept between the frames to reuse their memory.
+	 * instances holds the visible instances, order holds the features and the index in packets of each draw, sorted
 	 */
-	GLint uUseKsTexture;
+	mutable std::vector<const Instance*> instances;
+	mutable std::vector<DrawPacket> packets;
+	mutable std::vector<std::pair<uint, uint>> order;
 	/**
-	 * @brief id of the uniform uUseNormalTexture,
-	 * boolean which says whether or not we use the normal texture
+	 * @brief packets indices sorted front to back, and the position of each packet in order
+	 * which is its index in instanceStream
 	 */
-	GLint uUseNormalTexture;
+	mutable std::vector<uint> depthOrder;
+	mutable std::vector<uint> drawIndex;
+	mutable Frame frame;
 
 	/**
-	 * @brief id of the uniform uKaTexture,
-	 * the unit where the ambiant texture is binded
+	 * @brief Instances of the nodes intersecting the frustums, their bounding spheres,
+	 * and the indices of the visible ones among them
+	 */
+	mutable std::vector<uint> candidates;
+	mutable SphereSoA spheres;
+	mutable std::vector<uint> visible;
+	/**
+	 * @brief Indices of the instances in the frustums, then of the ones not occluded
 	 */
-	GLint uKaTexture;
+	mutable std::vector<uint> visibleItems;
+	mutable OcclusionCuller occlusionCuller;
+	mutable size_t occludedCount;
 	/**
-	 * @brief id of the uniform uKdTexture,
-	 * the unit where the diffuse texture is binded
+	 * @brief Level of detail of each scene instance, kept between the frames for the hysteresis,
+	 * and the mesh drawn at this level
 	 */
-	GLint uKdTexture;
+	mutable std::vector<uint> lodLevels;
+	mutable std::vector<uint> lodMeshes;
 	/**
-	 * @brief id of the uniform uKsTexture,
-	 * the unit where the specular texture is binded
+	 * @brief Largest radius in pixels of each scene instance over the views
 	 */
-	GLint uKsTexture;
+	mutable std::vector<float> screenRadii;
 	/**
-	 * @brief id of the uniform uNormalTexture,
-	 * the unit where the normal texture is binded
+	 * @brief Instances smaller than a pixel, drawn in a single batch of points after the packets
+	 * with the program of point.vs.glsl and point.fs.glsl, built with the defines of shadingFeatures(),
+	 * and their buffer and VAO
 	 */
-	GLint uNormalTexture;
+	mutable std::vector<PointSprite> sprites;
+	glimac::Program pointProgram;
+	Variant pointVariant;
+	mutable GLuint spriteBuffer;
+	mutable GLuint spriteVAO;
+	/**
+	 * @brief Frustums of the views of the frame
+	 */
+	mutable FrustumCuller culler;
+	mutable CullingStats cullingStats;
+};
+
+/**
+ * @brief Rendering the scene with the bling-phong model and with the textures.\n
+ * Each material is drawn with the shader permutation matching its textures
+ */
+class TextureAndLightRenderer : public LightRenderer
+{
+public:
+	TextureAndLightRenderer();
+
+	/**
+	 * @brief Submit also the permutations used by planets (diffuse and ambiant textures,
+	 * drawn as meshes, as impostors or as terrains) so that they are not compiled
+	 * during the first frame
+	 */
+	virtual void loadProgram(glimac::ProgramBuilder& builder);
+	virtual void loadUniforms();
+
+	/**
+	 * @brief Bind the textures of the material to their texture units
+	 */
+	virtual void bindMaterial(const Material& m, const Scene &scene) const;
+	/**
+	 * @return the Feature mask matching the textures of the material
+	 */
+	virtual uint materialFeatures(const Material& m) const;
+	/**
+	 * @return SteepPointFalloff, the point light of the textured planets falling off faster
+	 */
+	virtual uint shadingFeatures() const;
+	/**
+	 * @return the material colors multiplied by the mean colors of its textures
+	 */
+	virtual Material distantMaterial(const Material& m, const Scene& scene) const;
 };
 
 /**
@@ -192,11 +715,25 @@ class SkyboxRenderer : public Renderer
 public:
 	SkyboxRenderer();
 
-	virtual void loadProgram();
+	virtual void loadProgram(glimac::ProgramBuilder& builder);
 	virtual void loadUniforms();
-	virtual void render(const Scene& scene, const BaseCamera &camera) const;
+	/**
+	 * @brief Without depth prepass, the sky is drawn first without depth test.
+	 * With it, the sky is drawn last on the far plane, where nothing was drawn.
+	 * A single cube, it is simply drawn in each view
+	 */
+	virtual void render(const Scene& scene, const std::vector<View>& views) const;
 
 protected:
+	/**
+	 * @brief id of the uniform uFarDepth, the depth of the far plane (0 with reverse-Z)
+	 */
+	GLint uFarDepth;
+	/**
+	 * @brief id of the uniform uPositionDecode, the decoding of the packed positions
+	 * to the model space, where they are the directions of the cube map
+	 */
+	GLint uPositionDecode;
 	/**
 	 * @brief id of the uniform uTexture,
 	 * the unit where the sky texture is binded
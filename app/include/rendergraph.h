@@ -0,0 +1,237 @@
+#ifndef RENDERGRAPH_H
+#define RENDERGRAPH_H
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+/**
+ * @brief Frame described as passes declaring the resources they read and write.\n
+ * Each frame: reset(), declare the resources and the passes in execution order, then execute().
+ * execute() culls the passes whose outputs are never used, inserts the memory barriers,
+ * gives physical textures to the transient resources (a texture being shared by resources
+ * whose lifetimes don't overlap), binds the framebuffer of each pass and measures
+ * the CPU and GPU time of each pass
+ */
+class RenderGraph
+{
+public:
+	typedef uint ResourceId;
+	typedef uint PassId;
+
+	/**
+	 * @brief How a pass uses a resource, deciding the framebuffer attachments and the barriers
+	 */
+	enum Access {
+		/**
+		 * @brief Read with a sampler
+		 */
+		SampledAccess,
+		/**
+		 * @brief Read or written as an image or a storage buffer (needs glMemoryBarrier)
+		 */
+		StorageAccess,
+		/**
+		 * @brief Written as a framebuffer attachment (color or depth according to the format)
+		 */
+		AttachmentAccess
+	};
+
+	/**
+	 * @brief Description of a transient texture, the physical textures are shared between
+	 * the resources with the same description
+	 */
+	struct TextureDesc
+	{
+		GLsizei width;
+		GLsizei height;
+		GLenum internalFormat;
+
+		bool operator==(const TextureDesc& other) const;
+		bool isDepth() const;
+		/**
+		 * @return the approximate memory size of the texture
+		 */
+		size_t byteSize() const;
+	};
+
+	/**
+	 * @brief Average times of a pass since the last call to resetTimings(), in ms
+	 */
+	struct PassTiming
+	{
+		std::string name;
+		double cpuTime;
+		double gpuTime;
+		uint executedFrames;
+		uint culledFrames;
+	};
+
+	/**
+	 * @brief Given to the pass functions, to get the textures of the resources they read
+	 */
+	class PassContext
+	{
+	public:
+		GLuint texture(ResourceId resource) const;
+	private:
+		friend class RenderGraph;
+		explicit PassContext(const RenderGraph& graph);
+		const RenderGraph& graph;
+	};
+
+	typedef std::function<void(const PassContext&)> PassFunction;
+
+	RenderGraph();
+	~RenderGraph();
+
+	/**
+	 * @brief Clear the passes and resources of the previous frame, the physical textures are kept
+	 */
+	void reset();
+
+	/**
+	 * @brief Declare the default framebuffer, drawn in the given viewport. It is an output:
+	 * the passes writing it are never culled
+	 */
+	ResourceId importBackbuffer(const std::string& name, GLint x, GLint y, GLsizei width, GLsizei height);
+	/**
+	 * @brief Declare a texture living only during the frame
+	 */
+	ResourceId createTexture(const std::string& name, const TextureDesc& desc);
+
+	/**
+	 * @brief Add a pass, executed after the passes already added
+	 */
+	PassId addPass(const std::string& name, const PassFunction& function);
+	void read(PassId pass, ResourceId resource, Access access = SampledAccess);
+	void write(PassId pass, ResourceId resource, Access access = AttachmentAccess);
+	/**
+	 * @brief Keep the pass even if nothing reads its outputs
+	 */
+	void setSideEffect(PassId pass);
+
+	/**
+	 * @brief Compile and run the passes of the frame. Throw std::logic_error if a resource
+	 * is read before being written, or if a pass mixes the backbuffer and textures
+	 */
+	void execute();
+
+	/**
+	 * @return the timings of every pass seen since the last resetTimings(), in first execution order
+	 */
+	std::vector<PassTiming> timings() const;
+	void resetTimings();
+
+	/**
+	 * @brief Memory of the transient textures in the last frame with aliasing, and without
+	 */
+	size_t transientMemory() const;
+	size_t transientMemoryWithoutAliasing() const;
+
+private:
+	RenderGraph(const RenderGraph&);
+	RenderGraph& operator=(const RenderGraph&);
+
+	struct Resource
+	{
+		std::string name;
+		bool imported;
+		TextureDesc desc;
+		/**
+		 * @brief viewport of the imported backbuffer
+		 */
+		GLint viewport[4];
+		/**
+		 * @brief index in physicalTextures, -1 for the backbuffer or before allocation
+		 */
+		int physical;
+		/**
+		 * @brief last pass writing it and its access, updated while passes are compiled
+		 */
+		int lastWriter;
+		Access lastWriteAccess;
+		/**
+		 * @brief first and last executed pass using it
+		 */
+		int firstUse;
+		int lastUse;
+	};
+
+	struct ResourceUse
+	{
+		ResourceId resource;
+		Access access;
+	};
+
+	struct Pass
+	{
+		std::string name;
+		PassFunction function;
+		std::vector<ResourceUse> reads;
+		std::vector<ResourceUse> writes;
+		bool sideEffect;
+		bool culled;
+		/**
+		 * @brief glMemoryBarrier bits needed before the pass
+		 */
+		GLbitfield barriers;
+	};
+
+	struct PhysicalTexture
+	{
+		TextureDesc desc;
+		GLuint id;
+		/**
+		 * @brief last executed pass using it in the current frame, -1 if free
+		 */
+		int busyUntil;
+		uint lastFrame;
+	};
+
+	/**
+	 * @brief GPU timer queries of a pass, one per frame in flight so that
+	 * the results are read without waiting
+	 */
+	struct PassTimer
+	{
+		static const uint QueryCount = 3;
+		GLuint queries[QueryCount];
+		bool pending[QueryCount];
+		uint order;
+		double cpuTotal;
+		double gpuTotal;
+		uint cpuSamples;
+		uint gpuSamples;
+		uint culledFrames;
+	};
+
+	void cull();
+	void computeBarriers();
+	void allocateTextures();
+	void bindFramebuffer(const Pass& pass);
+	GLuint createTexture(const TextureDesc& desc) const;
+	PassTimer& timer(const std::string& name);
+
+	std::vector<Resource> resources;
+	std::vector<Pass> passes;
+	std::vector<PhysicalTexture> physicalTextures;
+	/**
+	 * @brief framebuffers by attachments, cleared when a physical texture is deleted
+	 */
+	std::map<std::vector<GLuint>, GLuint> framebuffers;
+	std::map<std::string, PassTimer> timers;
+	uint frame;
+	size_t m_transientMemory;
+	size_t m_transientMemoryWithoutAliasing;
+
+	/**
+	 * @brief Frames without use before a physical texture is deleted
+	 */
+	static const uint TextureLifetime = 60;
+};
+
+#endif // RENDERGRAPH_H
@@ -1,12 +1,17 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <deque>
 #include <list>
+#include <unordered_map>
 
 #include "glimac/common.hpp"
 #include "glimac/Geometry.hpp"
 
+#include "bvh.h"
 #include "common.h"
+#include "meshlet.h"
+#include "terrain.h"
 
 /**
  * @brief Data structure containing all structures for rendering 3D scene
@@ -17,16 +22,65 @@ public:
 	enum GLATTRIBUT {
 		VertexPosition=0,
 		VertexNormal,
-		VertexTexCoord
+		VertexTexCoord,
+		/**
+		 * @brief Per instance attributes, read from the renderers instance buffer.
+		 * The model matrix uses 4 locations and the normal matrix 3
+		 */
+		InstanceModelMatrix=3,
+		InstanceNormalMatrix=7,
+		InstanceMaterialIndex=10
+	};
+	/**
+	 * @brief Binding index of the vertex buffer in the VAO, used by the direct state access path
+	 */
+	static const GLuint VertexBinding = 0;
+	/**
+	 * @brief Shader storage binding point of the vertex buffer when the vertices are pulled
+	 */
+	static const GLuint VertexStorageBinding = 0;
+
+	/**
+	 * @brief Vertex of the packed format, 16 bytes rather than the 32 of glimac::Geometry::Vertex.
+	 * The position is quantized on 16 bits in the box of the positions of its geometry
+	 * (see Mesh::positionDecode), the normal is 10_10_10_2 signed normalized
+	 * and the texture coordinates are half floats
+	 */
+	struct PackedVertex
+	{
+		GLushort position[4];
+		GLuint normal;
+		GLuint texCoords;
 	};
 
 	Scene();
 	~Scene();
 
 	/**
+	 * @brief Add the meshes of the geometry. The indices of the meshes larger than a meshlet
+	 * are stored grouped by meshlet.
+	 * The vertices equal bit for bit are welded, a geometry whose welded vertices are already
+	 * in the scene shares them, and a mesh already in the scene shares its indices and meshlets
 	 * @return index of the first added mesh
 	 */
 	uint addMeshes(const glimac::Geometry& geometry);
+	/**
+	 * @brief Make the meshes levels of detail of each other, from the most detailed
+	 * to the least. The instances are made with the first one,
+	 * the renderers drawing the level matching their size on screen
+	 */
+	void setLodChain(const std::vector<uint>& meshIds);
+	/**
+	 * @brief Let the renderers draw the instances of the mesh, a sphere of radius 1
+	 * centered on the origin, as the quad facing the camera where the fragments ray-trace it
+	 */
+	void setSphereImpostor(uint meshId, uint quadId);
+	/**
+	 * @brief Add the streamed surface of a body, its height tiles being under tileRoot.
+	 * Set its id to the terrainId of the body instances
+	 * @return the id of the created terrain
+	 */
+	uint addTerrain(const glimac::FilePath& tileRoot);
 	/**
 	 * @brief add an instance of the mesh given by meshId
 	 * @return the reference of the created instance
@@ -48,6 +102,12 @@ public:
 	 * @brief make a mesh from box, create a sky texture and affect this texture to the new mesh
 	 */
 	void setSkybox(const glimac::Geometry& box, const glimac::FilePath& folderPath);
+	/**
+	 * @brief Store the vertices in the packed format, and the indices of the meshes
+	 * on 16 bits when they fit. Call it before initializeBuffers()
+	 */
+	void setPackedVertices(bool enabled);
+	bool hasPackedVertices() const;
 	/**
 	 * @brief initialize VBO, VAO and IBO from meshes of the scene.\n
 	 * Note: Add all model meshes before calling this function for storing the vertex in
@@ -60,6 +120,12 @@ public:
 	 */
 	void bind() const;
 	void unbind() const;
+	/**
+	 * @brief Bind the VAO holding only the index buffer and expose the vertex buffer
+	 * as a shader storage buffer at VertexStorageBinding, for shaders fetching
+	 * the vertices by gl_VertexID. Unbind with unbind()
+	 */
+	void bindVertexPulling() const;
 
 	GLuint VAOid() const;
 	GLuint VBOid() const;
@@ -68,6 +134,36 @@ public:
 	 * @return true if the scene buffers are initialized
 	 */
 	bool initialized() const;
+	/**
+	 * @brief Update the world bounding spheres of the instances from their transform, then the
+	 * hierarchy over them: the instances made since the last call are inserted and the tree refitted.
+	 * Call it after moving the instances, before rendering
+	 */
+	void updateBounds();
+	/**
+	 * @return the hierarchy over the instance bounding spheres, its items being the instance indices
+	 */
+	const BVH& bvh() const;
+	uint instanceCount() const;
+	/**
+	 * @return the instance i, in the order they were made
+	 */
+	const Instance& instance(uint i) const;
+	/**
+	 * @return the world bounding sphere of the instance i, the center in xyz and the radius in w,
+	 * as of the last updateBounds()
+	 */
+	const glm::vec4& instanceSphere(uint i) const;
+	/**
+	 * @return the index of the closest instance whose bounding sphere is hit by the ray,
+	 * -1 if none. The direction must be normalized
+	 */
+	int pickInstance(const glm::vec3& origin, const glm::vec3& direction) const;
+	/**
+	 * @brief Append to result the indices of the instances whose bounding sphere is closer
+	 * than distance from the point
+	 */
+	void instancesNear(const glm::vec3& point, float distance, std::vector<uint>& result) const;
 	/**
 	 * @return a list start iterator for iterating through the mesh instances
 	 */
@@ -79,19 +175,59 @@ public:
 	const Texture& texture(uint i) const;
 	const Material &material(uint i) const;
 	Material& material(uint i);
+	uint materialCount() const;
 	const Mesh& mesh(uint i) const;
 	Mesh& mesh(uint i);
+	const Meshlet& meshlet(uint i) const;
+	/**
+	 * @brief The terrains are updated while rendering, hence mutable through a const scene
+	 */
+	Terrain& terrain(uint i) const;
+	/**
+	 * @return true while a terrain is loading tiles, the view having to be redrawn when they arrive
+	 */
+	bool isStreaming() const;
 	const Instance& skybox() const;
 	/**
 	 * @return the material affected to the instance or default material if nothing is affected
 	 */
 	const Material& materialOfInstance(const Instance& i) const;
+	/**
+	 * @return the id of the material affected to the instance or -1 for the default material
+	 */
+	int materialIdOfInstance(const Instance& i) const;
 
 	AmbiantLight ambiantLight;
 	DirectionalLight directionalLight;
 	PointLight pointLight;
 private:
+	/**
+	 * @brief Quantize the vertices of each geometry in the box of their positions,
+	 * setting the positionDecode of its meshes
+	 */
+	void packVertices(const std::vector<glimac::Geometry::Vertex>& vertexData,
+					  std::vector<PackedVertex>& packedData);
+	/**
+	 * @brief Write the indices of each mesh, on 16 bits relative to its first vertex
+	 * when it fits with packed vertices, setting the index type and offsets of the meshes
+	 */
+	void packIndices(const std::vector<GLuint>& indexData, std::vector<unsigned char>& indexBytes);
+	/**
+	 * @brief create and fill the buffers by their name, without changing the bound objects
+	 */
+	void initializeBuffersDSA(const void* vertexData, size_t vertexSize,
+							  const std::vector<unsigned char>& indexData);
+	/**
+	 * @brief create and fill the buffers by binding them, used when direct state access is missing
+	 */
+	void initializeBuffersBind(const void* vertexData, size_t vertexSize,
+							   const std::vector<unsigned char>& indexData);
+
 	GLuint m_VAOid;
+	/**
+	 * @brief VAO without attributes, for vertex pulling
+	 */
+	GLuint m_pullingVAOid;
 	GLuint m_VBOid;
 	GLuint m_IBOid;
 
@@ -99,22 +235,55 @@ private:
 	 * @brief models which contain the index of vertices index
 	 */
 	std::vector<Mesh> meshes;
+	std::vector<Meshlet> meshlets;
 	std::vector<Texture> textures;
 	std::vector<Material> materials;
+	/**
+	 * @brief terrains of the bodies, a deque keeping them in place as they own a thread.
+	 * Mutable as the renderers update them
+	 */
+	mutable std::deque<Terrain> terrains;
 	/**
 	 * @brief instances to draw
 	 */
 	std::list<Instance> instances;
+	/**
+	 * @brief instances by index, their world bounding spheres and boxes
+	 */
+	std::vector<Instance*> indexedInstances;
+	std::vector<glm::vec4> instanceSpheres;
+	std::vector<glimac::BBox3f> instanceBounds;
+	BVH m_bvh;
 	Instance m_skybox;
 
+	/**
+	 * @brief Welded vertices added by an addMeshes(), shared by the geometries having the same
+	 */
+	struct GeometryRange
+	{
+		uint firstVertex;
+		uint vertexCount;
+	};
+	std::vector<GeometryRange> geometryRanges;
+	/**
+	 * @brief geometry range of the vertices of each mesh
+	 */
+	std::vector<uint> meshGeometries;
+	/**
+	 * @brief content hashes of the geometry ranges, and of the meshes owning their indices
+	 */
+	std::unordered_multimap<size_t, uint> geometryHashes;
+	std::unordered_multimap<size_t, uint> meshHashes;
+	bool m_packedVertices;
+
 	/**
 	 * @brief vertices to send to the VBO
 	 */
-	std::list<glimac::Geometry::Vertex> vertices;
+	std::vector<glimac::Geometry::Vertex> vertices;
 	/**
 	 * @brief vertices index to send to the IBO
 	 */
-	std::list<GLuint> verticesIndex;
+	std::vector<GLuint> verticesIndex;
 
 	bool m_initialized;
 };
@@ -1,11 +1,18 @@
 #ifndef SPACIMAC_H
 #define SPACIMAC_H
 
+#include <atomic>
 #include <string>
 #include <glimac/FilePath.hpp>
+#include <glimac/ProgramBinaryCache.hpp>
+#include <glimac/SPSCQueue.hpp>
+#include <glimac/ThreadPool.hpp>
+#include <glimac/TripleBuffer.hpp>
 
 #include "camera.h"
+#include "dynamicresolution.h"
 #include "renderer.h"
+#include "rendergraph.h"
 #include "scene.h"
 #include "solarsystem.h"
 
@@ -22,7 +29,9 @@ public:
 	~SpacImac();
 
 	/**
-	 * @brief Main loop which handle event, solar system update and frame drawing
+	 * @brief Main loop which handle event and frame drawing, the solar system
+	 * being updated by the simulation thread started here.
+	 * When the time is paused and the camera still, no frame is drawn until an event changes them
 	 * @return the application exit code
 	 */
 	int exec();
@@ -44,17 +53,49 @@ public:
 	 */
 	void updateSpaceElementMesh(std::pair<Instance*, const SpaceElement*> solarElement);
 	/**
-	 * @brief Handle SDL_Event
+	 * @brief Handle SDL_Event on the main thread: quit and resize, the other events
+	 * are queued for the simulation thread
 	 */
 	void handleEvent(const SDL_Event& event);
+	/**
+	 * @brief Handle the SDL_Event changing the time or the cameras, on the simulation thread
+	 */
+	void handleSimulationEvent(const SDL_Event& event);
 	/**
 	 * @brief update the time and all objects
 	 */
 	void update(float deltaTime);
 	/**
-	 * @brief call renderer
+	 * @brief Simulation thread loop: handle the queued events, update and publish a snapshot
+	 * every SimulationStep ms until done
+	 */
+	void simulationLoop();
+	/**
+	 * @brief Copy the simulated transforms and the current camera in a snapshot for the main thread
+	 */
+	void publishSnapshot();
+	/**
+	 * @brief build the render graph of the frame and execute it
+	 */
+	void render();
+	/**
+	 * @brief add the passes drawing the frame in targets to the render graph,
+	 * the views being laid out in the rectangle x, y, width, height of the targets
+	 */
+	void addFramePasses(const std::vector<RenderGraph::ResourceId>& targets,
+						GLint x, GLint y, GLsizei width, GLsizei height);
+	/**
+	 * @brief enable the depth prepass of the renderers, the sky being then drawn last (F2)
+	 */
+	void setDepthPrepass(bool enabled);
+	/**
+	 * @brief log the GPU time of offscreen frames up to 3840x2160, with and without depth prepass (F3)
+	 */
+	void measureFillRate();
+	/**
+	 * @brief depth format of the offscreen targets, floating-point with reverse-Z
 	 */
-	void render() const;
+	GLenum depthFormat() const;
 
 	void setRenderer(Renderer* renderer);
 
@@ -66,12 +107,111 @@ public:
 	uint viewWidth() const;
 	uint viewHeight() const;
 	Scene& scene();
+	/**
+	 * @brief Binary cache given to glimac when the renderers build their programs
+	 */
+	glimac::ProgramBinaryCache& programCache();
+	/**
+	 * @brief Worker threads shared by the renderers to prepare the frames
+	 */
+	glimac::ThreadPool& threadPool();
+	/**
+	 * @brief Scale of the offscreen resolution, toggled with F5
+	 */
+	DynamicResolution& dynamicResolution();
 
 	static SpacImac* instance();
 private:
+	/**
+	 * @brief Cameras drawn in a frame, switched with F6: the current one,
+	 * a stereo pair made from the current one side by side, or every camera in a grid
+	 */
+	enum ViewMode {
+		SingleView,
+		StereoViews,
+		GridViews
+	};
+
+	/**
+	 * @brief State of the simulation given to the main thread to draw a frame
+	 */
+	struct FrameSnapshot
+	{
+		/**
+		 * @brief transforms of the solar system instances, in solarSystemMeshes order
+		 */
+		std::vector<Transform> transforms;
+		/**
+		 * @brief a camera per view, drawn in a single pass
+		 */
+		std::vector<FixedCamera> cameras;
+		uint frame;
+		/**
+		 * @brief incremented only when the transforms or the camera differ from the previous snapshot
+		 */
+		uint version;
+
+		bool sameContent(const FrameSnapshot& other) const;
+	};
+
+	/**
+	 * @brief Time spent waiting by each thread in ms, logged every WaitReportPeriod ms
+	 */
+	struct WaitStats
+	{
+		Uint32 swap;
+		Uint32 pacing;
+		Uint32 eventQueue;
+		/**
+		 * @brief time without drawing because nothing changed
+		 */
+		Uint32 idle;
+		std::atomic<Uint32> simulationIdle;
+		Uint32 start;
+	};
+
+	/**
+	 * @brief Minimal duration of a simulation tick in ms
+	 */
+	static const Uint32 SimulationStep = 16;
+	static const Uint32 WaitReportPeriod = 5000;
+	/**
+	 * @brief Simulation ticks without change before blocking on the events,
+	 * leaving time to the simulation to publish the effect of the last events
+	 */
+	static const uint IdleTicksBeforeWait = 3;
+	/**
+	 * @brief Distance between the eyes of the stereo views, relative to the distance to the target
+	 */
+	static constexpr float StereoSeparation = 1.f / 30.f;
+	static const uint FillRateFrames = 20;
+	/**
+	 * @brief Near plane of the cameras with reverse-Z
+	 */
+	static constexpr float ReverseZNear = 0.001f;
+	/**
+	 * @brief Rows of quads of the generated spheres, from the most detailed level to the least,
+	 * each row having twice as many quads as there are rows (7920 to 48 triangles)
+	 */
+	static const uint SphereLodRows[];
+
+	void reportWaits();
+	/**
+	 * @brief Set the cameras of the views of the snapshot according to viewMode
+	 */
+	void snapshotCameras(std::vector<FixedCamera>& views) const;
+	/**
+	 * @brief true if the last snapshot or the main thread changed the frame since it was drawn
+	 */
+	bool frameChanged() const;
+	/**
+	 * @brief Sleep a simulation tick, or block until the next event after IdleTicksBeforeWait ticks
+	 */
+	void waitForChange();
+
 	glimac::FilePath path;
 
-	bool done;
+	std::atomic<bool> done;
 
 	float ratio;
 	float sizeScale, distanceScale;
@@ -85,13 +225,75 @@ private:
 	float lastTimeSpeed;
 	float timeStep;
 
+	/**
+	 * @brief ticks when the window was created and time spent building the shaders in ms,
+	 * logged at the end of initialize() to compare cold and warm program cache
+	 */
+	Uint32 startTicks;
+	Uint32 shaderTicks;
+	glimac::ProgramBinaryCache m_programCache;
+	glimac::ThreadPool m_threadPool;
+
 	std::unique_ptr<SkyboxRenderer> skyRenderer;
 	Renderer* renderer;
+	RenderGraph m_renderGraph;
+	DynamicResolution m_dynamicResolution;
 	std::vector<std::unique_ptr<BaseCamera>> cameras;
 	int currentCamera;
+	ViewMode viewMode;
+	/**
+	 * @brief Views of the frame being drawn, read by the render graph passes
+	 */
+	std::vector<View> m_frameViews;
+	bool m_depthPrepass;
+	/**
+	 * @brief Software occlusion culling of the renderer, toggled with F7
+	 */
+	bool m_occlusionCulling;
+	/**
+	 * @brief Planets drawn as ray-traced sphere impostors, toggled with F8
+	 */
+	bool m_sphereImpostors;
+	/**
+	 * @brief Depth range [0, 1] with glClipControl, the cameras using reverse-Z projections
+	 * and the frame being drawn offscreen with a floating-point depth
+	 */
+	bool m_reverseZ;
+	/**
+	 * @brief Read framebuffer copying the offscreen color in the backbuffer
+	 */
+	GLuint m_presentFramebuffer;
 	Scene m_scene;
 	SolarSystem solarSystem;
+	/**
+	 * @brief The instances of solarSystemMeshes are owned by the simulation thread,
+	 * the scene instances drawn are in sceneInstances, in the same order
+	 */
 	SpaceElementMeshes solarSystemMeshes;
+	std::list<Instance> simulationInstances;
+	std::vector<Instance*> sceneInstances;
+
+	/**
+	 * @brief Events from the main thread to the simulation thread
+	 */
+	glimac::SPSCQueue<SDL_Event> m_events;
+	/**
+	 * @brief Snapshots from the simulation thread to the main thread
+	 */
+	glimac::TripleBuffer<FrameSnapshot> m_snapshots;
+	WaitStats m_waits;
+	/**
+	 * @brief Content of the last snapshot and its version, on the simulation thread
+	 */
+	FrameSnapshot m_publishedSnapshot;
+	uint m_snapshotVersion;
+	/**
+	 * @brief Version of the snapshot drawn last, a redraw being needed anyway after
+	 * a change made by the main thread (resize, renderer settings)
+	 */
+	uint m_renderedVersion;
+	bool m_redraw;
+	uint m_idleTicks;
 
 	static SpacImac* m_instance;
 };
@@ -109,7 +311,8 @@ public:
 	virtual void update(float deltaTime);
 
 	/**
-	 * @brief Update the distance according to the target size
+	 * @brief Update the distance according to the target size,
+	 * and the near and far planes without reverse-Z
 	 */
 	void updateDistance();
 private:
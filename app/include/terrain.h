@@ -0,0 +1,161 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "glimac/FilePath.hpp"
+#include "glimac/SPSCQueue.hpp"
+
+#include "common.h"
+
+/**
+ * @brief Surface of a body seen from close, drawn instead of its sphere mesh.\n
+ * Each face of a cube projected on the unit sphere is a quadtree of chunks, a chunk being
+ * a grid of GridSize x GridSize quads displaced by its height tile. A chunk is split in its
+ * 4 children while its error on screen exceeds MaxPixelError, once the children are loaded.
+ * The height tiles are read from an on-disk pyramid, root/face/level/x_y.png, a missing tile
+ * being resampled from its nearest ancestor, or flat without any.
+ * The loader thread reads the tiles and builds the vertices with their normals, the GL thread
+ * only uploads them. It sleeps on a condition variable while no tile is requested.
+ * The cracks between chunks of different levels are hidden by skirts hanging under the edges
+ * of each chunk
+ */
+class Terrain
+{
+public:
+	/**
+	 * @brief Quads along a chunk side
+	 */
+	static const uint GridSize = 16;
+	static const uint MaxLevel = 14;
+	/**
+	 * @brief Largest error on screen of a drawn chunk, in pixels
+	 */
+	static constexpr float MaxPixelError = 2.f;
+	/**
+	 * @brief Height of the white in the tiles, relative to the radius of the body
+	 */
+	static constexpr float HeightScale = 0.005f;
+	/**
+	 * @brief Chunks kept on the GPU, the least recently drawn ones being released beyond
+	 */
+	static const uint MaxChunks = 512;
+
+	/**
+	 * @brief Chunk of the quadtree of a face, x and y being in [0, 2^level)
+	 */
+	struct TileKey
+	{
+		uint face;
+		uint level;
+		uint x;
+		uint y;
+
+		bool operator<(const TileKey& other) const;
+		TileKey child(uint i) const;
+	};
+
+	explicit Terrain(const glimac::FilePath& tileRoot);
+	/**
+	 * @return true if the directory of the height tiles exists
+	 */
+	static bool hasTiles(const glimac::FilePath& tileRoot);
+	/**
+	 * @brief Stop the loader thread and release the chunks
+	 */
+	~Terrain();
+
+	/**
+	 * @brief Upload the chunks loaded since the last call, then choose the chunks to draw
+	 * for the eye given in the model space of the body, and request the missing ones.
+	 * pixelScale is the number of pixels covered by a unit at distance 1. GL thread only
+	 */
+	void update(const glm::vec3& eye, float pixelScale);
+	/**
+	 * @brief Draw the chosen chunks with their own VAOs, the program and the matrices being set
+	 */
+	void draw() const;
+
+	/**
+	 * @return true once the chunks of the 6 faces are loaded, so that the whole body can be drawn
+	 */
+	bool isReady() const;
+	/**
+	 * @return true while tiles are requested and not uploaded yet
+	 */
+	bool isLoading() const;
+	uint drawnChunkCount() const;
+	uint triangleCount() const;
+
+private:
+	/**
+	 * @brief Vertices of a chunk built by the loader thread
+	 */
+	struct ChunkData
+	{
+		TileKey key;
+		std::vector<glimac::Geometry::Vertex> vertices;
+	};
+
+	struct Chunk
+	{
+		GLuint vao;
+		GLuint buffer;
+		uint lastFrame;
+	};
+
+	/**
+	 * @brief Choose the chunks of the subtree, requesting the children it should be split in
+	 */
+	void select(const TileKey& key, const glm::vec3& eye, float pixelScale);
+	void request(const TileKey& key);
+	void upload(const ChunkData& data);
+	/**
+	 * @brief Release the least recently drawn chunks beyond MaxChunks
+	 */
+	void evict();
+	void releaseChunk(Chunk& chunk);
+
+	void loaderLoop();
+	/**
+	 * @brief Heights of the chunk on a (GridSize + 3)² grid, the grid of the vertices with a border
+	 * for the normals, from the tile of the chunk or from the nearest ancestor on disk
+	 */
+	void loadHeights(const TileKey& key, std::vector<float>& heights);
+	void buildChunk(ChunkData& data);
+
+	glimac::FilePath tileRoot;
+
+	std::map<TileKey, Chunk> chunks;
+	std::set<TileKey> pending;
+	std::vector<const Chunk*> drawn;
+	uint frame;
+	/**
+	 * @brief Indices of the grid and of its skirts, shared by every chunk
+	 */
+	GLuint indexBuffer;
+	GLsizei indexCount;
+
+	std::unique_ptr<std::thread> loader;
+	std::atomic<bool> stopping;
+	/**
+	 * @brief Wakes the loader thread up when tiles are requested or when it stops
+	 */
+	std::mutex wakeMutex;
+	std::condition_variable wake;
+	glimac::SPSCQueue<TileKey> requests;
+	glimac::SPSCQueue<std::shared_ptr<ChunkData>> results;
+	/**
+	 * @brief Tiles read by the loader thread, dropped when there are too many
+	 */
+	std::map<TileKey, std::unique_ptr<glimac::Image>> tileCache;
+};
+
+#endif // TERRAIN_H
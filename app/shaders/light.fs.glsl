@@ -3,6 +3,18 @@
 precision mediump float;
 #endif
 
+// Features (defined at compile time by the renderer, see glimac::ProgramPermutations)
+// USE_KA_TEXTURE : ambiant color multiplied by uKaTexture
+// USE_KD_TEXTURE : diffuse color multiplied by uKdTexture
+// USE_KS_TEXTURE : specular color multiplied by uKsTexture
+// USE_NORMAL_TEXTURE : uNormalTexture is bound (not applied yet, no tangents in the vertices)
+// USE_INSTANCE_BUFFER : material read in uMaterialBlock at the index given by the instance
+// USE_DEPTH_ONLY : depth prepass, the color writes are masked so nothing is shaded
+// USE_SPHERE_IMPOSTOR : the fragments of the quad intersect their ray with the sphere
+// of the instance, discarding the missed ones, and shade the hit point
+// USE_STEEP_POINT_FALLOFF : the point light falls off with the distance to the power 1.5
+// (TextureAndLightRenderer), rather than with the distance
+
 // Lights
 uniform vec3 uDirectionalLightColor;
 uniform float uDirectionalLightPower;
@@ -12,10 +24,41 @@ uniform vec3 uAmbiantLightColor;
 uniform float uAmbiantLightPower;
 
 // Material
+#ifdef USE_INSTANCE_BUFFER
+#define MAX_MATERIALS 256 // LightRenderer::MaxMaterials
+
+struct MaterialData
+{
+	vec4 ka;
+	vec4 kd;
+	vec4 ksShininess; // specular color in xyz, shininess in w
+};
+
+layout(std140) uniform uMaterialBlock
+{
+	MaterialData uMaterials[MAX_MATERIALS];
+};
+
+flat in int vMaterialIndex;
+#else
 uniform vec3 uKa;
 uniform vec3 uKd;
 uniform vec3 uKs;
 uniform float uShininess;
+#endif
+
+#ifdef USE_KA_TEXTURE
+uniform sampler2D uKaTexture;
+#endif
+#ifdef USE_KD_TEXTURE
+uniform sampler2D uKdTexture;
+#endif
+#ifdef USE_KS_TEXTURE
+uniform sampler2D uKsTexture;
+#endif
+#ifdef USE_NORMAL_TEXTURE
+uniform sampler2D uNormalTexture;
+#endif
 
 // Variable In
 in vec3 vWSPosition;
@@ -26,49 +69,160 @@ in vec2 vTexCoords;
 in vec3 vCSEyeDir;
 
 in vec3 vCSPointLightPos;
-in vec3 vCSPointLightDir;
 
 in vec3 vCSDirectionalLightDir;
 
+#ifdef USE_SPHERE_IMPOSTOR
+flat in vec4 vCSSphere;
+flat in mat3 vSphereRotation;
+flat in vec4 vDepthTerms;
+
+// depth range [0, 1] set with glClipControl, [-1, 1] otherwise
+uniform bool uZeroToOneDepth;
+#endif
+
 // Sorties
 out vec3 fFragColor;
 
-vec3 computeDirectional(vec3 n, vec3 e)
+vec3 computeDirectional(vec3 n, vec3 e, vec3 kd, vec3 ks, float shininess)
 {
 	vec3 l = normalize(-vCSDirectionalLightDir);
 	vec3 r = reflect(-l,n);
 	float cosTheta = clamp(dot(n,l), 0.f, 1.f);
 	float cosAlpha = clamp(dot(e,r), 0.f, 1.f);
 
-	vec3 sensibility = uKd * cosTheta + uKs * pow(cosAlpha, uShininess);
-	vec3 intensity = uPointLightColor * uPointLightPower;
+	vec3 sensibility = kd * cosTheta + ks * pow(cosAlpha, shininess);
+	vec3 intensity = uDirectionalLightColor * uDirectionalLightPower;
 	return intensity * sensibility;
 }
 
-vec3 computePoint(vec3 n, vec3 e)
+vec3 computePoint(vec3 n, vec3 e, vec3 position, vec3 kd, vec3 ks, float shininess)
 {
-	float distanceFL = distance(vCSPosition, vCSPointLightPos); // distance Fragment-Light
+	float distanceFL = distance(position, vCSPointLightPos); // distance Fragment-Light
+#ifdef USE_STEEP_POINT_FALLOFF
+	distanceFL = pow(distanceFL,1.5f);
+#endif
 
-	vec3 l = normalize(-vCSPointLightDir);
+	vec3 l = normalize(vCSPointLightPos - position);
 	vec3 r = reflect(-l,n);
 	float cosTheta = clamp(dot(n,l), 0.f, 1.f);
 	float cosAlpha = clamp(dot(e,r), 0.f, 1.f);
 
-	vec3 sensibility = uKd * cosTheta + uKs * pow(cosAlpha, uShininess);
+	vec3 sensibility = kd * cosTheta + ks * pow(cosAlpha, shininess);
 	vec3 intensity = uPointLightColor * uPointLightPower;
 	return intensity * sensibility / distanceFL;
 }
 
-vec3 computeAmbiant()
+vec3 computeAmbiant(vec3 ka)
+{
+	return ka * uAmbiantLightColor * uAmbiantLightPower;
+}
+
+#ifdef USE_SPHERE_IMPOSTOR
+const float PI = 3.14159265;
+
+// Intersect the ray of the fragment with the sphere and write the depth of the hit point.
+// A missed ray gets the point where it passes closest to the sphere
+vec3 traceSphere(out bool hit)
 {
-	return uKa * uAmbiantLightColor * uAmbiantLightPower;
+	vec3 direction = normalize(vCSPosition);
+	float middle = dot(direction, vCSSphere.xyz);
+	// squared half chord, from the distance of the center to the ray to keep the precision far away
+	vec3 toRay = middle * direction - vCSSphere.xyz;
+	float halfChord2 = vCSSphere.w * vCSSphere.w - dot(toRay, toRay);
+	hit = halfChord2 >= 0;
+	vec3 position = (middle - sqrt(max(halfChord2, 0))) * direction;
+
+	float depth = (vDepthTerms.x * position.z + vDepthTerms.y) / (vDepthTerms.z * position.z + vDepthTerms.w);
+	gl_FragDepth = uZeroToOneDepth ? depth : 0.5 * depth + 0.5;
+	return position;
 }
 
+// Texture coordinates of the point of the unit sphere as on Geometry::sphere,
+// and their derivatives without the jump of u where atan wraps around
+vec2 texCoords;
+vec2 texCoordsDx;
+vec2 texCoordsDy;
+
+void computeSphereTexCoords(vec3 direction)
+{
+	texCoords = vec2(atan(direction.x, direction.z) / (2 * PI) + 0.25,
+					 asin(clamp(direction.y, -1, 1)) / PI + 0.5);
+	float wrapped = fract(texCoords.x + 0.5);
+	texCoordsDx = vec2(dFdx(texCoords.x), dFdx(texCoords.y));
+	texCoordsDy = vec2(dFdy(texCoords.x), dFdy(texCoords.y));
+	if (abs(dFdx(wrapped)) < abs(texCoordsDx.x))
+		texCoordsDx.x = dFdx(wrapped);
+	if (abs(dFdy(wrapped)) < abs(texCoordsDy.x))
+		texCoordsDy.x = dFdy(wrapped);
+}
+
+vec4 sampleTexture(sampler2D t)
+{
+	return textureGrad(t, texCoords, texCoordsDx, texCoordsDy);
+}
+#else
+vec4 sampleTexture(sampler2D t)
+{
+	return texture(t, vTexCoords);
+}
+#endif
+
+#ifdef USE_DEPTH_ONLY
+void main(void)
+{
+#ifdef USE_SPHERE_IMPOSTOR
+	bool hit;
+	traceSphere(hit);
+	if (!hit)
+		discard;
+#endif
+}
+#else
 void main(void)
 {
+#ifdef USE_SPHERE_IMPOSTOR
+	// the missed fragments are discarded last, so that the derivatives use every fragment of the quad
+	bool hit;
+	vec3 position = traceSphere(hit);
+	vec3 n = (position - vCSSphere.xyz) / vCSSphere.w;
+	vec3 e = normalize(-position);
+	computeSphereTexCoords(vSphereRotation * n);
+#else
+	vec3 position = vCSPosition;
 	vec3 n = normalize(vCSNormal);
 	vec3 e = normalize(vCSEyeDir);
-	fFragColor = computeDirectional(n, e) +
-			computeAmbiant() +
-			computePoint(n,e);
+#endif
+
+#ifdef USE_INSTANCE_BUFFER
+	vec3 ka = uMaterials[vMaterialIndex].ka.xyz;
+	vec3 kd = uMaterials[vMaterialIndex].kd.xyz;
+	vec3 ks = uMaterials[vMaterialIndex].ksShininess.xyz;
+	float shininess = uMaterials[vMaterialIndex].ksShininess.w;
+#else
+	vec3 ka = uKa;
+	vec3 kd = uKd;
+	vec3 ks = uKs;
+	float shininess = uShininess;
+#endif
+
+#ifdef USE_KA_TEXTURE
+	ka *= sampleTexture(uKaTexture).xyz;
+#endif
+#ifdef USE_KD_TEXTURE
+	kd *= sampleTexture(uKdTexture).xyz;
+#endif
+#ifdef USE_KS_TEXTURE
+	ks *= sampleTexture(uKsTexture).xyz;
+#endif
+
+	fFragColor = computeDirectional(n,e,kd,ks,shininess) +
+			computeAmbiant(ka) +
+			computePoint(n,e,position,kd,ks,shininess);
+
+#ifdef USE_SPHERE_IMPOSTOR
+	if (!hit)
+		discard;
+#endif
 }
+#endif
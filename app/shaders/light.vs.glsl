@@ -1,18 +1,87 @@
 #version 330
+#ifdef USE_VERTEX_PULLING
+#extension GL_ARB_shader_storage_buffer_object : require
+#extension GL_ARB_shader_draw_parameters : require
+#ifdef USE_PACKED_VERTICES
+#extension GL_ARB_shading_language_packing : require
+#endif
+#endif
+#ifdef USE_MULTI_VIEW
+#extension GL_ARB_shader_viewport_layer_array : require
+#endif
 #ifdef GL_ES
 precision mediump float;
 #endif
 
+// Features (defined at compile time by the renderer, see glimac::ProgramPermutations)
+// USE_INSTANCE_BUFFER : matrices and material index read from per instance attributes
+// rather than from uniforms set before each draw
+// USE_VERTEX_PULLING : with USE_INSTANCE_BUFFER, vertices and instances are fetched
+// from storage buffers by gl_VertexID and gl_InstanceID, the VAO holding only the indices
+// USE_MULTI_VIEW : with USE_VERTEX_PULLING, each instance is drawn once per view,
+// gl_InstanceID selecting the view matrices and the viewport
+// USE_SPHERE_IMPOSTOR : the mesh is a quad whose corners (-1 to 1 in xy) are moved
+// around the unit sphere of the instance, which the fragments ray-trace
+// USE_PACKED_VERTICES : the vertices are Scene::PackedVertex, the positions being quantized
+// in [0, 1] (the model matrix decoding them) and the normals 10_10_10_2
+
+#ifdef USE_VERTEX_PULLING
+#ifdef USE_PACKED_VERTICES
+// Scene::PackedVertex : unorm16 position and padding, snorm 10_10_10_2 normal, half float texture coordinates
+const int VERTEX_STRIDE = 4;
+layout(std430) readonly buffer uVertexBuffer {
+	uint uVertices[];
+};
+#else
+// interleaved glimac::Geometry::Vertex : position, normal, texture coordinates
+const int VERTEX_STRIDE = 8;
+layout(std430) readonly buffer uVertexBuffer {
+	float uVertices[];
+};
+#endif
+
+struct InstanceData {
+	mat4 modelMatrix;
+	vec4 normalMatrix[3]; // world space
+	int materialIndex;
+};
+layout(std430) readonly buffer uInstanceBuffer {
+	InstanceData uInstances[];
+};
+#else
 // Sommets
 layout(location = 0) in vec3 aVertexPosition;
 layout(location = 1) in vec3 aVertexNormal;
 layout(location = 2) in vec2 aVertexTexCoords;
+#endif
 
 // Matrices
+uniform mat4 uVMatrix;
+#ifdef USE_INSTANCE_BUFFER
+#ifndef USE_VERTEX_PULLING
+layout(location = 3) in mat4 aModelMatrix; // locations 3 to 6
+layout(location = 7) in mat3 aNormalMatrix; // locations 7 to 9, world space
+layout(location = 10) in int aMaterialIndex;
+#endif
+
+uniform mat4 uPMatrix;
+
+flat out int vMaterialIndex;
+
+#ifdef USE_MULTI_VIEW
+const int MAX_VIEWS = 4;
+uniform mat4 uVMatrices[MAX_VIEWS];
+uniform mat4 uPMatrices[MAX_VIEWS];
+uniform int uViewCount;
+#endif
+#else
 uniform mat4 uMVPMatrix;
 uniform mat4 uMVMatrix;
-uniform mat4 uVMatrix;
 uniform mat4 uNormalMatrix;
+#ifdef USE_SPHERE_IMPOSTOR
+uniform mat4 uPMatrix;
+#endif
+#endif
 
 // Directional Light
 uniform vec3 uDirectionalLightDir;
@@ -22,6 +91,8 @@ uniform vec3 uPointLightPos;
 
 
 // Sorties
+// the depth prepass and the shading permutations must compute the same depths
+invariant gl_Position;
 out vec3 vWSPosition;
 out vec3 vCSPosition;
 out vec3 vCSNormal;
@@ -30,24 +101,112 @@ out vec2 vTexCoords;
 out vec3 vCSEyeDir;
 
 out vec3 vCSPointLightPos;
-out vec3 vCSPointLightDir;
 
 out vec3 vCSDirectionalLightDir;
 
+#ifdef USE_SPHERE_IMPOSTOR
+flat out vec4 vCSSphere; // center in xyz, radius in w
+flat out mat3 vSphereRotation; // view space to model space
+flat out vec4 vDepthTerms; // third and fourth rows of the projection, for z and w
+#endif
+
 void main() {
-		vec4 aVertexPosition = vec4(aVertexPosition, 1);
-		vec4 aVertexNormal = vec4(aVertexNormal, 0);
+#ifdef USE_MULTI_VIEW
+		int view = gl_InstanceID % uViewCount;
+		int instanceId = gl_InstanceID / uViewCount;
+		mat4 viewMatrix = uVMatrices[view];
+		mat4 projMatrix = uPMatrices[view];
+		gl_ViewportIndex = view;
+#else
+		int instanceId = gl_InstanceID;
+		mat4 viewMatrix = uVMatrix;
+#ifdef USE_INSTANCE_BUFFER
+		mat4 projMatrix = uPMatrix;
+#endif
+#endif
 
-		vCSPosition = vec3(uMVMatrix*aVertexPosition);
-		vCSNormal = vec3(uNormalMatrix*aVertexNormal);
+#ifdef USE_VERTEX_PULLING
+		int v = gl_VertexID * VERTEX_STRIDE;
+#ifdef USE_PACKED_VERTICES
+		vec4 vertexPosition = vec4(unpackUnorm2x16(uVertices[v]), unpackUnorm2x16(uVertices[v+1]).x, 1);
+		// the shifts extend the sign of each 10 bits component
+		uint normal = uVertices[v+2];
+		ivec3 normalBits = ivec3(int(normal << 22u), int(normal << 12u), int(normal << 2u)) >> 22;
+		vec4 vertexNormal = vec4(max(vec3(normalBits) / 511.0, -1.0), 0);
+		vec2 vertexTexCoords = unpackHalf2x16(uVertices[v+3]);
+#else
+		vec4 vertexPosition = vec4(uVertices[v], uVertices[v+1], uVertices[v+2], 1);
+		vec4 vertexNormal = vec4(uVertices[v+3], uVertices[v+4], uVertices[v+5], 0);
+		vec2 vertexTexCoords = vec2(uVertices[v+6], uVertices[v+7]);
+#endif
 
-		vCSEyeDir = vec3(0,0,0) - vCSPosition;
-		vTexCoords = aVertexTexCoords;
+		// gl_InstanceID doesn't include the base instance of the draw
+		InstanceData instance = uInstances[gl_BaseInstanceARB + instanceId];
+		mat4 modelMatrix = instance.modelMatrix;
+		mat3 normalMatrix = mat3(instance.normalMatrix[0].xyz, instance.normalMatrix[1].xyz,
+								 instance.normalMatrix[2].xyz);
+		int materialIndex = instance.materialIndex;
+#else
+		vec4 vertexPosition = vec4(aVertexPosition, 1);
+		vec4 vertexNormal = vec4(aVertexNormal, 0);
+		vec2 vertexTexCoords = aVertexTexCoords;
+#ifdef USE_INSTANCE_BUFFER
+		mat4 modelMatrix = aModelMatrix;
+		mat3 normalMatrix = aNormalMatrix;
+		int materialIndex = aMaterialIndex;
+#endif
+#endif
+
+#ifdef USE_SPHERE_IMPOSTOR
+#ifdef USE_INSTANCE_BUFFER
+		mat4 MVMatrix = viewMatrix * modelMatrix;
+		vMaterialIndex = materialIndex;
+#else
+		mat4 MVMatrix = uMVMatrix;
+		mat4 projMatrix = uPMatrix;
+#endif
+		// the scale is uniform, the radius is the length of any axis
+		vec3 center = MVMatrix[3].xyz;
+		float radius = length(MVMatrix[0].xyz);
+		vCSSphere = vec4(center, radius);
+		vSphereRotation = transpose(mat3(MVMatrix) / radius);
+		vDepthTerms = vec4(projMatrix[2][2], projMatrix[3][2], projMatrix[2][3], projMatrix[3][3]);
 
-		vCSPointLightPos = vec3(uVMatrix * vec4(uPointLightPos, 1));
-		vCSPointLightDir = vCSPosition - vCSPointLightPos;
+		// the cone from the eye tangent to the sphere touches it along a circle:
+		// the square around this circle in its plane covers the whole silhouette
+		float distanceToCenter = length(center);
+		vec3 axis = center / distanceToCenter;
+		vec3 right = normalize(cross(axis, abs(axis.y) < 0.99 ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+		vec3 up = cross(right, axis);
+		float tangentLength = sqrt(max(distanceToCenter * distanceToCenter - radius * radius, 0));
+		vec3 circleCenter = axis * (tangentLength * tangentLength / distanceToCenter);
+		float circleRadius = radius * tangentLength / distanceToCenter;
+#ifdef USE_PACKED_VERTICES
+		// the quad fills the box of its quantized positions
+		vec2 corner = vertexPosition.xy * 2.0 - 1.0;
+#else
+		vec2 corner = vertexPosition.xy;
+#endif
+		vCSPosition = circleCenter + circleRadius * (corner.x * right + corner.y * up);
+		vCSNormal = -axis;
+		gl_Position = projMatrix*vec4(vCSPosition, 1);
+#elif defined(USE_INSTANCE_BUFFER)
+		mat4 MVMatrix = viewMatrix * modelMatrix;
+		vCSPosition = vec3(MVMatrix*vertexPosition);
+		// the view matrix is a rigid transformation, it can rotate normals as is
+		vCSNormal = mat3(viewMatrix) * (normalMatrix * vertexNormal.xyz);
+		vMaterialIndex = materialIndex;
+		gl_Position = projMatrix*vec4(vCSPosition, 1);
+#else
+		vCSPosition = vec3(uMVMatrix*vertexPosition);
+		vCSNormal = vec3(uNormalMatrix*vertexNormal);
+		gl_Position = uMVPMatrix*vertexPosition;
+#endif
+
+		vCSEyeDir = vec3(0,0,0) - vCSPosition;
+		vTexCoords = vertexTexCoords;
 
-		vCSDirectionalLightDir = vec3(uVMatrix * vec4(uDirectionalLightDir, 0));
+		vCSPointLightPos = vec3(viewMatrix * vec4(uPointLightPos, 1));
 
-		gl_Position = uMVPMatrix*aVertexPosition;
+		vCSDirectionalLightDir = vec3(viewMatrix * vec4(uDirectionalLightDir, 0));
 }
@@ -0,0 +1,14 @@
+#version 330
+#ifdef GL_ES
+precision mediump float;
+#endif
+
+in vec4 vColor;
+
+// premultiplied by the coverage in alpha
+out vec4 fFragColor;
+
+void main()
+{
+	fFragColor = vColor;
+}
@@ -0,0 +1,67 @@
+#version 330
+#ifdef GL_ES
+precision mediump float;
+#endif
+
+// Bodies smaller than a pixel, each one drawn as a single pixel receiving the light
+// its disc reflects, with the lights of light.fs.glsl
+// USE_STEEP_POINT_FALLOFF : the point light falls off with the distance to the power 1.5,
+// as in light.fs.glsl
+
+// Sommets (LightRenderer::PointSprite)
+layout(location = 0) in vec4 aSphere; // world center in xyz, radius in w
+layout(location = 1) in vec3 aKd;
+layout(location = 2) in vec3 aKa;
+
+// Matrices
+uniform mat4 uVMatrix;
+uniform mat4 uPMatrix;
+// pixels covered by a world unit at distance 1
+uniform float uPixelScale;
+
+// Lights
+uniform vec3 uDirectionalLightDir;
+uniform vec3 uDirectionalLightColor;
+uniform float uDirectionalLightPower;
+uniform vec3 uPointLightPos;
+uniform vec3 uPointLightColor;
+uniform float uPointLightPower;
+uniform vec3 uAmbiantLightColor;
+uniform float uAmbiantLightPower;
+
+// Sorties
+out vec4 vColor;
+
+const float PI = 3.14159265;
+
+// Mean of the diffuse cosine over the visible disc of a sphere lit from l and seen from e
+// (Lambert phase function, 2/3 when the whole disc is lit)
+float phase(vec3 e, vec3 l)
+{
+	float cosAlpha = clamp(dot(e, l), -1, 1);
+	float alpha = acos(cosAlpha);
+	return 2.0 / 3.0 * (sin(alpha) + (PI - alpha) * cosAlpha) / PI;
+}
+
+void main()
+{
+	vec3 eye = -transpose(mat3(uVMatrix)) * uVMatrix[3].xyz;
+	vec3 toEye = eye - aSphere.xyz;
+	vec3 e = normalize(toEye);
+
+	vec3 toLight = uPointLightPos - aSphere.xyz;
+	float distanceFL = length(toLight);
+#ifdef USE_STEEP_POINT_FALLOFF
+	distanceFL = pow(distanceFL, 1.5f);
+#endif
+	vec3 color = aKa * uAmbiantLightColor * uAmbiantLightPower
+			+ aKd * uPointLightColor * uPointLightPower * phase(e, normalize(toLight)) / distanceFL
+			+ aKd * uDirectionalLightColor * uDirectionalLightPower * phase(e, normalize(-uDirectionalLightDir));
+
+	// the part of the pixel covered by the disc blends the color over the background
+	float radius = uPixelScale * aSphere.w / length(toEye);
+	float coverage = min(PI * radius * radius, 1);
+	vColor = vec4(color * coverage, coverage);
+
+	gl_Position = uPMatrix * uVMatrix * vec4(aSphere.xyz, 1);
+}
@@ -12,9 +12,16 @@ out vec3 vTexCoords;
 
 // Matrices
 uniform mat4 uMVPMatrix;
+// packed positions to model space (Mesh::positionDecode), identity with float vertices
+uniform mat4 uPositionDecode;
+// depth of the far plane: 1, or 0 with reverse-Z
+uniform float uFarDepth;
 
 void main()
 {
-	vTexCoords = aVertexPosition;
-	gl_Position = uMVPMatrix*vec4(aVertexPosition, 1.0f);
+	// the direction of the cube map is the position in the model space of the cube
+	vTexCoords = vec3(uPositionDecode * vec4(aVertexPosition, 1));
+	// z = w * uFarDepth so that the sky lies on the far plane, behind everything
+	vec4 position = uMVPMatrix*vec4(aVertexPosition, 1.0f);
+	gl_Position = vec4(position.xy, position.w * uFarDepth, position.w);
 }
@@ -0,0 +1,328 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+const uint BinCount = 16;
+
+glimac::BBox3f emptyBox()
+{
+	return glimac::BBox3f(glm::vec3(std::numeric_limits<float>::max()),
+						  glm::vec3(-std::numeric_limits<float>::max()));
+}
+
+}
+
+bool BVH::Node::isLeaf() const
+{
+	return item >= 0;
+}
+
+BVH::BVH()
+	: root(-1), builtCost(0), builds(0)
+{}
+
+void BVH::clear()
+{
+	nodes.clear();
+	leaves.clear();
+	root = -1;
+	builtCost = 0;
+}
+
+void BVH::build(const std::vector<glimac::BBox3f>& bounds)
+{
+	clear();
+	leaves.assign(bounds.size(), -1);
+	if (bounds.empty())
+		return;
+	nodes.reserve(2 * bounds.size() - 1);
+	buildItems.resize(bounds.size());
+	std::iota(buildItems.begin(), buildItems.end(), 0);
+	buildCentroids.resize(bounds.size());
+	for (size_t i = 0; i < bounds.size(); ++i)
+		buildCentroids[i] = glimac::center(bounds[i]);
+	root = buildRange(bounds, 0, bounds.size(), -1);
+	builtCost = cost();
+	++builds;
+}
+
+/**
+ * The items are binned by the centroid along the axis where the centroids spread the most,
+ * and split between the bins where the areas of both sides weighted by their item count
+ * are the lowest
+ */
+int BVH::buildRange(const std::vector<glimac::BBox3f>& bounds, uint first, uint last, int parent)
+{
+	if (last - first == 1)
+		return makeLeaf(buildItems[first], bounds[buildItems[first]], parent);
+
+	glimac::BBox3f centroidBounds(buildCentroids[buildItems[first]]);
+	for (uint i = first + 1; i < last; ++i)
+		centroidBounds.grow(buildCentroids[buildItems[i]]);
+	glm::vec3 extent = centroidBounds.size();
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+	uint middle = first + (last - first) / 2;
+	if (extent[axis] > 0)
+	{
+		float lower = centroidBounds.lower[axis];
+		float binScale = BinCount / extent[axis];
+		auto binOf = [&](uint item)
+		{
+			return std::min(BinCount - 1, uint((buildCentroids[item][axis] - lower) * binScale));
+		};
+
+		glimac::BBox3f binBounds[BinCount];
+		uint binCounts[BinCount];
+		std::fill(binBounds, binBounds + BinCount, emptyBox());
+		std::fill(binCounts, binCounts + BinCount, 0);
+		for (uint i = first; i < last; ++i)
+		{
+			uint bin = binOf(buildItems[i]);
+			binBounds[bin].grow(bounds[buildItems[i]]);
+			++binCounts[bin];
+		}
+
+		// weighted area of the bins from b to the last one
+		float rightCosts[BinCount];
+		glimac::BBox3f side = emptyBox();
+		uint sideCount = 0;
+		for (uint b = BinCount - 1; b > 0; --b)
+		{
+			side.grow(binBounds[b]);
+			sideCount += binCounts[b];
+			rightCosts[b] = sideCount ? area(side) * sideCount : 0;
+		}
+		side = emptyBox();
+		sideCount = 0;
+		float bestCost = std::numeric_limits<float>::max();
+		uint bestSplit = 0;
+		for (uint b = 1; b < BinCount; ++b)
+		{
+			side.grow(binBounds[b - 1]);
+			sideCount += binCounts[b - 1];
+			if (sideCount == 0 || sideCount == last - first)
+				continue;
+			float splitCost = area(side) * sideCount + rightCosts[b];
+			if (splitCost < bestCost)
+			{
+				bestCost = splitCost;
+				bestSplit = b;
+			}
+		}
+		if (bestSplit > 0)
+			middle = std::partition(buildItems.begin() + first, buildItems.begin() + last,
+									[&](uint item) { return binOf(item) < bestSplit; })
+					 - buildItems.begin();
+	}
+
+	int node = nodes.size();
+	nodes.push_back(Node{emptyBox(), parent, -1, -1, -1});
+	int left = buildRange(bounds, first, middle, node);
+	int right = buildRange(bounds, middle, last, node);
+	nodes[node].left = left;
+	nodes[node].right = right;
+	nodes[node].bounds = glimac::merge(nodes[left].bounds, nodes[right].bounds);
+	return node;
+}
+
+int BVH::makeLeaf(uint item, const glimac::BBox3f& bounds, int parent)
+{
+	int leaf = nodes.size();
+	nodes.push_back(Node{bounds, parent, -1, -1, int(item)});
+	leaves[item] = leaf;
+	return leaf;
+}
+
+/**
+ * Descend from the root to the node whose sibling the leaf becomes, paying at each level
+ * the area the leaf adds to the node (Goldsmith and Salmon)
+ */
+void BVH::insert(uint item, const glimac::BBox3f& bounds)
+{
+	leaves.push_back(-1);
+	int leaf = makeLeaf(item, bounds, -1);
+	if (root < 0)
+	{
+		root = leaf;
+		return;
+	}
+
+	int sibling = root;
+	while (!nodes[sibling].isLeaf())
+	{
+		const Node& node = nodes[sibling];
+		float mergedArea = area(glimac::merge(node.bounds, bounds));
+		// a new parent of the node and the leaf, or the growth of the node and one of its children
+		float parentCost = 2 * mergedArea;
+		float inheritedCost = 2 * (mergedArea - area(node.bounds));
+		float childCosts[2];
+		int children[2] = {node.left, node.right};
+		for (int c = 0; c < 2; ++c)
+		{
+			const Node& child = nodes[children[c]];
+			float childArea = area(glimac::merge(child.bounds, bounds));
+			childCosts[c] = inheritedCost + (child.isLeaf() ? childArea : childArea - area(child.bounds));
+		}
+		if (parentCost < childCosts[0] && parentCost < childCosts[1])
+			break;
+		sibling = childCosts[0] < childCosts[1] ? children[0] : children[1];
+	}
+
+	int oldParent = nodes[sibling].parent;
+	int parent = nodes.size();
+	nodes.push_back(Node{glimac::merge(nodes[sibling].bounds, bounds), oldParent, sibling, leaf, -1});
+	nodes[sibling].parent = parent;
+	nodes[leaf].parent = parent;
+	if (oldParent < 0)
+		root = parent;
+	else if (nodes[oldParent].left == sibling)
+		nodes[oldParent].left = parent;
+	else
+		nodes[oldParent].right = parent;
+	refitAncestors(oldParent);
+}
+
+void BVH::refitAncestors(int node)
+{
+	for (; node >= 0; node = nodes[node].parent)
+		nodes[node].bounds = glimac::merge(nodes[nodes[node].left].bounds, nodes[nodes[node].right].bounds);
+}
+
+/**
+ * The nodes are updated in reverse pre-order, every child before its parent,
+ * the rotations only moving nodes of the subtree already updated (Kopta et al.)
+ */
+bool BVH::refit(const std::vector<glimac::BBox3f>& bounds)
+{
+	if (root < 0)
+		return false;
+
+	refitOrder.clear();
+	stack.clear();
+	stack.push_back(root);
+	while (!stack.empty())
+	{
+		int node = stack.back();
+		stack.pop_back();
+		refitOrder.push_back(node);
+		if (!nodes[node].isLeaf())
+		{
+			stack.push_back(nodes[node].left);
+			stack.push_back(nodes[node].right);
+		}
+	}
+	for (std::vector<int>::const_reverse_iterator i = refitOrder.rbegin(); i != refitOrder.rend(); ++i)
+	{
+		Node& node = nodes[*i];
+		if (node.isLeaf())
+			node.bounds = bounds[node.item];
+		else
+		{
+			node.bounds = glimac::merge(nodes[node.left].bounds, nodes[node.right].bounds);
+			rotate(*i);
+		}
+	}
+
+	if (cost() > RebuildRatio * builtCost)
+	{
+		build(bounds);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Swapping a child with a grandchild keeps the box of the node and changes the one of the
+ * other child: the swap which shrinks it the most is applied
+ */
+void BVH::rotate(int node)
+{
+	int children[2] = {nodes[node].left, nodes[node].right};
+	float bestGain = 0;
+	int bestChild = -1;
+	int bestGrandchild = -1;
+	for (int c = 0; c < 2; ++c)
+	{
+		const Node& other = nodes[children[1 - c]];
+		if (other.isLeaf())
+			continue;
+		float otherArea = area(other.bounds);
+		int grandchildren[2] = {other.left, other.right};
+		for (int g = 0; g < 2; ++g)
+		{
+			// the grandchild g moves up, the child c takes its place beside the other grandchild
+			float gain = otherArea - area(glimac::merge(nodes[children[c]].bounds,
+														 nodes[grandchildren[1 - g]].bounds));
+			if (gain > bestGain)
+			{
+				bestGain = gain;
+				bestChild = children[c];
+				bestGrandchild = grandchildren[g];
+			}
+		}
+	}
+	if (bestChild < 0)
+		return;
+
+	int other = nodes[bestGrandchild].parent;
+	if (nodes[node].left == bestChild)
+		nodes[node].left = bestGrandchild;
+	else
+		nodes[node].right = bestGrandchild;
+	nodes[bestGrandchild].parent = node;
+	if (nodes[other].left == bestGrandchild)
+		nodes[other].left = bestChild;
+	else
+		nodes[other].right = bestChild;
+	nodes[bestChild].parent = other;
+	nodes[other].bounds = glimac::merge(nodes[nodes[other].left].bounds, nodes[nodes[other].right].bounds);
+}
+
+uint BVH::itemCount() const
+{
+	return leaves.size();
+}
+
+float BVH::cost() const
+{
+	if (root < 0)
+		return 0;
+	float rootArea = area(nodes[root].bounds);
+	if (rootArea <= 0)
+		return 0;
+	float sum = 0;
+	for (const Node& node : nodes)
+	{
+		if (!node.isLeaf())
+			sum += area(node.bounds);
+	}
+	return sum / rootArea;
+}
+
+uint BVH::buildCount() const
+{
+	return builds;
+}
+
+float BVH::intersectRay(const glimac::BBox3f& box, const glm::vec3& origin,
+						const glm::vec3& inverseDirection, float maxDistance)
+{
+	glm::vec3 t0 = (box.lower - origin) * inverseDirection;
+	glm::vec3 t1 = (box.upper - origin) * inverseDirection;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+	float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.f));
+	float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+	return enter <= exit ? enter : -1.f;
+}
+
+float BVH::area(const glimac::BBox3f& box)
+{
+	glm::vec3 size = box.size();
+	return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
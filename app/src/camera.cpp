@@ -5,7 +5,7 @@
 #include "glm/gtx/euler_angles.hpp"
 
 BaseCamera::BaseCamera()
-	: FoV(70), near(0.1), far(100)
+	: FoV(70), near(0.1), far(100), reverseZ(false)
 {}
 
 void BaseCamera::handleEvent(const SDL_Event &e)
@@ -21,7 +21,17 @@ glm::mat4 BaseCamera::getViewMatrix() const
 
 glm::mat4 BaseCamera::getProjectionMatrix(float viewWidth, float viewHeight) const
 {
-	return glm::perspective(glm::radians(FoV), viewWidth / viewHeight, near, far);
+	if (!reverseZ)
+		return glm::perspective(glm::radians(FoV), viewWidth / viewHeight, near, far);
+
+	// clip z = near and clip w = -z_view: depth = near / distance, 1 on the near plane
+	float f = 1.f / glm::tan(glm::radians(FoV) / 2.f);
+	glm::mat4 projection(0.f);
+	projection[0][0] = f * viewHeight / viewWidth;
+	projection[1][1] = f;
+	projection[2][3] = -1.f;
+	projection[3][2] = near;
+	return projection;
 }
 
 OrbitalCamera::OrbitalCamera()
@@ -117,3 +127,16 @@ glm::mat4 OrbitalCamera::getViewMatrix() const
 
 	return glm::lookAt(eye,target,up);
 }
+
+FixedCamera::FixedCamera()
+	: viewMatrix(1.f)
+{}
+
+FixedCamera::FixedCamera(const BaseCamera &camera)
+	: BaseCamera(camera), viewMatrix(camera.getViewMatrix())
+{}
+
+glm::mat4 FixedCamera::getViewMatrix() const
+{
+	return viewMatrix;
+}
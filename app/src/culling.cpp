@@ -0,0 +1,203 @@
+#include "culling.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+SphereSoA::SphereSoA()
+	: count(0)
+{}
+
+void SphereSoA::resize(size_t count)
+{
+	this->count = count;
+	size_t padded = (count + FrustumCuller::Batch - 1) / FrustumCuller::Batch * FrustumCuller::Batch;
+	x.resize(padded, 0);
+	y.resize(padded, 0);
+	z.resize(padded, 0);
+	radius.resize(padded, 0);
+}
+
+void SphereSoA::set(size_t i, const glm::vec3 &center, float radius)
+{
+	x[i] = center.x;
+	y[i] = center.y;
+	z[i] = center.z;
+	this->radius[i] = radius;
+}
+
+glm::vec3 SphereSoA::center(size_t i) const
+{
+	return glm::vec3(x[i], y[i], z[i]);
+}
+
+void FrustumCuller::clear()
+{
+	planes.clear();
+}
+
+/**
+ * Planes extracted from the rows of the matrix (Gribb and Hartmann):
+ * a clip space point is inside when -w <= x <= w, -w <= y <= w and -w <= z <= w,
+ * or 0 <= z <= w with a [0, 1] depth range
+ */
+void FrustumCuller::addFrustum(const glm::mat4 &viewProjMatrix, bool zeroToOne)
+{
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; ++i)
+		rows[i] = glm::vec4(viewProjMatrix[0][i], viewProjMatrix[1][i], viewProjMatrix[2][i], viewProjMatrix[3][i]);
+
+	glm::vec4 frustum[6] = {
+		rows[3] + rows[0],
+		rows[3] - rows[0],
+		rows[3] + rows[1],
+		rows[3] - rows[1],
+		zeroToOne ? rows[2] : rows[3] + rows[2],
+		rows[3] - rows[2]
+	};
+	for (glm::vec4& plane : frustum)
+	{
+		float length = glm::length(glm::vec3(plane));
+		if (length > 0)
+			plane /= length;
+		planes.push_back(plane);
+	}
+}
+
+size_t FrustumCuller::frustumCount() const
+{
+	return planes.size() / 6;
+}
+
+bool FrustumCuller::isVisible(const glm::vec3 &center, float radius) const
+{
+	for (size_t f = 0; f < planes.size(); f += 6)
+	{
+		bool inside = true;
+		for (size_t p = f; p < f + 6 && inside; ++p)
+			inside = glm::dot(glm::vec3(planes[p]), center) + planes[p].w >= -radius;
+		if (inside)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * The distance of the center to each plane is compared to the projection of the half size
+ * of the box on the normal of the plane
+ */
+BVH::Overlap FrustumCuller::classify(const glimac::BBox3f &box) const
+{
+	glm::vec3 center = glimac::center(box);
+	glm::vec3 extent = 0.5f * box.size();
+	BVH::Overlap overlap = BVH::Outside;
+	for (size_t f = 0; f < planes.size(); f += 6)
+	{
+		BVH::Overlap frustumOverlap = BVH::Contains;
+		for (size_t p = f; p < f + 6 && frustumOverlap != BVH::Outside; ++p)
+		{
+			glm::vec3 normal(planes[p]);
+			float distance = glm::dot(normal, center) + planes[p].w;
+			float reach = glm::dot(glm::abs(normal), extent);
+			if (distance < -reach)
+				frustumOverlap = BVH::Outside;
+			else if (distance < reach)
+				frustumOverlap = BVH::Intersects;
+		}
+		if (frustumOverlap == BVH::Contains)
+			return BVH::Contains;
+		if (frustumOverlap == BVH::Intersects)
+			overlap = BVH::Intersects;
+	}
+	return overlap;
+}
+
+/**
+ * Each batch computes the signed distances of its spheres to a plane at once,
+ * a sphere being outside when it is below -radius for any plane of every frustum.
+ * The lanes of the padding are dropped when the mask is read
+ */
+void FrustumCuller::cull(const SphereSoA &spheres, std::vector<uint> &visible) const
+{
+	visible.clear();
+#if defined(__AVX__)
+	const size_t lanes = 8;
+	for (size_t i = 0; i < spheres.count; i += lanes)
+	{
+		__m256 x = _mm256_loadu_ps(&spheres.x[i]);
+		__m256 y = _mm256_loadu_ps(&spheres.y[i]);
+		__m256 z = _mm256_loadu_ps(&spheres.z[i]);
+		__m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&spheres.radius[i]));
+		__m256 any = _mm256_setzero_ps();
+		for (size_t f = 0; f < planes.size(); f += 6)
+		{
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (size_t p = f; p < f + 6; ++p)
+			{
+				__m256 distance = _mm256_add_ps(
+							_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(planes[p].x)),
+										  _mm256_mul_ps(y, _mm256_set1_ps(planes[p].y))),
+							_mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(planes[p].z)),
+										  _mm256_set1_ps(planes[p].w)));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+			}
+			any = _mm256_or_ps(any, inside);
+		}
+		for (int mask = _mm256_movemask_ps(any); mask; mask &= mask - 1)
+		{
+			size_t k = i + __builtin_ctz(mask);
+			if (k < spheres.count)
+				visible.push_back(k);
+		}
+	}
+#elif defined(__SSE__)
+	const size_t lanes = 4;
+	for (size_t i = 0; i < spheres.count; i += lanes)
+	{
+		__m128 x = _mm_loadu_ps(&spheres.x[i]);
+		__m128 y = _mm_loadu_ps(&spheres.y[i]);
+		__m128 z = _mm_loadu_ps(&spheres.z[i]);
+		__m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+		__m128 any = _mm_setzero_ps();
+		for (size_t f = 0; f < planes.size(); f += 6)
+		{
+			__m128 inside = _mm_cmpeq_ps(x, x);
+			for (size_t p = f; p < f + 6; ++p)
+			{
+				__m128 distance = _mm_add_ps(
+							_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p].x)),
+									   _mm_mul_ps(y, _mm_set1_ps(planes[p].y))),
+							_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p].z)),
+									   _mm_set1_ps(planes[p].w)));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+			}
+			any = _mm_or_ps(any, inside);
+		}
+		for (int mask = _mm_movemask_ps(any); mask; mask &= mask - 1)
+		{
+			size_t k = i + __builtin_ctz(mask);
+			if (k < spheres.count)
+				visible.push_back(k);
+		}
+	}
+#else
+	for (size_t i = 0; i < spheres.count; ++i)
+	{
+		if (isVisible(spheres.center(i), spheres.radius[i]))
+			visible.push_back(i);
+	}
+#endif
+}
+
+const char* FrustumCuller::instructionSet()
+{
+#if defined(__AVX__)
+	return "AVX";
+#elif defined(__SSE__)
+	return "SSE";
+#else
+	return "scalar";
+#endif
+}
@@ -0,0 +1,101 @@
+#include "dynamicresolution.h"
+
+#include <algorithm>
+#include <cmath>
+
+DynamicResolution::DynamicResolution()
+	: enabled(true), minScale(0.5f), maxScale(1.f), targetFrameTime(25.f),
+	  m_scale(1.f), m_frameTime(0), frameSamples(0), frame(0)
+{
+	std::fill(pending, pending + QueryCount, false);
+	queries[0][0] = 0;
+}
+
+DynamicResolution::~DynamicResolution()
+{
+	if (queries[0][0])
+		glDeleteQueries(QueryCount * 2, &queries[0][0]);
+}
+
+void DynamicResolution::setEnabled(bool enabled)
+{
+	this->enabled = enabled;
+}
+
+bool DynamicResolution::isEnabled() const
+{
+	return enabled;
+}
+
+void DynamicResolution::setBounds(float minScale, float maxScale)
+{
+	this->minScale = minScale;
+	this->maxScale = std::max(minScale, maxScale);
+	m_scale = glm::clamp(m_scale, this->minScale, this->maxScale);
+}
+
+void DynamicResolution::setTargetFrameTime(float frameTime)
+{
+	targetFrameTime = frameTime;
+}
+
+float DynamicResolution::scale() const
+{
+	return enabled ? m_scale : 1.f;
+}
+
+float DynamicResolution::frameTime() const
+{
+	return m_frameTime;
+}
+
+void DynamicResolution::beginFrame()
+{
+	if (!queries[0][0])
+		glGenQueries(QueryCount * 2, &queries[0][0]);
+
+	// read the frame which used this slot, QueryCount frames ago
+	uint slot = frame % QueryCount;
+	if (pending[slot])
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(queries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint64 start, end;
+			glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &start);
+			glGetQueryObjectui64v(queries[slot][1], GL_QUERY_RESULT, &end);
+			float time = (end - start) * 1e-6f;
+			m_frameTime = frameSamples ? m_frameTime * 0.8f + time * 0.2f : time;
+			++frameSamples;
+		}
+	}
+	glQueryCounter(queries[slot][0], GL_TIMESTAMP);
+}
+
+void DynamicResolution::endFrame()
+{
+	uint slot = frame % QueryCount;
+	glQueryCounter(queries[slot][1], GL_TIMESTAMP);
+	pending[slot] = true;
+	++frame;
+	if (frame % AdjustPeriod == 0)
+		adjust();
+}
+
+void DynamicResolution::adjust()
+{
+	if (!enabled || frameSamples < AdjustPeriod)
+		return;
+
+	// the pixel count goes with the square of the scale
+	float scale = m_scale * std::sqrt(targetFrameTime / std::max(m_frameTime, 0.01f));
+	scale = std::floor(scale / ScaleStep) * ScaleStep;
+	scale = glm::clamp(scale, minScale, maxScale);
+	if (scale != m_scale)
+	{
+		// expected time at the new scale, until new samples come
+		m_frameTime *= (scale * scale) / (m_scale * m_scale);
+		m_scale = scale;
+	}
+}
@@ -0,0 +1,209 @@
+#include "meshlet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace {
+
+/**
+ * @return true if every edge of a triangle is the edge of another one going the other way,
+ * the vertices at the same position being the same (the texture seams split them)
+ */
+bool isClosed(const glimac::Geometry::Vertex* vertices, const unsigned int* index, uint indexCount,
+			  uint vertexRange)
+{
+	std::vector<uint> sorted(index, index + indexCount);
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+	auto lessPosition = [vertices](uint a, uint b)
+	{
+		const glm::vec3& p = vertices[a].m_Position;
+		const glm::vec3& q = vertices[b].m_Position;
+		return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z < q.z;
+	};
+	std::sort(sorted.begin(), sorted.end(), lessPosition);
+	std::vector<uint> welded(vertexRange);
+	for (size_t k = 0; k < sorted.size(); ++k)
+		welded[sorted[k]] = k > 0 && !lessPosition(sorted[k - 1], sorted[k]) ? welded[sorted[k - 1]] : sorted[k];
+
+	std::vector<uint64_t> edges;
+	edges.reserve(indexCount);
+	for (uint j = 0; j + 2 < indexCount; j += 3)
+	{
+		for (uint e = 0; e < 3; ++e)
+		{
+			uint a = welded[index[j + e]], b = welded[index[j + (e + 1) % 3]];
+			if (a != b)
+				edges.push_back(uint64_t(a) << 32 | b);
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+	for (uint64_t edge : edges)
+	{
+		if (!std::binary_search(edges.begin(), edges.end(), edge << 32 | edge >> 32))
+			return false;
+	}
+	return !edges.empty();
+}
+
+/**
+ * Bounding sphere centered on the box of the vertices, and cone of the normals.
+ * A triangle faces away from the eye when the eye is behind its plane: for the triangles whose
+ * normals are within the angle a of the axis, this holds for every point of the sphere when
+ * the direction to the eye makes an angle greater than 90° + a with the axis,
+ * cos(90° + a) being -sin(a) (Zeux, meshoptimizer)
+ */
+void computeBounds(const glimac::Geometry::Vertex* vertices, const unsigned int* index, bool cullable,
+				   Meshlet& meshlet)
+{
+	glimac::BBox3f bbox(glm::vec3(std::numeric_limits<float>::max()), glm::vec3(-std::numeric_limits<float>::max()));
+	for (uint j = 0; j < meshlet.indexCount; ++j)
+		bbox.grow(vertices[index[j]].m_Position);
+	meshlet.center = glimac::center(bbox);
+	meshlet.radius = 0;
+	for (uint j = 0; j < meshlet.indexCount; ++j)
+		meshlet.radius = std::max(meshlet.radius, glm::length(vertices[index[j]].m_Position - meshlet.center));
+
+	std::vector<glm::vec3> normals;
+	glm::vec3 sum(0);
+	for (uint j = 0; j + 2 < meshlet.indexCount; j += 3)
+	{
+		const glm::vec3& a = vertices[index[j]].m_Position;
+		glm::vec3 normal = glm::cross(vertices[index[j + 1]].m_Position - a, vertices[index[j + 2]].m_Position - a);
+		float length = glm::length(normal);
+		if (length <= 0)
+			continue;
+		normals.push_back(normal / length);
+		sum += normals.back();
+	}
+	meshlet.coneAxis = glm::vec3(0);
+	meshlet.coneCutoff = 1;
+	if (!cullable || glm::length(sum) <= 0)
+		return;
+	glm::vec3 axis = glm::normalize(sum);
+	float minDot = 1;
+	for (const glm::vec3& normal : normals)
+		minDot = std::min(minDot, glm::dot(normal, axis));
+	// beyond 90°, the eye is in front of a triangle wherever the cluster is seen from
+	if (minDot <= 0)
+		return;
+	meshlet.coneAxis = axis;
+	meshlet.coneCutoff = std::sqrt(1 - minDot * minDot);
+}
+
+}
+
+bool Meshlet::isBackFacing(const glm::vec3& eye) const
+{
+	glm::vec3 direction = center - eye;
+	return glm::dot(direction, coneAxis) >= coneCutoff * glm::length(direction) + radius;
+}
+
+/**
+ * The triangles around each vertex are listed once, the candidates of a meshlet being those
+ * around its vertices. A meshlet starts from the first triangle left, in the mesh order
+ */
+void buildMeshlets(const glimac::Geometry::Vertex* vertices, const unsigned int* index, uint indexCount,
+				   std::vector<unsigned int>& meshletIndex, std::vector<Meshlet>& meshlets)
+{
+	uint triangleCount = indexCount / 3;
+	uint vertexRange = 0;
+	for (uint j = 0; j < triangleCount * 3; ++j)
+		vertexRange = std::max(vertexRange, index[j] + 1);
+	bool cullable = isClosed(vertices, index, triangleCount * 3, vertexRange);
+
+	std::vector<uint> firstTriangle(vertexRange + 1, 0);
+	for (uint j = 0; j < triangleCount * 3; ++j)
+		++firstTriangle[index[j] + 1];
+	for (uint v = 0; v < vertexRange; ++v)
+		firstTriangle[v + 1] += firstTriangle[v];
+	std::vector<uint> vertexTriangles(triangleCount * 3);
+	std::vector<uint> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+	for (uint j = 0; j < triangleCount * 3; ++j)
+		vertexTriangles[filled[index[j]]++] = j / 3;
+
+	std::vector<char> used(triangleCount, 0);
+	// the vertices of the current meshlet are stamped with its number
+	std::vector<uint> stamp(vertexRange, 0);
+	std::vector<uint> candidates;
+	std::vector<uint> triangles;
+	uint meshletNumber = 0;
+	for (uint seed = 0; seed < triangleCount; ++seed)
+	{
+		if (used[seed])
+			continue;
+		++meshletNumber;
+		triangles.clear();
+		candidates.clear();
+		uint vertexCount = 0;
+		glm::vec3 positionSum(0);
+
+		uint triangle = seed;
+		while (true)
+		{
+			used[triangle] = 1;
+			triangles.push_back(triangle);
+			for (uint c = 0; c < 3; ++c)
+			{
+				uint v = index[3 * triangle + c];
+				if (stamp[v] == meshletNumber)
+					continue;
+				stamp[v] = meshletNumber;
+				++vertexCount;
+				positionSum += vertices[v].m_Position;
+				for (uint t = firstTriangle[v]; t < firstTriangle[v + 1]; ++t)
+				{
+					if (!used[vertexTriangles[t]])
+						candidates.push_back(vertexTriangles[t]);
+				}
+			}
+			if (triangles.size() == Meshlet::MaxTriangles)
+				break;
+
+			glm::vec3 center = positionSum / float(vertexCount);
+			int best = -1;
+			uint bestExtra = 0;
+			float bestDistance = 0;
+			for (size_t k = 0; k < candidates.size();)
+			{
+				uint t = candidates[k];
+				if (used[t])
+				{
+					candidates[k] = candidates.back();
+					candidates.pop_back();
+					continue;
+				}
+				++k;
+				uint extra = 0;
+				glm::vec3 centroid(0);
+				for (uint c = 0; c < 3; ++c)
+				{
+					extra += stamp[index[3 * t + c]] != meshletNumber;
+					centroid += vertices[index[3 * t + c]].m_Position / 3.f;
+				}
+				if (vertexCount + extra > Meshlet::MaxVertices)
+					continue;
+				float distance = glm::dot(centroid - center, centroid - center);
+				if (best < 0 || extra < bestExtra || (extra == bestExtra && distance < bestDistance))
+				{
+					best = t;
+					bestExtra = extra;
+					bestDistance = distance;
+				}
+			}
+			if (best < 0)
+				break;
+			triangle = best;
+		}
+
+		Meshlet meshlet;
+		meshlet.indexOffset = meshletIndex.size();
+		meshlet.indexCount = 3 * triangles.size();
+		for (uint t : triangles)
+			meshletIndex.insert(meshletIndex.end(), index + 3 * t, index + 3 * t + 3);
+		computeBounds(vertices, &meshletIndex[meshlet.indexOffset], cullable, meshlet);
+		meshlets.push_back(meshlet);
+	}
+}
@@ -0,0 +1,221 @@
+#include "occlusion.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "scene.h"
+
+namespace {
+
+const size_t RowGrain = 16;
+const size_t TestGrain = 64;
+
+/**
+ * Keep the nearest depth of the pixels first to last - 1 of the row
+ */
+void drawSpan(float* row, int first, int last, float depth)
+{
+	int x = first;
+#if defined(__SSE__)
+	__m128 value = _mm_set1_ps(depth);
+	for (; x + 4 <= last; x += 4)
+		_mm_storeu_ps(row + x, _mm_min_ps(_mm_loadu_ps(row + x), value));
+#endif
+	for (; x < last; ++x)
+		row[x] = std::min(row[x], depth);
+}
+
+}
+
+OcclusionCuller::OcclusionCuller()
+{
+	glm::ivec2 size(Width, Height);
+	levelSizes.push_back(size);
+	while (size.x > 1 || size.y > 1)
+	{
+		size = glm::max(size / 2, glm::ivec2(1));
+		levelSizes.push_back(size);
+	}
+	levels.resize(levelSizes.size());
+	for (size_t l = 0; l < levels.size(); ++l)
+		levels[l].resize(levelSizes[l].x * levelSizes[l].y);
+}
+
+size_t OcclusionCuller::occluderCount() const
+{
+	return occluders.size();
+}
+
+void OcclusionCuller::cull(const Scene& scene, const std::vector<uint>& meshIds, const glm::mat4& viewMatrix,
+						   const glm::mat4& projMatrix, glimac::ThreadPool& threadPool, std::vector<uint>& items)
+{
+	this->viewMatrix = viewMatrix;
+	pixelScale = glm::vec2(projMatrix[0][0] * 0.5f * Width, projMatrix[1][1] * 0.5f * Height);
+	pixelCenter = glm::vec2(0.5f * Width, 0.5f * Height);
+	selectOccluders(scene, meshIds, items);
+	if (occluders.empty())
+		return;
+
+	threadPool.parallelFor(Height, RowGrain, [this](size_t begin, size_t end)
+	{
+		rasterize(begin, end);
+	});
+	buildPyramid(threadPool);
+
+	hidden.assign(items.size(), 0);
+	threadPool.parallelFor(items.size(), TestGrain, [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k)
+		{
+			const glm::vec4& sphere = scene.instanceSphere(items[k]);
+			hidden[k] = isHidden(glm::vec3(sphere), sphere.w);
+		}
+	});
+	size_t kept = 0;
+	for (size_t k = 0; k < items.size(); ++k)
+	{
+		if (!hidden[k])
+			items[kept++] = items[k];
+	}
+	items.resize(kept);
+}
+
+/**
+ * The ray of a point of the view plane at depth 1 closer than r / d to the projected center
+ * makes an angle with the center smaller than asin(r / d), so it hits the sphere:
+ * the disc of radius r / d is inside the silhouette.
+ * The visible points of the sphere are closer than its tangent points, at sqrt(d² - r²),
+ * which bounds their depth
+ */
+void OcclusionCuller::selectOccluders(const Scene& scene, const std::vector<uint>& meshIds,
+									   const std::vector<uint>& items)
+{
+	candidates.clear();
+	for (uint i : items)
+	{
+		const Instance& instance = scene.instance(i);
+		const Mesh& mesh = scene.mesh(meshIds[i]);
+		if (mesh.occluderRadius <= 0)
+			continue;
+		glm::vec3 scale = glm::abs(instance.transform.scale);
+		float radius = mesh.occluderRadius * std::min(scale.x, std::min(scale.y, scale.z));
+		glm::vec3 center = glm::vec3(viewMatrix * glm::vec4(glm::vec3(scene.instanceSphere(i)), 1));
+		float depth = -center.z;
+		float distance = glm::length(center);
+		if (depth - radius <= 0 || radius < MinOccluderSize * distance)
+			continue;
+
+		Occluder occluder;
+		occluder.center = pixelCenter + pixelScale * glm::vec2(center.x, center.y) / depth;
+		occluder.radius = pixelScale * (radius / distance);
+		occluder.depth = std::sqrt(distance * distance - radius * radius);
+		candidates.push_back(std::make_pair(radius / distance, occluder));
+	}
+
+	size_t count = std::min<size_t>(candidates.size(), MaxOccluders);
+	std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+					  [](const std::pair<float, Occluder>& a, const std::pair<float, Occluder>& b)
+	{
+		return a.first > b.first;
+	});
+	occluders.resize(count);
+	for (size_t k = 0; k < count; ++k)
+		occluders[k] = candidates[k].second;
+}
+
+/**
+ * A pixel is written only if it is entirely inside the ellipse: on each row, the span
+ * is the width of the ellipse at the edge of the row farthest from its center
+ */
+void OcclusionCuller::rasterize(int first, int last)
+{
+	std::vector<float>& depths = levels[0];
+	std::fill(depths.begin() + first * Width, depths.begin() + last * Width,
+			  std::numeric_limits<float>::infinity());
+	for (const Occluder& occluder : occluders)
+	{
+		int top = std::max(first, int(std::ceil(occluder.center.y - occluder.radius.y)));
+		int bottom = std::min(last, int(std::floor(occluder.center.y + occluder.radius.y)));
+		for (int y = top; y < bottom; ++y)
+		{
+			float dy = std::max(std::abs(y - occluder.center.y), std::abs(y + 1 - occluder.center.y))
+					   / occluder.radius.y;
+			if (dy >= 1)
+				continue;
+			float halfWidth = occluder.radius.x * std::sqrt(1 - dy * dy);
+			int left = std::max(0, int(std::ceil(occluder.center.x - halfWidth)));
+			int right = std::min(Width, int(std::floor(occluder.center.x + halfWidth)));
+			drawSpan(&depths[y * Width], left, right, occluder.depth);
+		}
+	}
+}
+
+void OcclusionCuller::buildPyramid(glimac::ThreadPool& threadPool)
+{
+	for (size_t l = 1; l < levels.size(); ++l)
+	{
+		const std::vector<float>& below = levels[l - 1];
+		std::vector<float>& level = levels[l];
+		glm::ivec2 belowSize = levelSizes[l - 1];
+		glm::ivec2 size = levelSizes[l];
+		threadPool.parallelFor(size.y, RowGrain, [&](size_t begin, size_t end)
+		{
+			for (int y = begin; y < int(end); ++y)
+			{
+				// the last row or column of an odd or single size is read twice
+				const float* row0 = &below[std::min(2 * y, belowSize.y - 1) * belowSize.x];
+				const float* row1 = &below[std::min(2 * y + 1, belowSize.y - 1) * belowSize.x];
+				for (int x = 0; x < size.x; ++x)
+				{
+					int x0 = std::min(2 * x, belowSize.x - 1);
+					int x1 = std::min(2 * x + 1, belowSize.x - 1);
+					level[y * size.x + x] = std::max(std::max(row0[x0], row0[x1]), std::max(row1[x0], row1[x1]));
+				}
+			}
+		});
+	}
+}
+
+/**
+ * The rectangle bounds the projection of the box around the sphere, x / depth being
+ * extreme at its corners. The parts of the rectangle outside of the buffer are off screen
+ */
+bool OcclusionCuller::isHidden(const glm::vec3& center, float radius) const
+{
+	glm::vec3 viewCenter = glm::vec3(viewMatrix * glm::vec4(center, 1));
+	float nearest = -viewCenter.z - radius;
+	float farthest = -viewCenter.z + radius;
+	if (nearest <= 0)
+		return false;
+	glm::vec2 low = glm::vec2(viewCenter.x, viewCenter.y) - radius;
+	glm::vec2 high = glm::vec2(viewCenter.x, viewCenter.y) + radius;
+	glm::vec2 lower = pixelCenter + pixelScale * glm::min(low / nearest, low / farthest);
+	glm::vec2 upper = pixelCenter + pixelScale * glm::max(high / nearest, high / farthest);
+	if (upper.x <= 0 || upper.y <= 0 || lower.x >= Width || lower.y >= Height)
+		return false;
+	lower = glm::max(lower, glm::vec2(0));
+	upper = glm::min(upper, glm::vec2(Width, Height));
+
+	// the level where the rectangle covers at most 2 texels on each axis
+	float extent = std::max(1.f, std::max(upper.x - lower.x, upper.y - lower.y));
+	int l = std::min(int(levels.size()) - 1, int(std::ceil(std::log2(extent))));
+	glm::ivec2 size = levelSizes[l];
+	int x0 = int(lower.x) >> l;
+	int y0 = int(lower.y) >> l;
+	int x1 = std::min(size.x - 1, (int(std::ceil(upper.x)) - 1) >> l);
+	int y1 = std::min(size.y - 1, (int(std::ceil(upper.y)) - 1) >> l);
+	for (int y = y0; y <= y1; ++y)
+	{
+		for (int x = x0; x <= x1; ++x)
+		{
+			if (levels[l][y * size.x + x] >= nearest)
+				return false;
+		}
+	}
+	return true;
+}
@@ -1,21 +1,37 @@
 #include "renderer.h"
 
+#include <algorithm>
+#include <cstddef>
+
 #include "spacimac.h"
 #include "scene.h"
 #include "camera.h"
 
+glm::mat4 View::getViewMatrix() const
+{
+	return camera->getViewMatrix();
+}
+
+glm::mat4 View::getProjectionMatrix() const
+{
+	return camera->getProjectionMatrix(viewport.z, viewport.w);
+}
+
 Renderer::Renderer()
+	: depthPrepass(false), occlusionCulling(true), sphereImpostors(false)
 {}
 
 void Renderer::initialize()
 {
-	loadProgram();
+	glimac::ProgramBuilder builder(&SpacImac::instance()->programCache());
+	loadProgram(builder);
+	builder.finish();
 	loadUniforms();
 }
 
-void Renderer::loadProgram()
+void Renderer::loadProgram(glimac::ProgramBuilder& builder)
 {
-	program = glimac::loadProgram(
+	builder.submit(program,
 		SpacImac::instance()->getFilePath("shaders/3D.vs.glsl"),
 		SpacImac::instance()->getFilePath("shaders/normals.fs.glsl")
 	);
@@ -30,229 +46,1100 @@ void Renderer::loadUniforms()
 
 typedef std::list<Instance>::const_iterator InstanceIterator;
 
-void Renderer::render(const Scene& scene, const BaseCamera& camera) const
+void Renderer::render(const Scene& scene, const std::vector<View>& views) const
 {
 	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(depthFunc(*views[0].camera, depthPrepass));
+	if (depthPrepass)
+		glDepthMask(GL_FALSE);
 
 	// bind the shaders and the scene buffers
 	program.use();
 	scene.bind();
-	glm::mat4 viewMatrix = camera.getViewMatrix();
-	glm::mat4 projMatrix = camera.getProjectionMatrix(SpacImac::instance()->viewWidth(),
-													  SpacImac::instance()->viewHeight());
-
-	// for each instance, defining the MV and MVP matrix then draw it
-	for(InstanceIterator i = scene.begin(); i != scene.end(); ++i)
+	for (const View& view : views)
 	{
-		glm::mat4 MVMatrix = viewMatrix * i->transform.getModelMatrix();
-		glm::mat4 MVPMatrix = projMatrix * MVMatrix;
-		glUniformMatrix4fv(uMVMatrix, 1, GL_FALSE, glm::value_ptr(MVMatrix));
-		glUniformMatrix4fv(uNormalMatrix, 1, GL_FALSE, glm::value_ptr(glm::transpose(glm::inverse(MVMatrix))));
-		glUniformMatrix4fv(uMVPMatrix, 1, GL_FALSE, glm::value_ptr(MVPMatrix));
+		if (views.size() > 1)
+			glViewport(view.viewport.x, view.viewport.y, view.viewport.z, view.viewport.w);
+		glm::mat4 viewMatrix = view.getViewMatrix();
+		glm::mat4 projMatrix = view.getProjectionMatrix();
+
+		// for each instance, defining the MV and MVP matrix then draw it
+		for(InstanceIterator i = scene.begin(); i != scene.end(); ++i)
+		{
+			const Mesh& mesh = scene.mesh(i->meshId);
+			glm::mat4 MVMatrix = viewMatrix * i->transform.getModelMatrix();
+			glm::mat4 normalMatrix = glm::transpose(glm::inverse(MVMatrix));
+			// the positions of the vertex buffer are decoded to the model space first
+			MVMatrix = MVMatrix * mesh.positionDecode;
+			glm::mat4 MVPMatrix = projMatrix * MVMatrix;
+			glUniformMatrix4fv(uMVMatrix, 1, GL_FALSE, glm::value_ptr(MVMatrix));
+			glUniformMatrix4fv(uNormalMatrix, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+			glUniformMatrix4fv(uMVPMatrix, 1, GL_FALSE, glm::value_ptr(MVPMatrix));
 
-		scene.mesh(i->meshId).draw();
+			mesh.draw();
+		}
 	}
 	scene.unbind();
+
+	if (depthPrepass)
+		glDepthMask(GL_TRUE);
+}
+
+void Renderer::renderDepth(const Scene& scene, const std::vector<View>& views) const
+{
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(depthFunc(*views[0].camera));
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+	program.use();
+	scene.bind();
+	for (const View& view : views)
+	{
+		if (views.size() > 1)
+			glViewport(view.viewport.x, view.viewport.y, view.viewport.z, view.viewport.w);
+		glm::mat4 viewProjMatrix = view.getProjectionMatrix() * view.getViewMatrix();
+		for(InstanceIterator i = scene.begin(); i != scene.end(); ++i)
+		{
+			const Mesh& mesh = scene.mesh(i->meshId);
+			glm::mat4 MVPMatrix = viewProjMatrix * i->transform.getModelMatrix() * mesh.positionDecode;
+			glUniformMatrix4fv(uMVPMatrix, 1, GL_FALSE, glm::value_ptr(MVPMatrix));
+			mesh.draw();
+		}
+	}
+	scene.unbind();
+
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+GLenum Renderer::depthFunc(const BaseCamera &camera, bool orEqual)
+{
+	if (camera.reverseZ)
+		return orEqual ? GL_GEQUAL : GL_GREATER;
+	return orEqual ? GL_LEQUAL : GL_LESS;
+}
+
+void Renderer::setDepthPrepass(bool enabled)
+{
+	depthPrepass = enabled;
+}
+
+bool Renderer::hasDepthPrepass() const
+{
+	return depthPrepass;
+}
+
+void Renderer::setOcclusionCulling(bool enabled)
+{
+	occlusionCulling = enabled;
+}
+
+bool Renderer::hasOcclusionCulling() const
+{
+	return occlusionCulling;
 }
 
+void Renderer::setSphereImpostors(bool enabled)
+{
+	sphereImpostors = enabled;
+}
+
+bool Renderer::hasSphereImpostors() const
+{
+	return sphereImpostors;
+}
+
+Renderer::CullingStats Renderer::takeCullingStats()
+{
+	return CullingStats{0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+}
+
+const std::vector<std::string> LightRenderer::featureNames = {
+	"USE_KA_TEXTURE",
+	"USE_KD_TEXTURE",
+	"USE_KS_TEXTURE",
+	"USE_NORMAL_TEXTURE",
+	"USE_INSTANCE_BUFFER",
+	"USE_VERTEX_PULLING",
+	"USE_DEPTH_ONLY",
+	"USE_MULTI_VIEW",
+	"USE_SPHERE_IMPOSTOR",
+	"USE_PACKED_VERTICES",
+	"USE_STEEP_POINT_FALLOFF"
+};
+
 LightRenderer::LightRenderer()
-{}
+	: instanceBuffer(false), vertexPulling(false), multiView(false), programFeatures(0), materialBuffer(0),
+	  uploadedMaterials(0), attachedVAO(0), attachedBuffer(0), spriteBuffer(0), spriteVAO(0)
+{
+	frame.baseFeatures = 0;
+	frame.prepared = false;
+	cullingStats = CullingStats{0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	occludedCount = 0;
+}
+
+LightRenderer::~LightRenderer()
+{
+	if (materialBuffer)
+		glDeleteBuffers(1, &materialBuffer);
+	if (spriteBuffer)
+		glDeleteBuffers(1, &spriteBuffer);
+	if (spriteVAO)
+		glDeleteVertexArrays(1, &spriteVAO);
+}
 
-void LightRenderer::loadProgram()
+void LightRenderer::loadProgram(glimac::ProgramBuilder& builder)
 {
-	program = glimac::loadProgram(
+	permutations = glimac::ProgramPermutations(
 				SpacImac::instance()->getFilePath("shaders/light.vs.glsl"),
-				SpacImac::instance()->getFilePath("shaders/light.fs.glsl")
+				SpacImac::instance()->getFilePath("shaders/light.fs.glsl"),
+				featureNames, &SpacImac::instance()->programCache()
 				);
+	variants.clear();
+
+	instanceBuffer = glimac::StreamBuffer::isSupported() && (GLEW_VERSION_4_2 || GLEW_ARB_base_instance);
+	// the packed vertices are pulled with the packing functions
+	vertexPulling = instanceBuffer && (GLEW_VERSION_4_3 || GLEW_ARB_shader_storage_buffer_object)
+			&& GLEW_ARB_shader_draw_parameters && (GLEW_VERSION_4_2 || GLEW_ARB_shading_language_packing);
+	multiView = vertexPulling && (GLEW_VERSION_4_1 || GLEW_ARB_viewport_array)
+			&& GLEW_ARB_shader_viewport_layer_array;
+	// the vertex format of the scene is chosen before, the materials are not loaded yet
+	programFeatures = frameFeatures(SpacImac::instance()->scene(), 1);
+	permutations.submit(programFeatures | shadingFeatures(), builder);
+	permutations.submit(programFeatures | DepthOnly, builder);
+	permutations.submit(programFeatures | SphereImpostor | DepthOnly, builder);
+	// the terrains are drawn with the uniforms path, whatever the path of the frame
+	permutations.submit(DepthOnly, builder);
+	// the sprites are lit as the meshes, with the same lighting model
+	builder.submit(pointProgram,
+		SpacImac::instance()->getFilePath("shaders/point.vs.glsl"),
+		SpacImac::instance()->getFilePath("shaders/point.fs.glsl"),
+		permutations.getDefines(shadingFeatures())
+	);
 }
 
 void LightRenderer::loadUniforms()
 {
-	Renderer::loadUniforms();
-	uVMatrix = glGetUniformLocation(program.getGLId(), "uVMatrix");
+	variant(programFeatures | shadingFeatures());
+	variant(programFeatures | DepthOnly);
+	variant(programFeatures | SphereImpostor | DepthOnly);
+	variant(DepthOnly);
+	pointVariant.program = &pointProgram;
+	loadVariantUniforms(pointVariant);
+}
 
-	uDirectionalLightDir = glGetUniformLocation(program.getGLId(), "uDirectionalLightDir");
-	uDirectionalLightColor = glGetUniformLocation(program.getGLId(), "uDirectionalLightColor");
-	uDirectionalLightPower = glGetUniformLocation(program.getGLId(), "uDirectionalLightPower");
+uint LightRenderer::frameFeatures(const Scene& scene, size_t viewCount) const
+{
+	bool streamed = instanceBuffer && scene.materialCount() < MaxMaterials;
+	uint features = streamed ? streamFeatures() : 0;
+	if (scene.hasPackedVertices())
+		features |= PackedVertices;
+	if (streamed && multiView && viewCount > 1 && viewCount <= MaxViews)
+		features |= MultiView;
+	return features;
+}
+
+uint LightRenderer::streamFeatures() const
+{
+	if (!instanceBuffer)
+		return 0;
+	return vertexPulling ? InstanceBuffer | VertexPulling : InstanceBuffer;
+}
 
-	uPointLightPos = glGetUniformLocation(program.getGLId(), "uPointLightPos");
-	uPointLightColor = glGetUniformLocation(program.getGLId(), "uPointLightColor");
-	uPointLightPower = glGetUniformLocation(program.getGLId(), "uPointLightPower");
+/**
+ * Build the permutation, get its uniforms ids and bind its samplers
+ * and its material block to the fixed units
+ */
+const LightRenderer::Variant& LightRenderer::variant(uint features) const
+{
+	std::map<uint, Variant>::const_iterator it = variants.find(features);
+	if (it != variants.end())
+		return it->second;
 
-	uAmbiantLightColor = glGetUniformLocation(program.getGLId(), "uAmbiantLightColor");
-	uAmbiantLightPower = glGetUniformLocation(program.getGLId(), "uAmbiantLightPower");
+	Variant v;
+	v.program = &permutations.get(features);
+	loadVariantUniforms(v);
+	GLuint id = v.program->getGLId();
+
+	GLuint materialBlock = glGetUniformBlockIndex(id, "uMaterialBlock");
+	if (materialBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(id, materialBlock, MaterialBinding);
+	if (features & VertexPulling)
+	{
+		glShaderStorageBlockBinding(id, glGetProgramResourceIndex(id, GL_SHADER_STORAGE_BLOCK, "uVertexBuffer"),
+									Scene::VertexStorageBinding);
+		glShaderStorageBlockBinding(id, glGetProgramResourceIndex(id, GL_SHADER_STORAGE_BLOCK, "uInstanceBuffer"),
+									InstanceStorageBinding);
+	}
+
+	// Samplers never change of unit, set them once
+	v.program->use();
+	glUniform1i(glGetUniformLocation(id, "uKaTexture"), KaTextureUnit);
+	glUniform1i(glGetUniformLocation(id, "uKdTexture"), KdTextureUnit);
+	glUniform1i(glGetUniformLocation(id, "uKsTexture"), KsTextureUnit);
+	glUniform1i(glGetUniformLocation(id, "uNormalTexture"), NormalTextureUnit);
+
+	return variants.insert(std::make_pair(features, v)).first->second;
+}
+
+void LightRenderer::loadVariantUniforms(Variant& v)
+{
+	GLuint id = v.program->getGLId();
+
+	v.uMVPMatrix = glGetUniformLocation(id, "uMVPMatrix");
+	v.uMVMatrix = glGetUniformLocation(id, "uMVMatrix");
+	v.uNormalMatrix = glGetUniformLocation(id, "uNormalMatrix");
+	v.uVMatrix = glGetUniformLocation(id, "uVMatrix");
+	v.uPMatrix = glGetUniformLocation(id, "uPMatrix");
+	v.uVMatrices = glGetUniformLocation(id, "uVMatrices");
+	v.uPMatrices = glGetUniformLocation(id, "uPMatrices");
+	v.uViewCount = glGetUniformLocation(id, "uViewCount");
+	v.uZeroToOneDepth = glGetUniformLocation(id, "uZeroToOneDepth");
+	v.uPixelScale = glGetUniformLocation(id, "uPixelScale");
+
+	v.uDirectionalLightDir = glGetUniformLocation(id, "uDirectionalLightDir");
+	v.uDirectionalLightColor = glGetUniformLocation(id, "uDirectionalLightColor");
+	v.uDirectionalLightPower = glGetUniformLocation(id, "uDirectionalLightPower");
+
+	v.uPointLightPos = glGetUniformLocation(id, "uPointLightPos");
+	v.uPointLightColor = glGetUniformLocation(id, "uPointLightColor");
+	v.uPointLightPower = glGetUniformLocation(id, "uPointLightPower");
+
+	v.uAmbiantLightColor = glGetUniformLocation(id, "uAmbiantLightColor");
+	v.uAmbiantLightPower = glGetUniformLocation(id, "uAmbiantLightPower");
 
 	// Material
-	uKa = glGetUniformLocation(program.getGLId(), "uKa");
-	uKd = glGetUniformLocation(program.getGLId(), "uKd");
-	uKs = glGetUniformLocation(program.getGLId(), "uKs");
-	uShininess = glGetUniformLocation(program.getGLId(), "uShininess");
+	v.uKa = glGetUniformLocation(id, "uKa");
+	v.uKd = glGetUniformLocation(id, "uKd");
+	v.uKs = glGetUniformLocation(id, "uKs");
+	v.uShininess = glGetUniformLocation(id, "uShininess");
 }
 
-void LightRenderer::render(const Scene &scene, const BaseCamera &camera) const
+void LightRenderer::useVariant(const Variant& v, const Scene& scene, const glm::mat4& viewMatrix,
+							   const glm::mat4& projMatrix) const
 {
-	glEnable(GL_DEPTH_TEST);
+	v.program->use();
 
-	program.use();
-	scene.bind();
-	glm::mat4 viewMatrix = camera.getViewMatrix();
-	glm::mat4 projMatrix = camera.getProjectionMatrix(SpacImac::instance()->viewWidth(),
-													  SpacImac::instance()->viewHeight());
+	glUniform3fv(v.uDirectionalLightDir, 1, glm::value_ptr(scene.directionalLight.direction));
+	glUniform3fv(v.uDirectionalLightColor, 1, glm::value_ptr(scene.directionalLight.color));
+	glUniform1f(v.uDirectionalLightPower, scene.directionalLight.power);
+	glUniform3fv(v.uPointLightPos, 1, glm::value_ptr(scene.pointLight.position));
+	glUniform3fv(v.uPointLightColor, 1, glm::value_ptr(scene.pointLight.color));
+	glUniform1f(v.uPointLightPower, scene.pointLight.power);
+	glUniform3fv(v.uAmbiantLightColor, 1, glm::value_ptr(scene.ambiantLight.color));
+	glUniform1f(v.uAmbiantLightPower, scene.ambiantLight.power);
 
-	glUniform3fv(uDirectionalLightDir, 1, glm::value_ptr(scene.directionalLight.direction));
-	glUniform3fv(uDirectionalLightColor, 1, glm::value_ptr(scene.directionalLight.color));
-	glUniform1f(uDirectionalLightPower, scene.directionalLight.power);
-	glUniform3fv(uPointLightPos, 1, glm::value_ptr(scene.pointLight.position));
-	glUniform3fv(uPointLightColor, 1, glm::value_ptr(scene.pointLight.color));
-	glUniform1f(uPointLightPower, scene.pointLight.power);
-	glUniform3fv(uAmbiantLightColor, 1, glm::value_ptr(scene.ambiantLight.color));
-	glUniform1f(uAmbiantLightPower, scene.ambiantLight.power);
+	glUniformMatrix4fv(v.uVMatrix, 1, GL_FALSE, glm::value_ptr(viewMatrix));
+	glUniformMatrix4fv(v.uPMatrix, 1, GL_FALSE, glm::value_ptr(projMatrix));
+	glUniform1i(v.uZeroToOneDepth, frame.zeroToOneDepth);
+	if (frame.baseFeatures & MultiView)
+	{
+		GLsizei viewCount = frame.viewMatrices.size();
+		glUniformMatrix4fv(v.uVMatrices, viewCount, GL_FALSE, glm::value_ptr(frame.viewMatrices[0]));
+		glUniformMatrix4fv(v.uPMatrices, viewCount, GL_FALSE, glm::value_ptr(frame.projMatrices[0]));
+		glUniform1i(v.uViewCount, viewCount);
+	}
+}
 
-	glUniformMatrix4fv(uVMatrix, 1, GL_FALSE, glm::value_ptr(viewMatrix));
+size_t LightRenderer::viewPasses() const
+{
+	return frame.baseFeatures & MultiView ? 1 : frame.viewMatrices.size();
+}
 
-	// for each instance, defining the matrix and the material then draw it
-	for(InstanceIterator i = scene.begin(); i != scene.end(); ++i)
+void LightRenderer::beginViewPass(size_t view) const
+{
+	if (viewPasses() == 1)
+		return;
+	const glm::ivec4& viewport = frame.viewports[view];
+	glViewport(viewport.x, viewport.y, viewport.z, viewport.w);
+	// the streamed instances are in world space, the uniforms path needs the matrices of the view
+	if (frame.baseFeatures & InstanceBuffer)
+		return;
+	const glm::mat4& viewMatrix = frame.viewMatrices[view];
+	const glm::mat4& projMatrix = frame.projMatrices[view];
+	SpacImac::instance()->threadPool().parallelFor(packets.size(), PacketGrain, [&](size_t begin, size_t end)
 	{
-		glm::mat4 MVMatrix = viewMatrix * i->transform.getModelMatrix();
-		glm::mat4 MVPMatrix = projMatrix * MVMatrix;
-		const Material& m = scene.materialOfInstance(*i);
+		for (size_t k = begin; k < end; ++k)
+			setViewMatrices(packets[k], viewMatrix, projMatrix);
+	});
+}
 
-		glUniformMatrix4fv(uMVMatrix, 1, GL_FALSE, glm::value_ptr(MVMatrix));
-		glUniformMatrix4fv(uNormalMatrix, 1, GL_FALSE, glm::value_ptr(glm::transpose(glm::inverse(MVMatrix))));
-		glUniformMatrix4fv(uMVPMatrix, 1, GL_FALSE, glm::value_ptr(MVPMatrix));
+void LightRenderer::setViewMatrices(DrawPacket& packet, const glm::mat4& viewMatrix, const glm::mat4& projMatrix)
+{
+	packet.MVMatrix = viewMatrix * packet.decodedMatrix;
+	packet.MVPMatrix = projMatrix * packet.MVMatrix;
+	packet.normalMatrix = glm::transpose(glm::inverse(viewMatrix * packet.modelMatrix));
+}
 
-		glUniform3fv(uKa, 1, glm::value_ptr(m.ka));
-		glUniform3fv(uKd, 1, glm::value_ptr(m.kd));
-		glUniform3fv(uKs, 1, glm::value_ptr(m.ks));
-		glUniform1f(uShininess, m.shininess);
+void LightRenderer::drawStreamed(const Scene& scene, const DrawPacket& packet, GLuint index) const
+{
+	GLsizei instanceCount = frame.baseFeatures & MultiView ? frame.viewMatrices.size() : 1;
+	GLuint baseInstance = instanceStream.getFirstIndex() + index;
+	if (!packet.clustered)
+	{
+		scene.mesh(packet.meshId).draw(baseInstance, instanceCount);
+		return;
+	}
+	// there is no multi-draw with a base instance without an indirect buffer
+	const Mesh& mesh = scene.mesh(packet.meshId);
+	for (size_t r = 0; r < packet.clusterCounts.size(); ++r)
+	{
+		glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, packet.clusterCounts[r], mesh.indexType,
+													  packet.clusterOffsets[r], instanceCount, mesh.baseVertex,
+													  baseInstance);
+	}
+}
 
-		scene.mesh(i->meshId).draw();
+/**
+ * The test against the cone of a meshlet is the side of its triangles planes where the eye is,
+ * which the model matrix keeps: it is done in model space, even with a non uniform scale.
+ * A meshlet is kept if it faces an eye and is in a frustum
+ */
+void LightRenderer::cullMeshlets(const Scene& scene, const Instance& instance, const glm::mat4& modelMatrix,
+								 DrawPacket& packet) const
+{
+	const Mesh& mesh = scene.mesh(packet.meshId);
+	glm::mat4 inverseModel = glm::inverse(modelMatrix);
+	glm::vec3 scale = glm::abs(instance.transform.scale);
+	float radiusScale = std::max(scale.x, std::max(scale.y, scale.z));
+
+	packet.clusterCounts.clear();
+	packet.clusterOffsets.clear();
+	packet.clusterBaseVertices.clear();
+	packet.meshletsCulled = 0;
+	uint rangeEnd = 0;
+	for (uint m = mesh.firstMeshlet; m < mesh.firstMeshlet + mesh.meshletCount; ++m)
+	{
+		const Meshlet& meshlet = scene.meshlet(m);
+		bool backFacing = true;
+		for (size_t e = 0; e < frame.eyes.size() && backFacing; ++e)
+			backFacing = meshlet.isBackFacing(glm::vec3(inverseModel * glm::vec4(frame.eyes[e], 1)));
+		if (backFacing
+			|| !culler.isVisible(glm::vec3(modelMatrix * glm::vec4(meshlet.center, 1)), meshlet.radius * radiusScale))
+		{
+			++packet.meshletsCulled;
+			continue;
+		}
+		if (!packet.clusterCounts.empty() && rangeEnd == meshlet.indexOffset)
+			packet.clusterCounts.back() += meshlet.indexCount;
+		else
+		{
+			packet.clusterCounts.push_back(meshlet.indexCount);
+			packet.clusterOffsets.push_back(mesh.indexPointer(meshlet.indexOffset));
+			packet.clusterBaseVertices.push_back(mesh.baseVertex);
+		}
+		rangeEnd = meshlet.indexOffset + meshlet.indexCount;
 	}
-	scene.unbind();
+	packet.clustered = packet.meshletsCulled > 0;
 }
 
+void LightRenderer::drawPacket(const Variant& v, const Scene& scene, const DrawPacket& packet) const
+{
+	const Material& m = *packet.material;
 
+	glUniformMatrix4fv(v.uMVMatrix, 1, GL_FALSE, glm::value_ptr(packet.MVMatrix));
+	glUniformMatrix4fv(v.uNormalMatrix, 1, GL_FALSE, glm::value_ptr(packet.normalMatrix));
+	glUniformMatrix4fv(v.uMVPMatrix, 1, GL_FALSE, glm::value_ptr(packet.MVPMatrix));
 
-TextureAndLightRenderer::TextureAndLightRenderer()
-{}
+	glUniform3fv(v.uKa, 1, glm::value_ptr(m.ka));
+	glUniform3fv(v.uKd, 1, glm::value_ptr(m.kd));
+	glUniform3fv(v.uKs, 1, glm::value_ptr(m.ks));
+	glUniform1f(v.uShininess, m.shininess);
+
+	// the chunks have their own VAOs, the frame one is bound again for the next packets
+	if (packet.terrain)
+	{
+		packet.terrain->draw();
+		bindFrame(scene);
+	}
+	else if (packet.clustered)
+	{
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, packet.clusterCounts.data(), scene.mesh(packet.meshId).indexType,
+									  packet.clusterOffsets.data(), packet.clusterCounts.size(),
+									  packet.clusterBaseVertices.data());
+	}
+	else
+		scene.mesh(packet.meshId).draw();
+}
 
-void TextureAndLightRenderer::loadProgram()
+/**
+ * The scale of an instance is the ratio of its world bounding radius to the one of its mesh,
+ * its edges being the longest on screen in the view where its nearest point is the closest
+ */
+void LightRenderer::selectLods(const Scene& scene, const std::vector<View>& views) const
 {
-	program = glimac::loadProgram(
-				SpacImac::instance()->getFilePath("shaders/light.vs.glsl"),
-				SpacImac::instance()->getFilePath("shaders/textureandlight.fs.glsl")
-	);
+	// pixels covered by a world unit at distance 1 in each view
+	std::vector<float> pixelScales(views.size());
+	for (size_t v = 0; v < views.size(); ++v)
+		pixelScales[v] = frame.projMatrices[v][1][1] * 0.5f * views[v].viewport.w;
+
+	lodLevels.resize(scene.instanceCount(), 0);
+	lodMeshes.resize(scene.instanceCount());
+	screenRadii.resize(scene.instanceCount());
+	SpacImac::instance()->threadPool().parallelFor(scene.instanceCount(), PacketGrain,
+												   [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			uint chain[MaxLodLevels];
+			uint levelCount = 0;
+			for (int mesh = scene.instance(i).meshId; mesh >= 0 && levelCount < MaxLodLevels;
+				 mesh = scene.mesh(mesh).coarserMesh)
+				chain[levelCount++] = mesh;
+
+			const glm::vec4& sphere = scene.instanceSphere(i);
+			float boundingRadius = scene.mesh(chain[0]).boundingRadius;
+			float pixels = 0;
+			float screenRadius = 0;
+			for (size_t v = 0; v < views.size(); ++v)
+			{
+				float distance = glm::length(glm::vec3(sphere) - frame.eyes[v]);
+				pixels = std::max(pixels, pixelScales[v] / std::max(distance - sphere.w, 1e-6f));
+				screenRadius = std::max(screenRadius, pixelScales[v] * sphere.w / std::max(distance, 1e-6f));
+			}
+			screenRadii[i] = screenRadius;
+			pixels = boundingRadius > 0 ? pixels * sphere.w / boundingRadius : 0;
+
+			uint level = std::min<uint>(lodLevels[i], levelCount - 1);
+			while (level > 0 && scene.mesh(chain[level]).edgeLength * pixels > LodEdgePixels * (1 + LodHysteresis))
+				--level;
+			while (level + 1 < levelCount
+				   && scene.mesh(chain[level + 1]).edgeLength * pixels < LodEdgePixels * (1 - LodHysteresis))
+				++level;
+			lodLevels[i] = level;
+			lodMeshes[i] = chain[level];
+		}
+	});
 }
 
-void TextureAndLightRenderer::loadUniforms()
+/**
+ * The hierarchy of the scene rejects or accepts whole subtrees against the frustums,
+ * the spheres of the instances in the partially visible nodes are then tested by batches.
+ * The visible instances are copied in a vector so that the workers can split them,
+ * each packet is then written by a single worker. The jobs only read the scene
+ */
+void LightRenderer::preparePackets(const Scene& scene, const glm::mat4& viewMatrix, const glm::mat4& projMatrix,
+								   uint baseFeatures) const
 {
-	LightRenderer::loadUniforms();
+	visibleItems.clear();
+	candidates.clear();
+	scene.bvh().query([this](const glimac::BBox3f& box)
+	{
+		return culler.classify(box);
+	},
+	[&](uint i, bool contained)
+	{
+		if (contained)
+			visibleItems.push_back(i);
+		else
+			candidates.push_back(i);
+	});
+	spheres.resize(candidates.size());
+	for (size_t k = 0; k < candidates.size(); ++k)
+	{
+		const glm::vec4& sphere = scene.instanceSphere(candidates[k]);
+		spheres.set(k, glm::vec3(sphere), sphere.w);
+	}
+	culler.cull(spheres, visible);
+	for (uint k : visible)
+		visibleItems.push_back(candidates[k]);
+
+	// the packets of several views are shared, an instance hidden in one view may be seen in another
+	glimac::ThreadPool& threadPool = SpacImac::instance()->threadPool();
+	occludedCount = 0;
+	if (occlusionCulling && frame.viewMatrices.size() == 1)
+	{
+		size_t count = visibleItems.size();
+		occlusionCuller.cull(scene, lodMeshes, viewMatrix, projMatrix, threadPool, visibleItems);
+		occludedCount = count - visibleItems.size();
+	}
+
+	// a body smaller than a pixel costs a vertex in the sprite batch rather than a whole mesh
+	sprites.clear();
+	size_t kept = 0;
+	for (uint i : visibleItems)
+	{
+		if (screenRadii[i] >= PointSpritePixels)
+		{
+			visibleItems[kept++] = i;
+			continue;
+		}
+		Material m = distantMaterial(scene.materialOfInstance(scene.instance(i)), scene);
+		sprites.push_back(PointSprite{scene.instanceSphere(i), m.kd, m.ka});
+	}
+	visibleItems.resize(kept);
+	instances.resize(visibleItems.size());
+	for (size_t k = 0; k < visibleItems.size(); ++k)
+		instances[k] = &scene.instance(visibleItems[k]);
+	packets.resize(instances.size());
+	order.resize(instances.size());
 
-	uUseKaTexture = glGetUniformLocation(program.getGLId(), "uUseKaTexture");
-	uUseKdTexture = glGetUniformLocation(program.getGLId(), "uUseKdTexture");
-	uUseKsTexture = glGetUniformLocation(program.getGLId(), "uUseKsTexture");
-	uUseNormalTexture = glGetUniformLocation(program.getGLId(), "uUseNormalTexture");
+	bool streamed = baseFeatures & InstanceBuffer;
+	threadPool.parallelFor(instances.size(), PacketGrain, [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k)
+		{
+			const Instance& instance = *instances[k];
+			DrawPacket& packet = packets[k];
+			int materialId = scene.materialIdOfInstance(instance);
+			packet.material = &scene.materialOfInstance(instance);
+			packet.features = baseFeatures | shadingFeatures() | materialFeatures(*packet.material);
+			packet.meshId = lodMeshes[visibleItems[k]];
+			packet.terrain = nullptr;
+			int impostor = scene.mesh(instance.meshId).sphereImpostor;
+			if (sphereImpostors && impostor >= 0)
+			{
+				const glm::vec4& sphere = scene.instanceSphere(visibleItems[k]);
+				bool outside = true;
+				for (const glm::vec3& eye : frame.eyes)
+					outside = outside && glm::length(glm::vec3(sphere) - eye) > ImpostorMinDistance * sphere.w;
+				if (outside)
+				{
+					packet.meshId = impostor;
+					packet.features |= SphereImpostor;
+				}
+			}
+
+			// a terrain is drawn with the uniforms path, its chunks having their own VAOs
+			if (frame.viewMatrices.size() == 1 && instance.terrainId >= 0 && screenRadii[visibleItems[k]] >= TerrainPixels
+				&& scene.terrain(instance.terrainId).isReady())
+			{
+				packet.terrain = &scene.terrain(instance.terrainId);
+				packet.features = shadingFeatures() | materialFeatures(*packet.material);
+			}
+
+			glm::mat4 modelMatrix = instance.transform.getModelMatrix();
+			packet.depth = -(viewMatrix * modelMatrix[3]).z;
+			// the positions of the vertex buffer are decoded to the model space first, but for
+			// the terrains which have their own buffers and the impostors which only use the corners
+			glm::mat4 decodedMatrix = packet.terrain || (packet.features & SphereImpostor) ? modelMatrix
+									  : modelMatrix * scene.mesh(packet.meshId).positionDecode;
+			packet.clustered = false;
+			packet.meshletsCulled = 0;
+			if (!packet.terrain && scene.mesh(packet.meshId).meshletCount > 0)
+				cullMeshlets(scene, instance, modelMatrix, packet);
+			if (streamed)
+			{
+				packet.instance.modelMatrix = decodedMatrix;
+				glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
+				for (int c = 0; c < 3; ++c)
+					packet.instance.normalMatrix[c] = glm::vec4(normalMatrix[c], 0);
+				packet.instance.materialIndex = materialId >= 0 ? materialId : scene.materialCount();
+				packet.instance.padding[0] = packet.instance.padding[1] = packet.instance.padding[2] = 0;
+			}
+			if (!streamed || packet.terrain)
+			{
+				packet.modelMatrix = modelMatrix;
+				packet.decodedMatrix = decodedMatrix;
+				setViewMatrices(packet, viewMatrix, projMatrix);
+			}
+			order[k] = std::make_pair(packet.features, k);
+		}
+	});
+
+	// sort the packets by permutation so that each program is used only once,
+	// then front to back so that the hidden fragments fail the depth test early
+	std::sort(order.begin(), order.end(), [this](const std::pair<uint, uint>& a, const std::pair<uint, uint>& b)
+	{
+		if (a.first != b.first)
+			return a.first < b.first;
+		return packets[a.second].depth < packets[b.second].depth;
+	});
 
-	uKaTexture = glGetUniformLocation(program.getGLId(), "uKaTexture");
-	uKdTexture = glGetUniformLocation(program.getGLId(), "uKdTexture");
-	uKsTexture = glGetUniformLocation(program.getGLId(), "uKsTexture");
-	uNormalTexture = glGetUniformLocation(program.getGLId(), "uNormalTexture");
+	// the depth prepass uses a single program, it only follows the depth
+	depthOrder.resize(packets.size());
+	drawIndex.resize(packets.size());
+	for (size_t k = 0; k < order.size(); ++k)
+	{
+		depthOrder[k] = order[k].second;
+		drawIndex[order[k].second] = k;
+	}
+	std::sort(depthOrder.begin(), depthOrder.end(), [this](uint a, uint b)
+	{
+		return packets[a].depth < packets[b].depth;
+	});
 }
 
-void TextureAndLightRenderer::render(const Scene &scene, const BaseCamera &camera) const
+/**
+ * Instance data are compared with the previous frame ones by instanceStream,
+ * so only the moving instances are copied. The default material is stored after the scene ones
+ */
+void LightRenderer::uploadInstances(const Scene& scene) const
 {
-	glEnable(GL_DEPTH_TEST);
+	instanceStream.resize(order.size());
+	// each element is compared and written by a single worker
+	SpacImac::instance()->threadPool().parallelFor(order.size(), PacketGrain, [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k)
+			instanceStream.set(k, packets[order[k].second].instance);
+	});
+	instanceStream.upload();
+	double stallTime = instanceStream.getBuffer().getLastStallTime();
+	if (stallTime > 0)
+	{
+		++cullingStats.streamStalls;
+		cullingStats.streamStallTime += stallTime;
+	}
 
-	program.use();
-	scene.bind();
-	glm::mat4 viewMatrix = camera.getViewMatrix();
-	glm::mat4 projMatrix = camera.getProjectionMatrix(SpacImac::instance()->viewWidth(),
-													  SpacImac::instance()->viewHeight());
-	glUniform3fv(uDirectionalLightDir, 1, glm::value_ptr(scene.directionalLight.direction));
-	glUniform3fv(uDirectionalLightColor, 1, glm::value_ptr(scene.directionalLight.color));
-	glUniform1f(uDirectionalLightPower, scene.directionalLight.power);
-	glUniform3fv(uPointLightPos, 1, glm::value_ptr(scene.pointLight.position));
-	glUniform3fv(uPointLightColor, 1, glm::value_ptr(scene.pointLight.color));
-	glUniform1f(uPointLightPower, scene.pointLight.power);
-	glUniform3fv(uAmbiantLightColor, 1, glm::value_ptr(scene.ambiantLight.color));
-	glUniform1f(uAmbiantLightPower, scene.ambiantLight.power);
-
-	glUniformMatrix4fv(uVMatrix, 1, GL_FALSE, glm::value_ptr(viewMatrix));
-
-	glUniform1i(uKaTexture, 0);
-	glUniform1i(uKdTexture, 1);
-	glUniform1i(uKsTexture, 2);
-	glUniform1i(uNormalTexture, 3);
-
-	// for each instance, defining the matrix and the material, bind the textures, then draw it
-	for(InstanceIterator i = scene.begin(); i != scene.end(); ++i)
-	{
-		glm::mat4 MVMatrix = viewMatrix * i->transform.getModelMatrix();
-		glm::mat4 MVPMatrix = projMatrix * MVMatrix;
-		const Material& m = scene.materialOfInstance(*i);
+	if (uploadedMaterials != scene.materialCount() + 1)
+	{
+		std::vector<MaterialData> materials(scene.materialCount() + 1);
+		for (uint i = 0; i <= scene.materialCount(); ++i)
+		{
+			const Material& m = i < scene.materialCount() ? scene.material(i) : Material();
+			materials[i].ka = glm::vec4(m.ka, 1);
+			materials[i].kd = glm::vec4(m.kd, 1);
+			materials[i].ksShininess = glm::vec4(m.ks, m.shininess);
+		}
+		if (glimac::hasDirectStateAccess())
+		{
+			if (!materialBuffer)
+			{
+				glCreateBuffers(1, &materialBuffer);
+				glNamedBufferData(materialBuffer, MaxMaterials * sizeof(MaterialData), nullptr, GL_STATIC_DRAW);
+			}
+			glNamedBufferSubData(materialBuffer, 0, materials.size() * sizeof(MaterialData), materials.data());
+		}
+		else
+		{
+			bool allocate = !materialBuffer;
+			if (allocate)
+				glGenBuffers(1, &materialBuffer);
+			glBindBuffer(GL_UNIFORM_BUFFER, materialBuffer);
+			if (allocate)
+				glBufferData(GL_UNIFORM_BUFFER, MaxMaterials * sizeof(MaterialData), nullptr, GL_STATIC_DRAW);
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, materials.size() * sizeof(MaterialData), materials.data());
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		}
+		uploadedMaterials = materials.size();
+	}
+	glBindBufferBase(GL_UNIFORM_BUFFER, MaterialBinding, materialBuffer);
 
-		glUniformMatrix4fv(uMVMatrix, 1, GL_FALSE, glm::value_ptr(MVMatrix));
-		glUniformMatrix4fv(uNormalMatrix, 1, GL_FALSE, glm::value_ptr(glm::transpose(glm::inverse(MVMatrix))));
-		glUniformMatrix4fv(uMVPMatrix, 1, GL_FALSE, glm::value_ptr(MVPMatrix));
+	if (vertexPulling)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, InstanceStorageBinding, instanceStream.getBuffer().getGLId());
+	else if (attachedVAO != scene.VAOid() || attachedBuffer != instanceStream.getBuffer().getGLId())
+		attachInstanceBuffer(scene);
+}
 
-		glUniform3fv(uKa, 1, glm::value_ptr(m.ka));
-		glUniform3fv(uKd, 1, glm::value_ptr(m.kd));
-		glUniform3fv(uKs, 1, glm::value_ptr(m.ks));
-		glUniform1f(uShininess, m.shininess);
+/**
+ * The attributes read the whole buffer, the region of the frame is selected
+ * by the base instance of the draw calls
+ */
+void LightRenderer::attachInstanceBuffer(const Scene& scene) const
+{
+	attachedVAO = scene.VAOid();
+	attachedBuffer = instanceStream.getBuffer().getGLId();
 
-		bindMaterial(m, scene);
+	if (glimac::hasDirectStateAccess())
+	{
+		glVertexArrayVertexBuffer(attachedVAO, InstanceBinding, attachedBuffer, 0, sizeof(InstanceData));
+		glVertexArrayBindingDivisor(attachedVAO, InstanceBinding, 1);
+		for (GLuint c = 0; c < 4; ++c)
+		{
+			glEnableVertexArrayAttrib(attachedVAO, Scene::InstanceModelMatrix + c);
+			glVertexArrayAttribFormat(attachedVAO, Scene::InstanceModelMatrix + c, 4, GL_FLOAT, GL_FALSE,
+									  offsetof(InstanceData, modelMatrix) + c * sizeof(glm::vec4));
+			glVertexArrayAttribBinding(attachedVAO, Scene::InstanceModelMatrix + c, InstanceBinding);
+		}
+		for (GLuint c = 0; c < 3; ++c)
+		{
+			glEnableVertexArrayAttrib(attachedVAO, Scene::InstanceNormalMatrix + c);
+			glVertexArrayAttribFormat(attachedVAO, Scene::InstanceNormalMatrix + c, 3, GL_FLOAT, GL_FALSE,
+									  offsetof(InstanceData, normalMatrix) + c * sizeof(glm::vec4));
+			glVertexArrayAttribBinding(attachedVAO, Scene::InstanceNormalMatrix + c, InstanceBinding);
+		}
+		glEnableVertexArrayAttrib(attachedVAO, Scene::InstanceMaterialIndex);
+		glVertexArrayAttribIFormat(attachedVAO, Scene::InstanceMaterialIndex, 1, GL_INT,
+								   offsetof(InstanceData, materialIndex));
+		glVertexArrayAttribBinding(attachedVAO, Scene::InstanceMaterialIndex, InstanceBinding);
+		return;
+	}
 
-		scene.mesh(i->meshId).draw();
+	scene.bind();
+	glBindBuffer(GL_ARRAY_BUFFER, instanceStream.getBuffer().getGLId());
+	for (GLuint c = 0; c < 4; ++c)
+	{
+		glEnableVertexAttribArray(Scene::InstanceModelMatrix + c);
+		glVertexAttribPointer(Scene::InstanceModelMatrix + c, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+							  (GLvoid*) (offsetof(InstanceData, modelMatrix) + c * sizeof(glm::vec4)));
+		glVertexAttribDivisor(Scene::InstanceModelMatrix + c, 1);
 	}
-	scene.unbind();
+	for (GLuint c = 0; c < 3; ++c)
+	{
+		glEnableVertexAttribArray(Scene::InstanceNormalMatrix + c);
+		glVertexAttribPointer(Scene::InstanceNormalMatrix + c, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+							  (GLvoid*) (offsetof(InstanceData, normalMatrix) + c * sizeof(glm::vec4)));
+		glVertexAttribDivisor(Scene::InstanceNormalMatrix + c, 1);
+	}
+	glEnableVertexAttribArray(Scene::InstanceMaterialIndex);
+	glVertexAttribIPointer(Scene::InstanceMaterialIndex, 1, GL_INT, sizeof(InstanceData),
+						   (GLvoid*) offsetof(InstanceData, materialIndex));
+	glVertexAttribDivisor(Scene::InstanceMaterialIndex, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void TextureAndLightRenderer::bindMaterial(const Material &m, const Scene& scene) const
+/**
+ * Prepare the packets and upload the instances once per frame,
+ * for renderDepth() and render() when there is a depth prepass
+ */
+void LightRenderer::prepareFrame(const Scene& scene, const std::vector<View>& views) const
 {
-	if (m.kaTextureId>=0)
+	frame.baseFeatures = frameFeatures(scene, views.size());
+	bool streamed = frame.baseFeatures & InstanceBuffer;
+	frame.viewMatrices.resize(views.size());
+	frame.projMatrices.resize(views.size());
+	frame.viewports.resize(views.size());
+	frame.eyes.resize(views.size());
+	for (size_t i = 0; i < views.size(); ++i)
 	{
-		scene.texture(m.kaTextureId).bind(0);
-		glUniform1i(uUseKaTexture, 1);
+		frame.viewMatrices[i] = views[i].getViewMatrix();
+		frame.projMatrices[i] = views[i].getProjectionMatrix();
+		frame.viewports[i] = views[i].viewport;
+		frame.eyes[i] = glm::vec3(glm::inverse(frame.viewMatrices[i])[3]);
 	}
-	else
+	frame.zeroToOneDepth = views[0].camera->reverseZ;
+	frame.viewMatrix = frame.viewMatrices[0];
+	frame.projMatrix = frame.projMatrices[0];
+	frame.prepared = true;
+
+	// the depth range is [0, 1] with reverse-Z
+	culler.clear();
+	for (size_t i = 0; i < views.size(); ++i)
+		culler.addFrustum(frame.projMatrices[i] * frame.viewMatrices[i], views[i].camera->reverseZ);
+
+	selectLods(scene, views);
+	// the chunks are uploaded and chosen on the GL thread, before the workers read them
+	if (views.size() == 1)
 	{
-		glUniform1i(uUseKaTexture, 0);
+		float pixelScale = frame.projMatrix[1][1] * 0.5f * views[0].viewport.w;
+		for (uint i = 0; i < scene.instanceCount(); ++i)
+		{
+			const Instance& instance = scene.instance(i);
+			if (instance.terrainId < 0 || screenRadii[i] < TerrainPixels)
+				continue;
+			glm::vec3 eye = glm::vec3(glm::inverse(instance.transform.getModelMatrix()) * glm::vec4(frame.eyes[0], 1));
+			scene.terrain(instance.terrainId).update(eye, pixelScale);
+		}
 	}
-	if (m.kdTextureId>=0)
+	preparePackets(scene, frame.viewMatrix, frame.projMatrix, frame.baseFeatures);
+	++cullingStats.frames;
+	cullingStats.tested += scene.instanceCount();
+	cullingStats.culled += scene.instanceCount() - instances.size() - sprites.size();
+	cullingStats.sprites += sprites.size();
+	cullingStats.occluded += occludedCount;
+	for (const DrawPacket& packet : packets)
+	{
+		const Mesh& mesh = scene.mesh(packet.meshId);
+		size_t triangles = mesh.indexCount / 3;
+		if (packet.terrain)
+			triangles = packet.terrain->triangleCount();
+		else if (packet.clustered)
+		{
+			triangles = 0;
+			for (GLsizei count : packet.clusterCounts)
+				triangles += count / 3;
+		}
+		cullingStats.triangles += packet.terrain ? triangles : triangles * views.size();
+		if (!packet.terrain)
+		{
+			cullingStats.meshlets += mesh.meshletCount;
+			cullingStats.meshletsCulled += packet.meshletsCulled;
+		}
+	}
+	if (streamed && !order.empty())
 	{
-		scene.texture(m.kdTextureId).bind(1);
-		glUniform1i(uUseKdTexture, 1);
+		bindFrame(scene);
+		uploadInstances(scene);
 	}
+}
+
+void LightRenderer::bindFrame(const Scene& scene) const
+{
+	// with vertex pulling, every mesh is drawn with the same VAO
+	// whatever its vertex format, the shaders reading the vertices themselves
+	if (frame.baseFeatures & VertexPulling)
+		scene.bindVertexPulling();
 	else
+		scene.bind();
+
+	if (frame.baseFeatures & MultiView)
 	{
-		glUniform1i(uUseKdTexture, 0);
+		for (GLuint i = 0; i < frame.viewports.size(); ++i)
+		{
+			const glm::ivec4& viewport = frame.viewports[i];
+			glViewportIndexedf(i, viewport.x, viewport.y, viewport.z, viewport.w);
+		}
 	}
-	if (m.ksTextureId>=0)
+}
+
+void LightRenderer::renderDepth(const Scene &scene, const std::vector<View>& views) const
+{
+	prepareFrame(scene, views);
+	if (order.empty())
+		return;
+
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(depthFunc(*views[0].camera));
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	bindFrame(scene);
+
+	// the impostors write the depth they trace with their own permutation, and the terrains
+	// are drawn with the uniforms one, each used only if there are some
+	const uint passMask = streamFeatures() | MultiView | SphereImpostor | PackedVertices;
+	std::vector<uint> passFeatures = {frame.baseFeatures, frame.baseFeatures | SphereImpostor};
+	if (frame.baseFeatures)
+		passFeatures.push_back(0);
+	for (size_t view = 0; view < viewPasses(); ++view)
 	{
-		scene.texture(m.ksTextureId).bind(2);
-		glUniform1i(uUseKsTexture, 1);
+		beginViewPass(view);
+		for (uint features : passFeatures)
+		{
+			const Variant* v = nullptr;
+			for (uint p : depthOrder)
+			{
+				if ((packets[p].features & passMask) != features)
+					continue;
+				if (!v)
+				{
+					v = &variant(features | DepthOnly);
+					useVariant(*v, scene, frame.viewMatrices[view], frame.projMatrices[view]);
+				}
+				if (features & InstanceBuffer)
+					drawStreamed(scene, packets[p], drawIndex[p]);
+				else
+					drawPacket(*v, scene, packets[p]);
+			}
+		}
 	}
-	else
+
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	scene.unbind();
+}
+
+void LightRenderer::render(const Scene &scene, const std::vector<View>& views) const
+{
+	if (!frame.prepared)
+		prepareFrame(scene, views);
+	frame.prepared = false;
+
+	if (order.empty() && sprites.empty())
+		return;
+	bool streamed = frame.baseFeatures & InstanceBuffer;
+
+	glEnable(GL_DEPTH_TEST);
+	// with the prepass, the depths are already written, only the visible fragments are shaded
+	glDepthFunc(depthFunc(*views[0].camera, depthPrepass));
+	if (depthPrepass)
+		glDepthMask(GL_FALSE);
+	bindFrame(scene);
+
+	// for each packet, bind the textures of its material then draw it,
+	// the matrices and material colors being either streamed or set with uniforms
+	for (size_t view = 0; view < viewPasses(); ++view)
 	{
-		glUniform1i(uUseKsTexture, 0);
+		beginViewPass(view);
+		const Variant* v = nullptr;
+		for(size_t k = 0; k < order.size(); ++k)
+		{
+			const DrawPacket& packet = packets[order[k].second];
+			if (!v || order[k].first != order[k-1].first)
+			{
+				v = &variant(packet.features);
+				useVariant(*v, scene, frame.viewMatrices[view], frame.projMatrices[view]);
+			}
+			bindMaterial(*packet.material, scene);
+			if (packet.features & InstanceBuffer)
+				drawStreamed(scene, packet, k);
+			else
+				drawPacket(*v, scene, packet);
+		}
+		drawSprites(scene, view);
 	}
-	if (m.normalTextureId>=0)
+
+	if (depthPrepass)
+		glDepthMask(GL_TRUE);
+	// the instances are only uploaded when there are packets
+	if (streamed && !order.empty())
+		instanceStream.endFrame();
+	scene.unbind();
+}
+
+Renderer::CullingStats LightRenderer::takeCullingStats()
+{
+	CullingStats stats = cullingStats;
+	cullingStats = CullingStats{0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	return stats;
+}
+
+void LightRenderer::bindMaterial(const Material&, const Scene&) const
+{}
+
+uint LightRenderer::materialFeatures(const Material&) const
+{
+	return 0;
+}
+
+uint LightRenderer::shadingFeatures() const
+{
+	return 0;
+}
+
+Material LightRenderer::distantMaterial(const Material& m, const Scene&) const
+{
+	return m;
+}
+
+/**
+ * The sprites write their depth so that the sky drawn last with the depth prepass stays behind them.
+ * Their color is premultiplied by the part of the pixel they cover, in alpha
+ */
+void LightRenderer::drawSprites(const Scene& scene, size_t view) const
+{
+	if (sprites.empty())
+		return;
+
+	GLsizeiptr size = sprites.size() * sizeof(PointSprite);
+	if (glimac::hasDirectStateAccess())
 	{
-		scene.texture(m.normalTextureId).bind(3);
-		glUniform1i(uUseNormalTexture, 1);
+		if (!spriteVAO)
+		{
+			glCreateBuffers(1, &spriteBuffer);
+			glCreateVertexArrays(1, &spriteVAO);
+			glVertexArrayVertexBuffer(spriteVAO, 0, spriteBuffer, 0, sizeof(PointSprite));
+			glEnableVertexArrayAttrib(spriteVAO, 0);
+			glVertexArrayAttribFormat(spriteVAO, 0, 4, GL_FLOAT, GL_FALSE, offsetof(PointSprite, sphere));
+			glVertexArrayAttribBinding(spriteVAO, 0, 0);
+			glEnableVertexArrayAttrib(spriteVAO, 1);
+			glVertexArrayAttribFormat(spriteVAO, 1, 3, GL_FLOAT, GL_FALSE, offsetof(PointSprite, kd));
+			glVertexArrayAttribBinding(spriteVAO, 1, 0);
+			glEnableVertexArrayAttrib(spriteVAO, 2);
+			glVertexArrayAttribFormat(spriteVAO, 2, 3, GL_FLOAT, GL_FALSE, offsetof(PointSprite, ka));
+			glVertexArrayAttribBinding(spriteVAO, 2, 0);
+		}
+		glNamedBufferData(spriteBuffer, size, sprites.data(), GL_STREAM_DRAW);
+		glBindVertexArray(spriteVAO);
 	}
 	else
 	{
-		glUniform1i(uUseNormalTexture, 0);
+		if (!spriteVAO)
+		{
+			glGenBuffers(1, &spriteBuffer);
+			glGenVertexArrays(1, &spriteVAO);
+			glBindVertexArray(spriteVAO);
+			glBindBuffer(GL_ARRAY_BUFFER, spriteBuffer);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(PointSprite),
+								  (GLvoid*) offsetof(PointSprite, sphere));
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(PointSprite),
+								  (GLvoid*) offsetof(PointSprite, kd));
+			glEnableVertexAttribArray(2);
+			glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(PointSprite),
+								  (GLvoid*) offsetof(PointSprite, ka));
+		}
+		glBindVertexArray(spriteVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, spriteBuffer);
+		glBufferData(GL_ARRAY_BUFFER, size, sprites.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_TRUE);
+	// with MultiView, the packets are drawn in a single pass: the sprites are drawn in each viewport
+	bool everyView = frame.baseFeatures & MultiView;
+	size_t first = everyView ? 0 : view;
+	size_t last = everyView ? frame.viewMatrices.size() : view + 1;
+	for (size_t v = first; v < last; ++v)
+	{
+		if (everyView)
+		{
+			const glm::ivec4& viewport = frame.viewports[v];
+			glViewport(viewport.x, viewport.y, viewport.z, viewport.w);
+		}
+		useVariant(pointVariant, scene, frame.viewMatrices[v], frame.projMatrices[v]);
+		glUniform1f(pointVariant.uPixelScale, frame.projMatrices[v][1][1] * 0.5f * frame.viewports[v].w);
+		glDrawArrays(GL_POINTS, 0, sprites.size());
+	}
+	glDisable(GL_BLEND);
+	if (depthPrepass)
+		glDepthMask(GL_FALSE);
+
+	bindFrame(scene);
+}
+
+
+
+TextureAndLightRenderer::TextureAndLightRenderer()
+{}
+
+void TextureAndLightRenderer::loadProgram(glimac::ProgramBuilder& builder)
+{
+	LightRenderer::loadProgram(builder);
+	uint features = programFeatures | shadingFeatures() | KaTexture | KdTexture;
+	permutations.submit(features, builder);
+	permutations.submit(features | SphereImpostor, builder);
+	permutations.submit(shadingFeatures() | KaTexture | KdTexture, builder);
+}
+
+void TextureAndLightRenderer::loadUniforms()
+{
+	LightRenderer::loadUniforms();
+	uint features = programFeatures | shadingFeatures() | KaTexture | KdTexture;
+	variant(features);
+	variant(features | SphereImpostor);
+	variant(shadingFeatures() | KaTexture | KdTexture);
+}
+
+void TextureAndLightRenderer::bindMaterial(const Material &m, const Scene& scene) const
+{
+	if (m.kaTextureId>=0)
+		scene.texture(m.kaTextureId).bind(KaTextureUnit);
+	if (m.kdTextureId>=0)
+		scene.texture(m.kdTextureId).bind(KdTextureUnit);
+	if (m.ksTextureId>=0)
+		scene.texture(m.ksTextureId).bind(KsTextureUnit);
+	if (m.normalTextureId>=0)
+		scene.texture(m.normalTextureId).bind(NormalTextureUnit);
+}
+
+Material TextureAndLightRenderer::distantMaterial(const Material& m, const Scene& scene) const
+{
+	Material distant = m;
+	if (m.kaTextureId>=0)
+		distant.ka *= scene.texture(m.kaTextureId).meanColor;
+	if (m.kdTextureId>=0)
+		distant.kd *= scene.texture(m.kdTextureId).meanColor;
+	if (m.ksTextureId>=0)
+		distant.ks *= scene.texture(m.ksTextureId).meanColor;
+	return distant;
+}
+
+uint TextureAndLightRenderer::materialFeatures(const Material& m) const
+{
+	uint features = 0;
+	if (m.kaTextureId>=0)
+		features |= KaTexture;
+	if (m.kdTextureId>=0)
+		features |= KdTexture;
+	if (m.ksTextureId>=0)
+		features |= KsTexture;
+	if (m.normalTextureId>=0)
+		features |= NormalTexture;
+	return features;
+}
+
+uint TextureAndLightRenderer::shadingFeatures() const
+{
+	return SteepPointFalloff;
 }
 
 SkyboxRenderer::SkyboxRenderer()
 	{}
 
-void SkyboxRenderer::loadProgram()
+void SkyboxRenderer::loadProgram(glimac::ProgramBuilder& builder)
 {
-	program = glimac::loadProgram(
+	builder.submit(program,
 				SpacImac::instance()->getFilePath("shaders/skybox.vs.glsl"),
 				SpacImac::instance()->getFilePath("shaders/skybox.fs.glsl")
 				);
@@ -263,14 +1150,26 @@ void SkyboxRenderer::loadUniforms()
 	Renderer::loadUniforms();
 
 	uTexture = glGetUniformLocation(program.getGLId(), "uTexture");
+	uFarDepth = glGetUniformLocation(program.getGLId(), "uFarDepth");
+	uPositionDecode = glGetUniformLocation(program.getGLId(), "uPositionDecode");
 }
 
-void SkyboxRenderer::render(const Scene &scene, const BaseCamera &camera) const
+void SkyboxRenderer::render(const Scene &scene, const std::vector<View>& views) const
 {
 	if (scene.skybox().meshId < 0)
 		return;
-	// Disable depth to always the sky in background
-	glDisable(GL_DEPTH_TEST);
+	if (depthPrepass)
+	{
+		// The sky is on the far plane: only the pixels still at the clear depth are shaded
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(depthFunc(*views[0].camera, true));
+		glDepthMask(GL_FALSE);
+	}
+	else
+	{
+		// Disable depth to always the sky in background
+		glDisable(GL_DEPTH_TEST);
+	}
 
 	program.use();
 	scene.bind();
@@ -280,17 +1179,27 @@ void SkyboxRenderer::render(const Scene &scene, const BaseCamera &camera) const
 	t.bind(30);
 	glUniform1i(uTexture, 30);
 
-	glm::mat4 viewMatrix = camera.getViewMatrix();
-	viewMatrix[3].x *= 0.01f; // low camera translation given that the sky is far far away
-	viewMatrix[3].y *= 0.01f;
-	viewMatrix[3].z *= 0.01f;
-	glm::mat4 projMatrix = camera.getProjectionMatrix(SpacImac::instance()->viewWidth(), SpacImac::instance()->viewHeight());
-	glm::mat4 MVMatrix = viewMatrix * scene.skybox().transform.getModelMatrix();
-	glm::mat4 MVPMatrix = projMatrix * MVMatrix;
+	for (const View& view : views)
+	{
+		if (views.size() > 1)
+			glViewport(view.viewport.x, view.viewport.y, view.viewport.z, view.viewport.w);
+		glm::mat4 viewMatrix = view.getViewMatrix();
+		viewMatrix[3].x *= 0.01f; // low camera translation given that the sky is far far away
+		viewMatrix[3].y *= 0.01f;
+		viewMatrix[3].z *= 0.01f;
+		glm::mat4 projMatrix = view.getProjectionMatrix();
+		const Mesh& mesh = scene.mesh(scene.skybox().meshId);
+		glm::mat4 MVMatrix = viewMatrix * scene.skybox().transform.getModelMatrix() * mesh.positionDecode;
+		glm::mat4 MVPMatrix = projMatrix * MVMatrix;
 
-	glUniformMatrix4fv(uMVPMatrix, 1, GL_FALSE, glm::value_ptr(MVPMatrix));
+		glUniformMatrix4fv(uMVPMatrix, 1, GL_FALSE, glm::value_ptr(MVPMatrix));
+		glUniform1f(uFarDepth, view.camera->reverseZ ? 0.f : 1.f);
+		glUniformMatrix4fv(uPositionDecode, 1, GL_FALSE, glm::value_ptr(mesh.positionDecode));
 
-	scene.mesh(scene.skybox().meshId).draw();
+		mesh.draw();
+	}
 
 	scene.unbind();
+	if (depthPrepass)
+		glDepthMask(GL_TRUE);
 }
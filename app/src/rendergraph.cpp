@@ -0,0 +1,475 @@
+#include "rendergraph.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+bool RenderGraph::TextureDesc::operator==(const TextureDesc &other) const
+{
+	return width == other.width && height == other.height && internalFormat == other.internalFormat;
+}
+
+bool RenderGraph::TextureDesc::isDepth() const
+{
+	switch (internalFormat)
+	{
+	case GL_DEPTH_COMPONENT16:
+	case GL_DEPTH_COMPONENT24:
+	case GL_DEPTH_COMPONENT32:
+	case GL_DEPTH_COMPONENT32F:
+	case GL_DEPTH24_STENCIL8:
+	case GL_DEPTH32F_STENCIL8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+size_t RenderGraph::TextureDesc::byteSize() const
+{
+	size_t pixelSize;
+	switch (internalFormat)
+	{
+	case GL_R8:
+		pixelSize = 1;
+		break;
+	case GL_DEPTH_COMPONENT16:
+	case GL_RG8:
+	case GL_R16F:
+		pixelSize = 2;
+		break;
+	case GL_RGBA16F:
+	case GL_RG32F:
+	case GL_DEPTH32F_STENCIL8:
+		pixelSize = 8;
+		break;
+	case GL_RGBA32F:
+		pixelSize = 16;
+		break;
+	default:
+		pixelSize = 4;
+		break;
+	}
+	return pixelSize * width * height;
+}
+
+RenderGraph::PassContext::PassContext(const RenderGraph &graph)
+	: graph(graph)
+{}
+
+GLuint RenderGraph::PassContext::texture(ResourceId resource) const
+{
+	int physical = graph.resources[resource].physical;
+	return physical >= 0 ? graph.physicalTextures[physical].id : 0;
+}
+
+RenderGraph::RenderGraph()
+	: frame(0), m_transientMemory(0), m_transientMemoryWithoutAliasing(0)
+{}
+
+RenderGraph::~RenderGraph()
+{
+	for (auto& framebuffer : framebuffers)
+		glDeleteFramebuffers(1, &framebuffer.second);
+	for (auto& texture : physicalTextures)
+		glDeleteTextures(1, &texture.id);
+	for (auto& timer : timers)
+		glDeleteQueries(PassTimer::QueryCount, timer.second.queries);
+}
+
+void RenderGraph::reset()
+{
+	resources.clear();
+	passes.clear();
+}
+
+RenderGraph::ResourceId RenderGraph::importBackbuffer(const std::string &name, GLint x, GLint y,
+													  GLsizei width, GLsizei height)
+{
+	Resource r;
+	r.name = name;
+	r.imported = true;
+	r.desc = TextureDesc{width, height, GL_RGBA8};
+	r.viewport[0] = x;
+	r.viewport[1] = y;
+	r.viewport[2] = width;
+	r.viewport[3] = height;
+	r.physical = -1;
+	resources.push_back(r);
+	return resources.size() - 1;
+}
+
+RenderGraph::ResourceId RenderGraph::createTexture(const std::string &name, const TextureDesc &desc)
+{
+	Resource r;
+	r.name = name;
+	r.imported = false;
+	r.desc = desc;
+	r.viewport[0] = r.viewport[1] = 0;
+	r.viewport[2] = desc.width;
+	r.viewport[3] = desc.height;
+	r.physical = -1;
+	resources.push_back(r);
+	return resources.size() - 1;
+}
+
+RenderGraph::PassId RenderGraph::addPass(const std::string &name, const PassFunction &function)
+{
+	Pass p;
+	p.name = name;
+	p.function = function;
+	p.sideEffect = false;
+	p.culled = false;
+	p.barriers = 0;
+	passes.push_back(p);
+	return passes.size() - 1;
+}
+
+void RenderGraph::read(PassId pass, ResourceId resource, Access access)
+{
+	passes[pass].reads.push_back(ResourceUse{resource, access});
+}
+
+void RenderGraph::write(PassId pass, ResourceId resource, Access access)
+{
+	passes[pass].writes.push_back(ResourceUse{resource, access});
+}
+
+void RenderGraph::setSideEffect(PassId pass)
+{
+	passes[pass].sideEffect = true;
+}
+
+/**
+ * Walk the passes backward: a pass is kept if it has side effects or writes
+ * a resource needed by a kept pass or by the output, then its inputs become needed
+ */
+void RenderGraph::cull()
+{
+	std::vector<bool> needed(resources.size(), false);
+	for (size_t r = 0; r < resources.size(); ++r)
+		needed[r] = resources[r].imported;
+
+	for (auto pass = passes.rbegin(); pass != passes.rend(); ++pass)
+	{
+		bool keep = pass->sideEffect;
+		for (const ResourceUse& w : pass->writes)
+			keep = keep || needed[w.resource];
+		pass->culled = !keep;
+		if (keep)
+			for (const ResourceUse& r : pass->reads)
+				needed[r.resource] = true;
+	}
+}
+
+/**
+ * Walk the kept passes in order, tracking the last writer of each resource
+ * to find the reads of data written as images or storage, which GL doesn't synchronize
+ */
+void RenderGraph::computeBarriers()
+{
+	for (Resource& r : resources)
+	{
+		r.lastWriter = -1;
+		r.lastWriteAccess = AttachmentAccess;
+		r.firstUse = -1;
+		r.lastUse = -1;
+	}
+
+	for (size_t p = 0; p < passes.size(); ++p)
+	{
+		Pass& pass = passes[p];
+		pass.barriers = 0;
+		if (pass.culled)
+			continue;
+
+		for (const ResourceUse& use : pass.reads)
+		{
+			Resource& r = resources[use.resource];
+			if (!r.imported && r.lastWriter < 0)
+				throw std::logic_error("render graph: pass " + pass.name + " reads " + r.name
+									   + " before it is written");
+			if (r.lastWriter >= 0 && r.lastWriteAccess == StorageAccess)
+			{
+				if (use.access == SampledAccess)
+					pass.barriers |= GL_TEXTURE_FETCH_BARRIER_BIT;
+				else
+					pass.barriers |= GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT;
+			}
+		}
+		for (const ResourceUse& use : pass.writes)
+		{
+			Resource& r = resources[use.resource];
+			if (use.access == AttachmentAccess && r.lastWriter >= 0 && r.lastWriteAccess == StorageAccess)
+				pass.barriers |= GL_FRAMEBUFFER_BARRIER_BIT;
+			r.lastWriter = p;
+			r.lastWriteAccess = use.access;
+		}
+
+		for (const std::vector<ResourceUse>* uses : {&pass.reads, &pass.writes})
+			for (const ResourceUse& use : *uses)
+			{
+				Resource& r = resources[use.resource];
+				if (r.firstUse < 0)
+					r.firstUse = p;
+				r.lastUse = p;
+			}
+	}
+}
+
+/**
+ * The transient resources are given a physical texture in the order of their first use,
+ * reusing a texture of the same description whose previous resource is not used anymore
+ */
+void RenderGraph::allocateTextures()
+{
+	// delete the textures unused for a while, with the framebuffers which may reference them
+	size_t kept = 0;
+	for (size_t t = 0; t < physicalTextures.size(); ++t)
+	{
+		if (frame - physicalTextures[t].lastFrame > TextureLifetime)
+			glDeleteTextures(1, &physicalTextures[t].id);
+		else
+			physicalTextures[kept++] = physicalTextures[t];
+	}
+	if (kept != physicalTextures.size())
+	{
+		physicalTextures.resize(kept);
+		for (auto& framebuffer : framebuffers)
+			glDeleteFramebuffers(1, &framebuffer.second);
+		framebuffers.clear();
+	}
+	for (PhysicalTexture& t : physicalTextures)
+		t.busyUntil = -1;
+
+	std::vector<ResourceId> transients;
+	for (size_t r = 0; r < resources.size(); ++r)
+		if (!resources[r].imported && resources[r].firstUse >= 0)
+			transients.push_back(r);
+	std::stable_sort(transients.begin(), transients.end(), [this](ResourceId a, ResourceId b)
+	{
+		return resources[a].firstUse < resources[b].firstUse;
+	});
+
+	m_transientMemory = 0;
+	m_transientMemoryWithoutAliasing = 0;
+	for (ResourceId id : transients)
+	{
+		Resource& r = resources[id];
+		m_transientMemoryWithoutAliasing += r.desc.byteSize();
+
+		r.physical = -1;
+		for (size_t t = 0; t < physicalTextures.size() && r.physical < 0; ++t)
+			if (physicalTextures[t].desc == r.desc && physicalTextures[t].busyUntil < r.firstUse)
+				r.physical = t;
+		if (r.physical < 0)
+		{
+			PhysicalTexture t;
+			t.desc = r.desc;
+			t.id = createTexture(r.desc);
+			t.busyUntil = -1;
+			physicalTextures.push_back(t);
+			r.physical = physicalTextures.size() - 1;
+		}
+
+		PhysicalTexture& t = physicalTextures[r.physical];
+		if (t.busyUntil < 0)
+			m_transientMemory += t.desc.byteSize();
+		t.busyUntil = r.lastUse;
+		t.lastFrame = frame;
+	}
+}
+
+GLuint RenderGraph::createTexture(const TextureDesc &desc) const
+{
+	GLuint id;
+	if (glimac::hasDirectStateAccess())
+	{
+		glCreateTextures(GL_TEXTURE_2D, 1, &id);
+		glTextureStorage2D(id, 1, desc.internalFormat, desc.width, desc.height);
+		glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTextureParameteri(id, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(id, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		return id;
+	}
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
+	glTexStorage2D(GL_TEXTURE_2D, 1, desc.internalFormat, desc.width, desc.height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return id;
+}
+
+/**
+ * The attachments are the resources written with AttachmentAccess: the backbuffer alone,
+ * or textures, attached as depth or as the next color attachment according to their format
+ */
+void RenderGraph::bindFramebuffer(const Pass &pass)
+{
+	std::vector<const Resource*> attachments;
+	for (const ResourceUse& use : pass.writes)
+		if (use.access == AttachmentAccess)
+			attachments.push_back(&resources[use.resource]);
+	if (attachments.empty())
+		return;
+
+	if (attachments[0]->imported)
+	{
+		if (attachments.size() > 1)
+			throw std::logic_error("render graph: pass " + pass.name + " writes the backbuffer and textures");
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(attachments[0]->viewport[0], attachments[0]->viewport[1],
+				   attachments[0]->viewport[2], attachments[0]->viewport[3]);
+		return;
+	}
+
+	std::vector<GLuint> key;
+	for (const Resource* r : attachments)
+	{
+		if (r->imported)
+			throw std::logic_error("render graph: pass " + pass.name + " writes the backbuffer and textures");
+		key.push_back(physicalTextures[r->physical].id);
+	}
+
+	auto it = framebuffers.find(key);
+	if (it == framebuffers.end())
+	{
+		GLuint fbo;
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		std::vector<GLenum> drawBuffers;
+		for (const Resource* r : attachments)
+		{
+			GLenum attachment;
+			if (r->desc.internalFormat == GL_DEPTH24_STENCIL8 || r->desc.internalFormat == GL_DEPTH32F_STENCIL8)
+				attachment = GL_DEPTH_STENCIL_ATTACHMENT;
+			else if (r->desc.isDepth())
+				attachment = GL_DEPTH_ATTACHMENT;
+			else
+			{
+				attachment = GL_COLOR_ATTACHMENT0 + drawBuffers.size();
+				drawBuffers.push_back(attachment);
+			}
+			glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, physicalTextures[r->physical].id, 0);
+		}
+		if (drawBuffers.empty())
+			glDrawBuffer(GL_NONE);
+		else
+			glDrawBuffers(drawBuffers.size(), drawBuffers.data());
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			throw std::runtime_error("render graph: framebuffer of pass " + pass.name + " is incomplete");
+		it = framebuffers.insert(std::make_pair(key, fbo)).first;
+	}
+	else
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, it->second);
+	}
+	glViewport(0, 0, attachments[0]->desc.width, attachments[0]->desc.height);
+}
+
+RenderGraph::PassTimer &RenderGraph::timer(const std::string &name)
+{
+	auto it = timers.find(name);
+	if (it != timers.end())
+		return it->second;
+
+	PassTimer t;
+	glGenQueries(PassTimer::QueryCount, t.queries);
+	std::fill(t.pending, t.pending + PassTimer::QueryCount, false);
+	t.order = timers.size();
+	t.cpuTotal = t.gpuTotal = 0;
+	t.cpuSamples = t.gpuSamples = t.culledFrames = 0;
+	return timers.insert(std::make_pair(name, t)).first->second;
+}
+
+/**
+ * The GPU time of a pass is read QueryCount frames after its query, when the result is
+ * available, so that the CPU never waits for it
+ */
+void RenderGraph::execute()
+{
+	cull();
+	computeBarriers();
+	allocateTextures();
+
+	PassContext context(*this);
+	uint slot = frame % PassTimer::QueryCount;
+	for (Pass& pass : passes)
+	{
+		PassTimer& t = timer(pass.name);
+		if (pass.culled)
+		{
+			++t.culledFrames;
+			continue;
+		}
+
+		GLuint query = t.queries[slot];
+		if (t.pending[slot])
+		{
+			GLint available = 0;
+			glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint64 elapsed;
+				glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+				t.gpuTotal += elapsed * 1e-6;
+				++t.gpuSamples;
+			}
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		if (pass.barriers)
+			glMemoryBarrier(pass.barriers);
+		bindFramebuffer(pass);
+		pass.function(context);
+		glEndQuery(GL_TIME_ELAPSED);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		t.pending[slot] = true;
+		t.cpuTotal += elapsed.count();
+		++t.cpuSamples;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	++frame;
+}
+
+std::vector<RenderGraph::PassTiming> RenderGraph::timings() const
+{
+	std::vector<PassTiming> result(timers.size());
+	for (const auto& timer : timers)
+	{
+		const PassTimer& t = timer.second;
+		PassTiming& timing = result[t.order];
+		timing.name = timer.first;
+		timing.cpuTime = t.cpuSamples ? t.cpuTotal / t.cpuSamples : 0;
+		timing.gpuTime = t.gpuSamples ? t.gpuTotal / t.gpuSamples : 0;
+		timing.executedFrames = t.cpuSamples;
+		timing.culledFrames = t.culledFrames;
+	}
+	return result;
+}
+
+void RenderGraph::resetTimings()
+{
+	for (auto& timer : timers)
+	{
+		PassTimer& t = timer.second;
+		t.cpuTotal = t.gpuTotal = 0;
+		t.cpuSamples = t.gpuSamples = t.culledFrames = 0;
+	}
+}
+
+size_t RenderGraph::transientMemory() const
+{
+	return m_transientMemory;
+}
+
+size_t RenderGraph::transientMemoryWithoutAliasing() const
+{
+	return m_transientMemoryWithoutAliasing;
+}
@@ -1,19 +1,147 @@
 #include "scene.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <unordered_map>
 #include <vector>
 
+#include "glm/gtc/packing.hpp"
+
+namespace {
+
+/**
+ * FNV-1a hash of the bytes, the seed being mixed in first
+ */
+size_t hashBytes(const void* data, size_t size, size_t seed = 0)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t hash = 14695981039346656037ull ^ seed;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return size_t(hash);
+}
+
+/**
+ * @return true if the vertices are equal bit for bit, as hashed by hashBytes
+ */
+bool sameVertices(const glimac::Geometry::Vertex* a, const glimac::Geometry::Vertex* b, size_t count)
+{
+	return std::memcmp(a, b, count * sizeof(glimac::Geometry::Vertex)) == 0;
+}
+
+/**
+ * Closest point of the triangle abc to p (Ericson, Real-Time Collision Detection 5.1.5)
+ */
+glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+	glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+	if (d1 <= 0 && d2 <= 0)
+		return a;
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+	if (d3 >= 0 && d4 <= d3)
+		return b;
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0)
+		return a + ab * (d1 / (d1 - d3));
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+	if (d6 >= 0 && d5 <= d6)
+		return c;
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0)
+		return a + ac * (d2 / (d2 - d6));
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	float denominator = 1.f / (va + vb + vc);
+	return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+/**
+ * @return true if the ray from origin crosses the triangle abc (Moller and Trumbore)
+ */
+bool rayCrossesTriangle(const glm::vec3& origin, const glm::vec3& direction,
+						const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+	glm::vec3 ab = b - a, ac = c - a;
+	glm::vec3 p = glm::cross(direction, ac);
+	float determinant = glm::dot(ab, p);
+	if (std::abs(determinant) < 1e-12f)
+		return false;
+	glm::vec3 ao = origin - a;
+	float u = glm::dot(ao, p) / determinant;
+	if (u < 0 || u > 1)
+		return false;
+	glm::vec3 q = glm::cross(ao, ab);
+	float v = glm::dot(direction, q) / determinant;
+	if (v < 0 || u + v > 1)
+		return false;
+	return glm::dot(ac, q) / determinant > 0;
+}
+
+/**
+ * The ball around center closer to no triangle than the returned radius is inside the mesh
+ * if center is, a ray from it crossing the triangles an odd number of times.
+ * @return 0 if center is outside, or the mesh open
+ */
+float innerRadius(const glimac::Geometry::Vertex* vertices, const unsigned int* index, int indexCount,
+				  const glm::vec3& center)
+{
+	// a direction unlikely to go through an edge or a vertex
+	const glm::vec3 direction = glm::normalize(glm::vec3(0.5773f, 0.6187f, 0.5326f));
+	float radius = std::numeric_limits<float>::max();
+	int crossings = 0;
+	for (int j = 0; j + 2 < indexCount; j += 3)
+	{
+		const glm::vec3& a = vertices[index[j]].m_Position;
+		const glm::vec3& b = vertices[index[j + 1]].m_Position;
+		const glm::vec3& c = vertices[index[j + 2]].m_Position;
+		radius = std::min(radius, glm::length(closestPointOnTriangle(center, a, b, c) - center));
+		if (rayCrossesTriangle(center, direction, a, b, c))
+			++crossings;
+	}
+	return crossings % 2 == 1 ? radius : 0;
+}
+
+/**
+ * @return the mean length of the longest edge of the triangles
+ */
+float longestEdgeLength(const glimac::Geometry::Vertex* vertices, const unsigned int* index, int indexCount)
+{
+	float sum = 0;
+	int count = 0;
+	for (int j = 0; j + 2 < indexCount; j += 3, ++count)
+	{
+		const glm::vec3& a = vertices[index[j]].m_Position;
+		const glm::vec3& b = vertices[index[j + 1]].m_Position;
+		const glm::vec3& c = vertices[index[j + 2]].m_Position;
+		sum += std::max(glm::length(b - a), std::max(glm::length(c - b), glm::length(a - c)));
+	}
+	return count ? sum / count : 0;
+}
+
+}
+
 Scene::Scene()
 	: ambiantLight{glm::vec3(0.2,0.2,0.2), 1},
 		directionalLight{glm::vec3(-0.7f,-0.7,0.f),glm::vec3(0.2,0.3f,0.2),1},
 		pointLight{glm::vec3(1,1,1), glm::vec3(0.2,0.3,0.7),3},
-		m_VAOid(0), m_VBOid(0), m_IBOid(0), m_skybox(-1),
-		m_initialized(false)
+		m_VAOid(0), m_pullingVAOid(0), m_VBOid(0), m_IBOid(0), m_skybox(-1),
+		m_packedVertices(false), m_initialized(false)
 	{}
 
 Scene::~Scene()
 {
 	if(m_VAOid)
 		glDeleteVertexArrays(1, &m_VAOid);
+	if(m_pullingVAOid)
+		glDeleteVertexArrays(1, &m_pullingVAOid);
 	if(m_VBOid)
 		glDeleteBuffers(1, &m_VBOid);
 	if(m_IBOid)
@@ -27,48 +155,166 @@ Scene::~Scene()
 uint Scene::addMeshes(const glimac::Geometry &geometry)
 {
 	const glimac::Geometry::Mesh* meshes = geometry.getMeshBuffer();
-	const glimac::Geometry::Vertex* vertices = geometry.getVertexBuffer();
 	const glimac::Geometry::Material* materials = geometry.getMaterialBuffer();
-	const unsigned int* index = geometry.getIndexBuffer();
 	unsigned int firstindex = this->meshes.size();
 
+	/* Weld the vertices of the geometry which are equal bit for bit,
+	 * the indices of the geometry being remapped to the welded vertices
+	 */
+	std::vector<glimac::Geometry::Vertex> vertices;
+	std::vector<GLuint> remap(geometry.getVertexCount());
+	std::unordered_multimap<size_t, GLuint> vertexHashes;
+	vertices.reserve(geometry.getVertexCount());
+	for (int i=0; i<geometry.getVertexCount(); ++i)
+	{
+		const glimac::Geometry::Vertex& vertex = geometry.getVertexBuffer()[i];
+		size_t hash = hashBytes(&vertex, sizeof(vertex));
+		remap[i] = vertices.size();
+		auto candidates = vertexHashes.equal_range(hash);
+		for (auto it = candidates.first; it != candidates.second; ++it)
+		{
+			if (sameVertices(&vertices[it->second], &vertex, 1))
+			{
+				remap[i] = it->second;
+				break;
+			}
+		}
+		if (remap[i] == vertices.size())
+		{
+			vertexHashes.emplace(hash, remap[i]);
+			vertices.push_back(vertex);
+		}
+	}
+
+	/* The geometries with the same welded vertices share the vertex range of the first one,
+	 * whose box quantizes them in the packed format
+	 */
+	size_t vertexHash = hashBytes(vertices.data(), vertices.size() * sizeof(glimac::Geometry::Vertex));
+	uint range = geometryRanges.size();
+	auto sameRanges = geometryHashes.equal_range(vertexHash);
+	for (auto it = sameRanges.first; it != sameRanges.second; ++it)
+	{
+		const GeometryRange& other = geometryRanges[it->second];
+		if (other.vertexCount == vertices.size()
+			&& sameVertices(&this->vertices[other.firstVertex], vertices.data(), vertices.size()))
+		{
+			range = it->second;
+			break;
+		}
+	}
+	if (range == geometryRanges.size())
+	{
+		geometryHashes.emplace(vertexHash, range);
+		geometryRanges.push_back(GeometryRange{uint(this->vertices.size()), uint(vertices.size())});
+		this->vertices.insert(this->vertices.end(), vertices.begin(), vertices.end());
+	}
+	GLuint firstVertex = geometryRanges[range].firstVertex;
+
 	/* for each mesh in geometry
-	 * We create a new mesh, set the index count and define the index offset as the
-	 * index of the last vertice + 1 (start of the new mesh)
+	 * A mesh with the same indices in the same vertex range as an added one shares its
+	 * indices, meshlets and bounds. Otherwise, we create a new mesh, set the index count
+	 * and define the index offset as the end of the vertices index
 	 * If a material is affected, create the material and
 	 * define the material id with the new one
-	 * Add vertices index
+	 * Add vertices index, grouped by meshlet if there are several
 	 */
+	std::vector<GLuint> index;
 	for (int i=0; i<geometry.getMeshCount(); ++i)
 	{
 		glimac::Geometry::Mesh mesh = meshes[i];
+		index.resize(mesh.m_nIndexCount);
+		for (int j=0; j<mesh.m_nIndexCount; ++j)
+			index[j] = remap[geometry.getIndexBuffer()[mesh.m_nIndexOffset + j]];
+
+		size_t indexHash = hashBytes(index.data(), index.size() * sizeof(GLuint), range);
+		int source = -1;
+		auto sameMeshes = meshHashes.equal_range(indexHash);
+		for (auto it = sameMeshes.first; it != sameMeshes.second && source < 0; ++it)
+		{
+			const Mesh& other = this->meshes[it->second];
+			if (meshGeometries[it->second] == range && other.indexCount == index.size()
+				&& std::equal(index.begin(), index.end(), this->verticesIndex.begin() + other.indexOffset,
+							  [firstVertex](GLuint a, GLuint b) { return a + firstVertex == b; }))
+				source = it->second;
+		}
+
 		Mesh newMesh;
-		newMesh.indexCount = mesh.m_nIndexCount;
-		newMesh.indexOffset = this->verticesIndex.size();
+		if (source >= 0)
+		{
+			newMesh = this->meshes[source];
+			newMesh.materialId = -1;
+			newMesh.coarserMesh = -1;
+			newMesh.sphereImpostor = -1;
+		}
+		else
+		{
+			newMesh.indexCount = mesh.m_nIndexCount;
+			newMesh.indexOffset = this->verticesIndex.size();
+			glimac::BBox3f bbox(glm::vec3(std::numeric_limits<float>::max()),
+								glm::vec3(-std::numeric_limits<float>::max()));
+			for (GLuint j : index)
+				bbox.grow(vertices[j].m_Position);
+			if (mesh.m_nIndexCount / 3 > Meshlet::MaxTriangles)
+			{
+				std::vector<unsigned int> meshletIndex;
+				newMesh.firstMeshlet = this->meshlets.size();
+				buildMeshlets(vertices.data(), index.data(), mesh.m_nIndexCount, meshletIndex, this->meshlets);
+				newMesh.meshletCount = this->meshlets.size() - newMesh.firstMeshlet;
+				for (uint m = newMesh.firstMeshlet; m < this->meshlets.size(); ++m)
+					this->meshlets[m].indexOffset += newMesh.indexOffset;
+				for (unsigned int j : meshletIndex)
+					this->verticesIndex.push_back(firstVertex + j);
+			}
+			else
+			{
+				for (GLuint j : index)
+					this->verticesIndex.push_back(firstVertex + j);
+			}
+			// the sphere around the box is up to sqrt(3) times too large, the farthest vertex bounds it
+			if (!bbox.empty())
+			{
+				newMesh.boundingCenter = glimac::center(bbox);
+				for (GLuint j : index)
+					newMesh.boundingRadius = std::max(newMesh.boundingRadius,
+													  glm::length(vertices[j].m_Position - newMesh.boundingCenter));
+			}
+			newMesh.occluderRadius = innerRadius(vertices.data(), index.data(), mesh.m_nIndexCount,
+												 newMesh.boundingCenter);
+			newMesh.edgeLength = longestEdgeLength(vertices.data(), index.data(), mesh.m_nIndexCount);
+			meshHashes.emplace(indexHash, this->meshes.size());
+		}
 		if (mesh.m_nMaterialIndex >= 0)
 		{
 			newMesh.materialId = this->materials.size();
 			this->materials.push_back(Material(materials[mesh.m_nMaterialIndex]));
 		}
-		for (int j=mesh.m_nIndexOffset; j<mesh.m_nIndexOffset+mesh.m_nIndexCount; ++j)
-		{
-			this->verticesIndex.push_back(this->vertices.size() + index[j]);
-		}
+		meshGeometries.push_back(range);
 		this->meshes.push_back(newMesh);
 	}
-	/*
-	 * Add all vertices
-	 */
-	for (int i=0; i<geometry.getVertexCount(); ++i)
-	{
-		this->vertices.push_back(vertices[i]);
-	}
 	return firstindex;
 }
 
+void Scene::setLodChain(const std::vector<uint>& meshIds)
+{
+	for (size_t i = 0; i + 1 < meshIds.size(); ++i)
+		meshes[meshIds[i]].coarserMesh = meshIds[i + 1];
+}
+
+void Scene::setSphereImpostor(uint meshId, uint quadId)
+{
+	meshes[meshId].sphereImpostor = quadId;
+}
+
+uint Scene::addTerrain(const glimac::FilePath& tileRoot)
+{
+	terrains.emplace_back(tileRoot);
+	return terrains.size() - 1;
+}
+
 Instance& Scene::makeInstance(uint meshId)
 {
 	instances.push_back(Instance(meshId));
+	indexedInstances.push_back(&instances.back());
 	return instances.back();
 }
 
@@ -105,6 +351,8 @@ uint Scene::addMaterial(const Material &other)
 
 /**
  * Buffers initializing
+ * With direct state access (GL 4.5), create the objects and fill them by their name,
+ * without touching the bindings. Otherwise :
  * Generate with glGenVertexArrays and glGenBuffers
  * Make VBO from vertices (transfer vertices buffer)
  * Make IBO from vertices index (transfer vertices index buffer)
@@ -114,24 +362,170 @@ void Scene::initializeBuffers()
 {
 	if (vertices.empty())
 		throw std::runtime_error("there isn't any mesh in the scene");
+	std::vector<unsigned char> indexBytes;
+	packIndices(verticesIndex, indexBytes);
+
+	std::vector<PackedVertex> packedData;
+	const void* data = vertices.data();
+	size_t size = vertices.size() * sizeof(glimac::Geometry::Vertex);
+	if (m_packedVertices)
+	{
+		packVertices(vertices, packedData);
+		data = packedData.data();
+		size = packedData.size() * sizeof(PackedVertex);
+	}
+
+	if (glimac::hasDirectStateAccess())
+		initializeBuffersDSA(data, size, indexBytes);
+	else
+		initializeBuffersBind(data, size, indexBytes);
+
+	m_initialized = true;
+}
+
+/**
+ * A flat box keeps its axis, whose quantized coordinates are all 0
+ */
+void Scene::packVertices(const std::vector<glimac::Geometry::Vertex>& vertexData,
+						 std::vector<PackedVertex>& packedData)
+{
+	packedData.resize(vertexData.size());
+	std::vector<glm::mat4> decodes(geometryRanges.size(), glm::mat4(1));
+	for (uint r = 0; r < geometryRanges.size(); ++r)
+	{
+		const GeometryRange& range = geometryRanges[r];
+		glimac::BBox3f bbox(glm::vec3(std::numeric_limits<float>::max()),
+							glm::vec3(-std::numeric_limits<float>::max()));
+		for (uint v = range.firstVertex; v < range.firstVertex + range.vertexCount; ++v)
+			bbox.grow(vertexData[v].m_Position);
+		if (bbox.empty())
+			continue;
+		glm::vec3 extent = bbox.upper - bbox.lower;
+		decodes[r] = glm::scale(glm::translate(glm::mat4(1), bbox.lower), extent);
+
+		for (uint v = range.firstVertex; v < range.firstVertex + range.vertexCount; ++v)
+		{
+			const glimac::Geometry::Vertex& vertex = vertexData[v];
+			PackedVertex& packed = packedData[v];
+			for (int c = 0; c < 3; ++c)
+			{
+				float position = extent[c] > 0 ? (vertex.m_Position[c] - bbox.lower[c]) / extent[c] : 0;
+				packed.position[c] = glm::packUnorm1x16(position);
+			}
+			packed.position[3] = 0;
+			packed.normal = glm::packSnorm3x10_1x2(glm::vec4(vertex.m_Normal, 0));
+			packed.texCoords = glm::packHalf2x16(vertex.m_TexCoords);
+		}
+	}
+	for (uint m = 0; m < meshes.size(); ++m)
+		meshes[m].positionDecode = decodes[meshGeometries[m]];
+}
+
+/**
+ * The 32 bits indices stay aligned on 4 bytes after the 16 bits ones.
+ * The meshes sharing an index range share its bytes
+ */
+void Scene::packIndices(const std::vector<GLuint>& indexData, std::vector<unsigned char>& indexBytes)
+{
+	// an empty mesh has the offset of the next one, a range is known by its count too
+	std::map<std::pair<uint, uint>, const Mesh*> packed;
+	for (Mesh& mesh : meshes)
+	{
+		auto shared = packed.find(std::make_pair(mesh.indexOffset, mesh.indexCount));
+		if (shared != packed.end())
+		{
+			mesh.indexType = shared->second->indexType;
+			mesh.baseVertex = shared->second->baseVertex;
+			mesh.indexByteOffset = shared->second->indexByteOffset;
+			continue;
+		}
+		packed.emplace(std::make_pair(mesh.indexOffset, mesh.indexCount), &mesh);
+		GLuint first = std::numeric_limits<GLuint>::max(), last = 0;
+		for (uint j = mesh.indexOffset; j < mesh.indexOffset + mesh.indexCount; ++j)
+		{
+			first = std::min(first, indexData[j]);
+			last = std::max(last, indexData[j]);
+		}
+		if (m_packedVertices && mesh.indexCount > 0 && last - first <= std::numeric_limits<GLushort>::max())
+		{
+			mesh.indexType = GL_UNSIGNED_SHORT;
+			mesh.baseVertex = first;
+			mesh.indexByteOffset = indexBytes.size();
+			indexBytes.resize(indexBytes.size() + mesh.indexCount * sizeof(GLushort));
+			GLushort* index = reinterpret_cast<GLushort*>(&indexBytes[mesh.indexByteOffset]);
+			for (uint j = 0; j < mesh.indexCount; ++j)
+				index[j] = GLushort(indexData[mesh.indexOffset + j] - first);
+		}
+		else
+		{
+			mesh.indexType = GL_UNSIGNED_INT;
+			mesh.baseVertex = 0;
+			mesh.indexByteOffset = (indexBytes.size() + sizeof(GLuint) - 1) / sizeof(GLuint) * sizeof(GLuint);
+			indexBytes.resize(mesh.indexByteOffset + mesh.indexCount * sizeof(GLuint));
+			std::copy(indexData.begin() + mesh.indexOffset, indexData.begin() + mesh.indexOffset + mesh.indexCount,
+					  reinterpret_cast<GLuint*>(&indexBytes[mesh.indexByteOffset]));
+		}
+	}
+}
+
+void Scene::initializeBuffersDSA(const void* vertexData, size_t vertexSize,
+								 const std::vector<unsigned char>& indexData)
+{
+	glCreateVertexArrays(1, &m_VAOid);
+	glCreateBuffers(1, &m_VBOid);
+	glCreateBuffers(1, &m_IBOid);
+
+	glNamedBufferStorage(m_VBOid, vertexSize, vertexData, 0);
+	glNamedBufferStorage(m_IBOid, indexData.size(), indexData.data(), 0);
+
+	glVertexArrayElementBuffer(m_VAOid, m_IBOid);
+
+	glEnableVertexArrayAttrib(m_VAOid, VertexPosition);
+	glEnableVertexArrayAttrib(m_VAOid, VertexNormal);
+	glEnableVertexArrayAttrib(m_VAOid, VertexTexCoord);
+
+	if (m_packedVertices)
+	{
+		glVertexArrayVertexBuffer(m_VAOid, VertexBinding, m_VBOid, 0, sizeof(PackedVertex));
+		glVertexArrayAttribFormat(m_VAOid, VertexPosition, 3, GL_UNSIGNED_SHORT, GL_TRUE,
+								  offsetof(PackedVertex, position));
+		glVertexArrayAttribFormat(m_VAOid, VertexNormal, 4, GL_INT_2_10_10_10_REV, GL_TRUE,
+								  offsetof(PackedVertex, normal));
+		glVertexArrayAttribFormat(m_VAOid, VertexTexCoord, 2, GL_HALF_FLOAT, GL_FALSE,
+								  offsetof(PackedVertex, texCoords));
+	}
+	else
+	{
+		glVertexArrayVertexBuffer(m_VAOid, VertexBinding, m_VBOid, 0, sizeof(glimac::Geometry::Vertex));
+		glVertexArrayAttribFormat(m_VAOid, VertexPosition, 3, GL_FLOAT, GL_FALSE,
+								  offsetof(glimac::Geometry::Vertex, m_Position));
+		glVertexArrayAttribFormat(m_VAOid, VertexNormal, 3, GL_FLOAT, GL_FALSE,
+								  offsetof(glimac::Geometry::Vertex, m_Normal));
+		glVertexArrayAttribFormat(m_VAOid, VertexTexCoord, 2, GL_FLOAT, GL_FALSE,
+								  offsetof(glimac::Geometry::Vertex, m_TexCoords));
+	}
+
+	glVertexArrayAttribBinding(m_VAOid, VertexPosition, VertexBinding);
+	glVertexArrayAttribBinding(m_VAOid, VertexNormal, VertexBinding);
+	glVertexArrayAttribBinding(m_VAOid, VertexTexCoord, VertexBinding);
+
+	glCreateVertexArrays(1, &m_pullingVAOid);
+	glVertexArrayElementBuffer(m_pullingVAOid, m_IBOid);
+}
+
+void Scene::initializeBuffersBind(const void* vertexData, size_t vertexSize,
+								  const std::vector<unsigned char>& indexData)
+{
 	glGenVertexArrays(1, &m_VAOid);
 	glGenBuffers(1, &m_VBOid);
 	glGenBuffers(1, &m_IBOid);
 
 	glBindBuffer(GL_ARRAY_BUFFER, m_VBOid);
-	glBufferData(GL_ARRAY_BUFFER,
-			vertices.size() * sizeof(glimac::Geometry::Vertex),
-			std::vector<glimac::Geometry::Vertex>(std::begin(vertices), std::end(vertices)).data(),
-			GL_STATIC_DRAW
-	);
+	glBufferData(GL_ARRAY_BUFFER, vertexSize, vertexData, GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_IBOid);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-			verticesIndex.size() * sizeof(GLuint),
-			std::vector<GLuint>(std::begin(verticesIndex), std::end(verticesIndex)).data(),
-			GL_STATIC_DRAW
-	);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexData.size(), indexData.data(), GL_STATIC_DRAW);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
 	glBindVertexArray(m_VAOid);
@@ -141,18 +535,44 @@ void Scene::initializeBuffers()
 	glEnableVertexAttribArray(VertexNormal);
 	glEnableVertexAttribArray(VertexTexCoord);
 
-	glVertexAttribPointer(VertexPosition, 3, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
-												(GLvoid*) offsetof(glimac::Geometry::Vertex, m_Position));
-	glVertexAttribPointer(VertexNormal, 3, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
-												(GLvoid*) offsetof(glimac::Geometry::Vertex, m_Normal));
-	glVertexAttribPointer(VertexTexCoord, 2, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
-												(GLvoid*) offsetof(glimac::Geometry::Vertex, m_TexCoords));
+	if (m_packedVertices)
+	{
+		glVertexAttribPointer(VertexPosition, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex),
+							  (GLvoid*) offsetof(PackedVertex, position));
+		glVertexAttribPointer(VertexNormal, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedVertex),
+							  (GLvoid*) offsetof(PackedVertex, normal));
+		glVertexAttribPointer(VertexTexCoord, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex),
+							  (GLvoid*) offsetof(PackedVertex, texCoords));
+	}
+	else
+	{
+		glVertexAttribPointer(VertexPosition, 3, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
+							  (GLvoid*) offsetof(glimac::Geometry::Vertex, m_Position));
+		glVertexAttribPointer(VertexNormal, 3, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
+							  (GLvoid*) offsetof(glimac::Geometry::Vertex, m_Normal));
+		glVertexAttribPointer(VertexTexCoord, 2, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
+							  (GLvoid*) offsetof(glimac::Geometry::Vertex, m_TexCoords));
+	}
 
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_IBOid);
 
 	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	m_initialized = true;
+	glGenVertexArrays(1, &m_pullingVAOid);
+	glBindVertexArray(m_pullingVAOid);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_IBOid);
+	glBindVertexArray(0);
+}
+
+void Scene::setPackedVertices(bool enabled)
+{
+	m_packedVertices = enabled;
+}
+
+bool Scene::hasPackedVertices() const
+{
+	return m_packedVertices;
 }
 
 void Scene::setSkybox(const glimac::Geometry &box, const glimac::FilePath &folderPath)
@@ -168,6 +588,12 @@ void Scene::bind() const
 	glBindVertexArray(m_VAOid);
 }
 
+void Scene::bindVertexPulling() const
+{
+	glBindVertexArray(m_pullingVAOid);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VertexStorageBinding, m_VBOid);
+}
+
 void Scene::unbind() const
 {
 	glBindVertexArray(0);
@@ -193,6 +619,88 @@ bool Scene::initialized() const
 	return m_initialized;
 }
 
+/**
+ * The rotation keeps the radius of the mesh sphere, the largest scale factor bounds it.
+ * The tree is built over the first instances, the later ones are inserted in it
+ */
+void Scene::updateBounds()
+{
+	instanceSpheres.resize(indexedInstances.size());
+	instanceBounds.resize(indexedInstances.size());
+	for (size_t i = 0; i < indexedInstances.size(); ++i)
+	{
+		const Instance& instance = *indexedInstances[i];
+		const Mesh& mesh = meshes[instance.meshId];
+		glm::vec3 scale = glm::abs(instance.transform.scale);
+		glm::vec3 center = glm::vec3(instance.transform.getModelMatrix() * glm::vec4(mesh.boundingCenter, 1));
+		float radius = mesh.boundingRadius * std::max(scale.x, std::max(scale.y, scale.z));
+		instanceSpheres[i] = glm::vec4(center, radius);
+		instanceBounds[i] = glimac::BBox3f(center - radius, center + radius);
+	}
+
+	if (m_bvh.itemCount() == 0)
+	{
+		m_bvh.build(instanceBounds);
+		return;
+	}
+	for (uint i = m_bvh.itemCount(); i < instanceBounds.size(); ++i)
+		m_bvh.insert(i, instanceBounds[i]);
+	m_bvh.refit(instanceBounds);
+}
+
+const BVH& Scene::bvh() const
+{
+	return m_bvh;
+}
+
+uint Scene::instanceCount() const
+{
+	return indexedInstances.size();
+}
+
+const Instance& Scene::instance(uint i) const
+{
+	return *indexedInstances[i];
+}
+
+const glm::vec4& Scene::instanceSphere(uint i) const
+{
+	return instanceSpheres[i];
+}
+
+int Scene::pickInstance(const glm::vec3& origin, const glm::vec3& direction) const
+{
+	return m_bvh.raycast(origin, direction, std::numeric_limits<float>::max(),
+						 [this, &origin, &direction](uint i, float& distance)
+	{
+		// first intersection of the ray and the sphere, the exit one if the origin is inside
+		glm::vec3 offset = origin - glm::vec3(instanceSpheres[i]);
+		float b = glm::dot(offset, direction);
+		float c = glm::dot(offset, offset) - instanceSpheres[i].w * instanceSpheres[i].w;
+		float discriminant = b * b - c;
+		if (discriminant < 0)
+			return false;
+		float t = -b - std::sqrt(discriminant);
+		if (t < 0)
+			t = -b + std::sqrt(discriminant);
+		if (t < 0 || t >= distance)
+			return false;
+		distance = t;
+		return true;
+	});
+}
+
+void Scene::instancesNear(const glm::vec3& point, float distance, std::vector<uint>& result) const
+{
+	m_bvh.overlap(glimac::BBox3f(point - distance, point + distance), [&](uint i)
+	{
+		float reach = distance + instanceSpheres[i].w;
+		glm::vec3 offset = glm::vec3(instanceSpheres[i]) - point;
+		if (glm::dot(offset, offset) < reach * reach)
+			result.push_back(i);
+	});
+}
+
 std::list<Instance>::const_iterator Scene::begin() const
 {
 	return instances.cbegin();
@@ -218,6 +726,11 @@ Material &Scene::material(uint i)
 	return materials[i];
 }
 
+uint Scene::materialCount() const
+{
+	return materials.size();
+}
+
 const Mesh& Scene::mesh(uint i) const
 {
 	return meshes[i];
@@ -228,6 +741,26 @@ Mesh& Scene::mesh(uint i)
 	return meshes[i];
 }
 
+const Meshlet& Scene::meshlet(uint i) const
+{
+	return meshlets[i];
+}
+
+Terrain& Scene::terrain(uint i) const
+{
+	return terrains[i];
+}
+
+bool Scene::isStreaming() const
+{
+	for (const Terrain& terrain : terrains)
+	{
+		if (terrain.isLoading())
+			return true;
+	}
+	return false;
+}
+
 const Instance &Scene::skybox() const
 {
 	return m_skybox;
@@ -237,9 +770,15 @@ Material _default;
 
 const Material &Scene::materialOfInstance(const Instance &i) const
 {
-	if (i.materialId >= 0)
-		return materials[i.materialId];
-	else if (meshes[i.meshId].materialId >= 0)
-		return materials[meshes[i.meshId].materialId];
+	int id = materialIdOfInstance(i);
+	if (id >= 0)
+		return materials[id];
 	return _default;
 }
+
+int Scene::materialIdOfInstance(const Instance &i) const
+{
+	if (i.materialId >= 0)
+		return i.materialId;
+	return meshes[i.meshId].materialId;
+}
@@ -4,18 +4,22 @@
 #include <GL/glew.h>
 #include <algorithm>
 #include <iostream>
+#include <thread>
 
 #include "scene.h"
 #include "renderer.h"
 #include "camera.h"
 
 SpacImac* SpacImac::m_instance = nullptr;
+const uint SpacImac::SphereLodRows[] = {45, 32, 16, 8, 4};
 
 SpacImac::SpacImac(int argc, char **argv, const std::string& title, bool fullscreen)
 	: path(argv[0]), done(false), ratio(16.f/9.f), sizeScale(0.0001f), distanceScale(0.000001f),
 		width(754), height(512),
 		timeSpeed(1), lastTimeSpeed(1), timeStep(1),
-		currentCamera(0), solarSystem(path.dirPath() + "assets")
+		shaderTicks(0), m_programCache(path.dirPath() + "shadercache"), renderer(nullptr),
+		currentCamera(0), viewMode(SingleView), m_depthPrepass(false), m_occlusionCulling(true), m_sphereImpostors(false), m_reverseZ(false), m_presentFramebuffer(0), solarSystem(path.dirPath() + "assets"), m_events(256),
+		m_snapshotVersion(0), m_renderedVersion(0), m_redraw(true), m_idleTicks(0)
 {
 	if(0 != SDL_Init(SDL_INIT_VIDEO)) {
 			std::cerr << SDL_GetError() << std::endl;
@@ -31,6 +35,7 @@ SpacImac::SpacImac(int argc, char **argv, const std::string& title, bool fullscr
 			return;
 	}
 	SDL_WM_SetCaption(title.c_str(), nullptr);
+	startTicks = SDL_GetTicks();
 
 	GLenum glewInitError = glewInit();
 	if(GLEW_OK != glewInitError) {
@@ -43,7 +48,9 @@ SpacImac::SpacImac(int argc, char **argv, const std::string &title, uint width,
 	: path(argv[0]), done(false), ratio(16.f/9.f), sizeScale(0.0001f), distanceScale(0.000001f),
 		width(width), height(height),
 		timeSpeed(1), lastTimeSpeed(1), timeStep(1),
-		currentCamera(0), solarSystem(path.dirPath() + "assets")
+		shaderTicks(0), m_programCache(path.dirPath() + "shadercache"), renderer(nullptr),
+		currentCamera(0), viewMode(SingleView), m_depthPrepass(false), m_occlusionCulling(true), m_sphereImpostors(false), m_reverseZ(false), m_presentFramebuffer(0), solarSystem(path.dirPath() + "assets"), m_events(256),
+		m_snapshotVersion(0), m_renderedVersion(0), m_redraw(true), m_idleTicks(0)
 {
 	if(0 != SDL_Init(SDL_INIT_VIDEO)) {
 			std::cerr << SDL_GetError() << std::endl;
@@ -55,6 +62,7 @@ SpacImac::SpacImac(int argc, char **argv, const std::string &title, uint width,
 			return;
 	}
 	SDL_WM_SetCaption(title.c_str(), nullptr);
+	startTicks = SDL_GetTicks();
 
 	GLenum glewInitError = glewInit();
 	if(GLEW_OK != glewInitError) {
@@ -65,6 +73,8 @@ SpacImac::SpacImac(int argc, char **argv, const std::string &title, uint width,
 
 SpacImac::~SpacImac()
 {
+	if (m_presentFramebuffer)
+		glDeleteFramebuffers(1, &m_presentFramebuffer);
 	SDL_Quit();
 }
 
@@ -73,27 +83,222 @@ int SpacImac::exec()
 	SDL_Event e;
 	Uint32 start, end;
 	initialize();
+
+	// the simulation runs on its own thread, the GL context stays on this one
+	// which SDL requires for the events too. They only share the event queue and the snapshots
+	publishSnapshot();
+	m_waits.swap = m_waits.pacing = m_waits.eventQueue = m_waits.idle = 0;
+	m_waits.simulationIdle = 0;
+	m_waits.start = SDL_GetTicks();
+	std::thread simulation(&SpacImac::simulationLoop, this);
+
 	while(!done)
 	{
 		start = SDL_GetTicks();
 		while (SDL_PollEvent(&e)) {
 			handleEvent(e);
 		}
+		if (m_snapshots.update())
+		{
+			const FrameSnapshot& snapshot = m_snapshots.front();
+			for (size_t i = 0; i < sceneInstances.size(); ++i)
+				sceneInstances[i]->transform = snapshot.transforms[i];
+			m_scene.updateBounds();
+		}
+		if (!frameChanged())
+		{
+			waitForChange();
+			reportWaits();
+			continue;
+		}
 		render();
+		m_renderedVersion = m_snapshots.front().version;
+		m_redraw = false;
+		m_idleTicks = 0;
+		Uint32 swapStart = SDL_GetTicks();
 		SDL_GL_SwapBuffers();
 		end = SDL_GetTicks();
+		m_waits.swap += end - swapStart;
 		if (end - start < 30)
+		{
 			SDL_Delay(30 - (end - start));
-		update((SDL_GetTicks() - start) * 0.001f);
+			m_waits.pacing += 30 - (end - start);
+		}
+		reportWaits();
 	}
+	simulation.join();
 	return EXIT_SUCCESS;
 }
 
+void SpacImac::simulationLoop()
+{
+	SDL_Event e;
+	Uint32 last = SDL_GetTicks();
+	while(!done)
+	{
+		Uint32 start = SDL_GetTicks();
+		while (m_events.pop(e)) {
+			handleSimulationEvent(e);
+		}
+		update((start - last) * 0.001f);
+		last = start;
+		publishSnapshot();
+
+		Uint32 elapsed = SDL_GetTicks() - start;
+		if (elapsed < SimulationStep)
+		{
+			SDL_Delay(SimulationStep - elapsed);
+			m_waits.simulationIdle += SimulationStep - elapsed;
+		}
+	}
+}
+
+void SpacImac::publishSnapshot()
+{
+	FrameSnapshot& snapshot = m_snapshots.back();
+	snapshot.transforms.resize(solarSystemMeshes.size());
+	std::transform(solarSystemMeshes.begin(), solarSystemMeshes.end(), snapshot.transforms.begin(),
+								 [](const std::pair<Instance*, const SpaceElement*>& solarElement)
+	{
+		return solarElement.first->transform;
+	});
+	snapshotCameras(snapshot.cameras);
+	snapshot.frame = frame;
+	if (m_snapshotVersion == 0 || !snapshot.sameContent(m_publishedSnapshot))
+	{
+		++m_snapshotVersion;
+		m_publishedSnapshot = snapshot;
+	}
+	snapshot.version = m_snapshotVersion;
+	m_snapshots.publish();
+}
+
+/**
+ * The stereo eyes are parallel, shifted along the x axis of the view
+ */
+void SpacImac::snapshotCameras(std::vector<FixedCamera>& views) const
+{
+	views.clear();
+	if (viewMode == GridViews)
+	{
+		for (size_t i = 0; i < cameras.size() && i < LightRenderer::MaxViews; ++i)
+			views.push_back(FixedCamera(*cameras[i]));
+		return;
+	}
+
+	FixedCamera camera(*cameras[currentCamera]);
+	if (viewMode == SingleView)
+	{
+		views.push_back(camera);
+		return;
+	}
+	const OrbitalCamera* orbital = dynamic_cast<const OrbitalCamera*>(cameras[currentCamera].get());
+	float separation = StereoSeparation * (orbital ? orbital->distance : 1.f);
+	for (float eye : {-0.5f, 0.5f})
+	{
+		views.push_back(camera);
+		views.back().viewMatrix = glm::translate(glm::mat4(1.f), glm::vec3(-eye * separation, 0, 0))
+				* camera.viewMatrix;
+	}
+}
+
+bool SpacImac::FrameSnapshot::sameContent(const FrameSnapshot &other) const
+{
+	return transforms.size() == other.transforms.size()
+			&& std::equal(transforms.begin(), transforms.end(), other.transforms.begin(),
+						  [](const Transform& a, const Transform& b)
+	{
+		return a.position == b.position && a.rotation == b.rotation && a.scale == b.scale;
+	})
+			&& cameras.size() == other.cameras.size()
+			&& std::equal(cameras.begin(), cameras.end(), other.cameras.begin(),
+						  [](const FixedCamera& a, const FixedCamera& b)
+	{
+		return a.viewMatrix == b.viewMatrix && a.FoV == b.FoV && a.near == b.near && a.far == b.far
+				&& a.reverseZ == b.reverseZ;
+	});
+}
+
+bool SpacImac::frameChanged() const
+{
+	// the tiles loaded since the last frame are uploaded by the next one
+	return m_redraw || m_snapshots.front().version != m_renderedVersion || m_scene.isStreaming();
+}
+
+void SpacImac::waitForChange()
+{
+	Uint32 start = SDL_GetTicks();
+	if (++m_idleTicks < IdleTicksBeforeWait)
+	{
+		SDL_Delay(SimulationStep);
+	}
+	else
+	{
+		SDL_Event e;
+		if (SDL_WaitEvent(&e))
+			handleEvent(e);
+	}
+	m_waits.idle += SDL_GetTicks() - start;
+}
+
+/**
+ * Log the time each thread spent blocked or sleeping during the last period:
+ * the main thread in SDL_GL_SwapBuffers, in the frame pacing delay and on a full event queue,
+ * the simulation thread sleeping until its next tick
+ */
+void SpacImac::reportWaits()
+{
+	Uint32 now = SDL_GetTicks();
+	if (now - m_waits.start < WaitReportPeriod)
+		return;
+	std::clog << "Waits over " << now - m_waits.start << " ms: main thread " << m_waits.swap
+			  << " ms swapping, " << m_waits.pacing << " ms pacing, " << m_waits.eventQueue
+			  << " ms on a full event queue, " << m_waits.idle << " ms idle without change; simulation thread " << m_waits.simulationIdle.exchange(0)
+			  << " ms idle" << std::endl;
+	m_waits.swap = m_waits.pacing = m_waits.eventQueue = m_waits.idle = 0;
+	m_waits.start = now;
+
+	std::clog << "Passes (cpu/gpu ms):";
+	for (const RenderGraph::PassTiming& timing : m_renderGraph.timings())
+	{
+		std::clog << " " << timing.name << " " << timing.cpuTime << "/" << timing.gpuTime;
+		if (timing.culledFrames)
+			std::clog << " (culled " << timing.culledFrames << " frames)";
+	}
+	if (renderer)
+	{
+		Renderer::CullingStats culling = renderer->takeCullingStats();
+		if (culling.frames)
+			std::clog << ", instances culled " << culling.culled / culling.frames << " of "
+					  << culling.tested / culling.frames << " per frame ("
+					  << culling.occluded / culling.frames << " occluded), "
+					  << culling.triangles / culling.frames << " triangles and "
+					  << culling.sprites / culling.frames << " point sprites per frame, meshlets culled "
+					  << culling.meshletsCulled / culling.frames << " of " << culling.meshlets / culling.frames;
+		if (culling.streamStalls)
+			std::clog << ", instance stream stalled " << culling.streamStalls << " times ("
+					  << culling.streamStallTime << " ms)";
+		std::clog << ", hierarchy cost " << m_scene.bvh().cost() << " ("
+				  << m_scene.bvh().buildCount() << " builds)";
+	}
+	if (m_dynamicResolution.isEnabled())
+		std::clog << ", resolution scale " << m_dynamicResolution.scale() << " for "
+				  << m_dynamicResolution.frameTime() << " ms per frame";
+	std::clog << ", transient textures " << m_renderGraph.transientMemory() / 1024 << " KB ("
+			  << m_renderGraph.transientMemoryWithoutAliasing() / 1024 << " KB without aliasing)" << std::endl;
+	m_renderGraph.resetTimings();
+}
+
 void SpacImac::update(float deltaTime)
 {
 	std::cout << "Frame n:" << frame << " Delta time:" << deltaTime << std::endl;
 
-	cameras[currentCamera]->update(deltaTime);
+	// every camera of the grid moves with its target
+	for (size_t i = 0; i < cameras.size(); ++i)
+	{
+		if (viewMode == GridViews || int(i) == currentCamera)
+			cameras[i]->update(deltaTime);
+	}
 	std::for_each(solarSystemMeshes.begin(), solarSystemMeshes.end(),
 								[this](std::pair<Instance*, const SpaceElement*> solarElement)
 	{
@@ -103,25 +308,198 @@ void SpacImac::update(float deltaTime)
 	++frame;
 }
 
-void SpacImac::render() const
+/**
+ * The frame is described as a render graph, the renderers drawing in the backbuffer
+ * in the order of their passes.
+ * With reverse-Z, they draw in an offscreen target with a floating-point depth,
+ * the default framebuffer having a fixed-point one, then the color is copied in the backbuffer.
+ * With dynamic resolution, the offscreen target is scaled and the copy upscales it to the view
+ */
+void SpacImac::render()
 {
-	glClearColor(0.05,0.05,0.05,1);
-	glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
-	if (skyRenderer.get())
+	m_renderGraph.reset();
+	RenderGraph::ResourceId backbuffer = m_renderGraph.importBackbuffer("backbuffer", m_viewX, m_viewY,
+																		 m_viewWidth, m_viewHeight);
+	if (!m_reverseZ && !m_dynamicResolution.isEnabled())
 	{
-		skyRenderer->render(m_scene, *cameras[currentCamera]);
+		addFramePasses({backbuffer}, m_viewX, m_viewY, m_viewWidth, m_viewHeight);
+		m_renderGraph.execute();
+		return;
 	}
+
+	float scale = m_dynamicResolution.scale();
+	GLsizei width = std::max(1, int(m_viewWidth * scale));
+	GLsizei height = std::max(1, int(m_viewHeight * scale));
+	RenderGraph::ResourceId color = m_renderGraph.createTexture("scene color",
+			RenderGraph::TextureDesc{width, height, GL_RGBA8});
+	RenderGraph::ResourceId depth = m_renderGraph.createTexture("scene depth",
+			RenderGraph::TextureDesc{width, height, depthFormat()});
+	addFramePasses({color, depth}, 0, 0, width, height);
+	RenderGraph::PassId present = m_renderGraph.addPass("present", [this, color, width, height](const RenderGraph::PassContext& context)
+	{
+		if (!m_presentFramebuffer)
+			glGenFramebuffers(1, &m_presentFramebuffer);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, m_presentFramebuffer);
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, context.texture(color), 0);
+		glBlitFramebuffer(0, 0, width, height,
+						  m_viewX, m_viewY, m_viewX + m_viewWidth, m_viewY + m_viewHeight,
+						  GL_COLOR_BUFFER_BIT, GLuint(width) == m_viewWidth ? GL_NEAREST : GL_LINEAR);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	});
+	m_renderGraph.read(present, color);
+	m_renderGraph.write(present, backbuffer);
+
+	// timestamps around the whole graph, its passes being timed with GL_TIME_ELAPSED queries
+	m_dynamicResolution.beginFrame();
+	m_renderGraph.execute();
+	m_dynamicResolution.endFrame();
+}
+
+GLenum SpacImac::depthFormat() const
+{
+	return m_reverseZ ? GL_DEPTH_COMPONENT32F : GL_DEPTH_COMPONENT24;
+}
+
+/**
+ * Without depth prepass, the sky covers the background then the planets are drawn over it.
+ * With it, the planets depths are written first, then the planets and the sky
+ * only shade their visible pixels.
+ * Several views are laid out on two columns, the first view at the top left
+ */
+void SpacImac::addFramePasses(const std::vector<RenderGraph::ResourceId>& targets,
+							  GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	const FrameSnapshot& snapshot = m_snapshots.front();
+	size_t viewCount = snapshot.cameras.size();
+	GLsizei columns = viewCount > 1 ? 2 : 1;
+	GLsizei rows = (viewCount + columns - 1) / columns;
+	GLsizei cellWidth = width / columns, cellHeight = height / rows;
+	m_frameViews.resize(viewCount);
+	for (size_t i = 0; i < viewCount; ++i)
+	{
+		m_frameViews[i].camera = &snapshot.cameras[i];
+		m_frameViews[i].viewport = glm::ivec4(x + (i % columns) * cellWidth,
+											  y + height - (i / columns + 1) * cellHeight,
+											  cellWidth, cellHeight);
+	}
+
+	auto writeTargets = [this, &targets](RenderGraph::PassId pass)
+	{
+		for (RenderGraph::ResourceId target : targets)
+			m_renderGraph.write(pass, target);
+	};
+
+	writeTargets(m_renderGraph.addPass("clear", [this](const RenderGraph::PassContext&)
+	{
+		glClearColor(0.05,0.05,0.05,1);
+		glClearDepth(m_reverseZ ? 0 : 1);
+		glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+	}));
+	if (renderer && m_depthPrepass)
+	{
+		writeTargets(m_renderGraph.addPass("depth prepass", [this](const RenderGraph::PassContext&)
+		{
+			renderer->renderDepth(m_scene, m_frameViews);
+		}));
+	}
+	RenderGraph::PassFunction drawSky = [this](const RenderGraph::PassContext&)
+	{
+		skyRenderer->render(m_scene, m_frameViews);
+	};
+	if (skyRenderer.get() && !m_depthPrepass)
+		writeTargets(m_renderGraph.addPass("skybox", drawSky));
 	if (renderer)
 	{
-		renderer->render(m_scene, *cameras[currentCamera]);
+		writeTargets(m_renderGraph.addPass("scene", [this](const RenderGraph::PassContext&)
+		{
+			renderer->render(m_scene, m_frameViews);
+		}));
 	}
+	if (skyRenderer.get() && m_depthPrepass)
+		writeTargets(m_renderGraph.addPass("skybox", drawSky));
+}
+
+void SpacImac::setDepthPrepass(bool enabled)
+{
+	m_depthPrepass = enabled;
+	if (skyRenderer.get())
+		skyRenderer->setDepthPrepass(enabled);
+	if (renderer)
+		renderer->setDepthPrepass(enabled);
+}
+
+/**
+ * Draw FillRateFrames frames offscreen at each resolution, with and without depth prepass,
+ * and log the GPU time per frame and the pixels drawn per second.
+ * The GPU time is measured with timestamps which, unlike GL_TIME_ELAPSED,
+ * don't conflict with the render graph queries
+ */
+void SpacImac::measureFillRate()
+{
+	static const GLsizei resolutions[][2] = {{1280, 720}, {1920, 1080}, {2560, 1440}, {3840, 2160}};
+	bool depthPrepass = m_depthPrepass;
+	uint viewWidth = m_viewWidth, viewHeight = m_viewHeight;
+	GLuint queries[2];
+	glGenQueries(2, queries);
+
+	for (int prepass = 0; prepass < 2; ++prepass)
+	{
+		setDepthPrepass(prepass == 1);
+		for (const auto& resolution : resolutions)
+		{
+			// the renderers use the view size for the aspect ratio
+			m_viewWidth = resolution[0];
+			m_viewHeight = resolution[1];
+			glQueryCounter(queries[0], GL_TIMESTAMP);
+			for (uint f = 0; f < FillRateFrames; ++f)
+			{
+				m_renderGraph.reset();
+				RenderGraph::ResourceId color = m_renderGraph.createTexture("offscreen color",
+						RenderGraph::TextureDesc{resolution[0], resolution[1], GL_RGBA8});
+				RenderGraph::ResourceId depth = m_renderGraph.createTexture("offscreen depth",
+						RenderGraph::TextureDesc{resolution[0], resolution[1], depthFormat()});
+				addFramePasses({color, depth}, 0, 0, resolution[0], resolution[1]);
+				// nothing reads the offscreen target, keep its passes
+				RenderGraph::PassId sink = m_renderGraph.addPass("fill rate", [](const RenderGraph::PassContext&) {});
+				m_renderGraph.read(sink, color);
+				m_renderGraph.setSideEffect(sink);
+				m_renderGraph.execute();
+			}
+			glQueryCounter(queries[1], GL_TIMESTAMP);
+
+			GLuint64 begin, end;
+			glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end);
+			double frameTime = (end - begin) * 1e-6 / FillRateFrames;
+			std::clog << "Fill rate " << (prepass ? "with" : "without") << " depth prepass at "
+					  << resolution[0] << "x" << resolution[1] << ": " << frameTime << " ms per frame, "
+					  << resolution[0] * resolution[1] / (frameTime * 1e3) << " Mpixels/s" << std::endl;
+		}
+	}
+
+	glDeleteQueries(2, queries);
+	m_viewWidth = viewWidth;
+	m_viewHeight = viewHeight;
+	setDepthPrepass(depthPrepass);
+	m_renderGraph.resetTimings();
 }
 
 void SpacImac::setRenderer(Renderer* renderer)
 {
 	this->renderer = renderer;
 	if (renderer)
+	{
+		renderer->setDepthPrepass(m_depthPrepass);
+		renderer->setOcclusionCulling(m_occlusionCulling);
+		renderer->setSphereImpostors(m_sphereImpostors);
+	}
+	// before initialize(), the shaders are built with the other ones
+	if (renderer && m_scene.initialized())
+	{
+		Uint32 start = SDL_GetTicks();
 		renderer->initialize();
+		shaderTicks += SDL_GetTicks() - start;
+	}
 }
 
 std::string SpacImac::getFilePath(const std::string& file) const
@@ -144,6 +522,21 @@ Scene &SpacImac::scene()
 	return m_scene;
 }
 
+glimac::ProgramBinaryCache &SpacImac::programCache()
+{
+	return m_programCache;
+}
+
+glimac::ThreadPool &SpacImac::threadPool()
+{
+	return m_threadPool;
+}
+
+DynamicResolution &SpacImac::dynamicResolution()
+{
+	return m_dynamicResolution;
+}
+
 SpacImac *SpacImac::instance()
 {
 	if (!m_instance)
@@ -185,7 +578,16 @@ void SpacImac::addSpaceElementMesh(const SpaceElement &element, uint sphereMeshI
 	mesh.transform.scale = element.getSize() * sizeScale;
 	mesh.transform.rotation = element.getRotation(0);
 	mesh.materialId = m_scene.addMaterial(Material(element.getColor(), textureId));
-	solarSystemMeshes.push_back(std::pair<Instance*, const SpaceElement*>(&mesh, &element));
+	// the height tiles of a body are in a folder named after its texture, the bodies without one
+	// keep their sphere however close they are seen
+	std::string textureFile = element.diffuseTexture().file();
+	std::string tileRoot = getFilePath("assets/terrain/" + textureFile.substr(0, textureFile.find_last_of('.')));
+	if (Terrain::hasTiles(tileRoot))
+		mesh.terrainId = m_scene.addTerrain(tileRoot);
+	// the simulation moves its own copy, the scene one is updated from the snapshots
+	simulationInstances.push_back(mesh);
+	sceneInstances.push_back(&mesh);
+	solarSystemMeshes.push_back(std::pair<Instance*, const SpaceElement*>(&simulationInstances.back(), &element));
 
 	std::for_each(element.firstSatellite(), element.lastSatellite(),
 	[this, sphereMeshId](const std::pair<const std::string, std::unique_ptr<Satellite> >& satellite){
@@ -197,8 +599,18 @@ void SpacImac::initialize()
 {
 	resize(width,	height);
 
+	// half the memory and bandwidth of the float vertices, the shaders decoding them.
+	// Chosen first, the permutations submitted below depend on it
+	m_scene.setPackedVertices(true);
+
+	// Submit every shader first, the driver compiles them while the assets are loaded
+	Uint32 shaderStart = SDL_GetTicks();
+	glimac::ProgramBuilder programBuilder(&m_programCache);
 	skyRenderer = std::make_unique<SkyboxRenderer>();
-	skyRenderer->initialize();
+	skyRenderer->loadProgram(programBuilder);
+	if (renderer)
+		renderer->loadProgram(programBuilder);
+	Uint32 shaderSubmitTicks = SDL_GetTicks() - shaderStart;
 
 	// Skybox
 	glimac::Geometry cube;
@@ -206,9 +618,12 @@ void SpacImac::initialize()
 	m_scene.setSkybox(cube, getFilePath("assets/starfield"));
 
 	// Planets
-	glimac::Geometry sphere;
-	sphere.loadOBJ(getFilePath("assets/sphere.obj"),getFilePath("assets"));
-	uint sphereId = m_scene.addMeshes(sphere);
+	std::vector<uint> sphereLods;
+	for (uint rows : SphereLodRows)
+		sphereLods.push_back(m_scene.addMeshes(glimac::Geometry::sphere(1.f, 2 * rows, rows)));
+	m_scene.setLodChain(sphereLods);
+	uint sphereId = sphereLods.front();
+	m_scene.setSphereImpostor(sphereId, m_scene.addMeshes(glimac::Geometry::quad(1.f)));
 
 	addSpaceElementMesh(solarSystem.sun(), sphereId);
 
@@ -218,6 +633,16 @@ void SpacImac::initialize()
 	m_scene.pointLight.color = solarSystem.sun().lightColor();
 	m_scene.pointLight.power = solarSystem.sun().lightPower();
 	m_scene.initializeBuffers();
+	m_scene.updateBounds();
+
+	size_t stillCompiling = programBuilder.poll();
+	shaderStart = SDL_GetTicks();
+	programBuilder.finish();
+	skyRenderer->loadUniforms();
+	if (renderer)
+		renderer->loadUniforms();
+	Uint32 shaderWaitTicks = SDL_GetTicks() - shaderStart;
+	shaderTicks += shaderSubmitTicks + shaderWaitTicks;
 
 	cameras.push_back(std::make_unique<OrbitalCamera>());
 	OrbitalCamera* oc = dynamic_cast<OrbitalCamera*>(cameras.back().get());
@@ -245,8 +670,40 @@ void SpacImac::initialize()
 	oc->pitch = 2.f * glm::pi<float>() / 8.f;
 	oc->translationAcc = (oc->far - oc->near) / 200.f;
 
+	// With reverse-Z, the depth precision doesn't depend on near and far:
+	// a near plane closer than any target surface fits the whole system
+	m_reverseZ = GLEW_VERSION_4_5 || GLEW_ARB_clip_control;
+	if (m_reverseZ)
+		glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+	for (std::unique_ptr<BaseCamera>& camera : cameras)
+	{
+		camera->reverseZ = m_reverseZ;
+		if (m_reverseZ)
+			camera->near = ReverseZNear;
+	}
+
 	time = 0;
 	frame = 0;
+
+	std::clog << "Startup in " << SDL_GetTicks() - startTicks << " ms, shaders built in "
+			  << shaderTicks << " ms (" << shaderSubmitTicks << " ms to submit "
+			  << programBuilder.getSubmittedCount() << " programs, " << shaderWaitTicks
+			  << " ms waiting after the assets loading, ";
+	if (programBuilder.isParallel())
+		std::clog << stillCompiling << " still compiling then)";
+	else
+		std::clog << "no parallel compilation)";
+	if (m_programCache.isEnabled())
+		std::clog << " (program cache: " << m_programCache.getHitCount() << " hits, "
+				  << m_programCache.getMissCount() << " misses)";
+	else
+		std::clog << " (program cache disabled)";
+	std::clog << std::endl;
+	std::clog << "GL objects created with "
+			  << (glimac::hasDirectStateAccess() ? "direct state access" : "bind to edit")
+			  << ", frames prepared on " << m_threadPool.getWorkerCount() + 1 << " threads, "
+			  << (m_reverseZ ? "reverse-Z 32-bit float" : "24-bit") << " depth, instances culled with "
+			  << FrustumCuller::instructionSet() << std::endl;
 }
 
 void SpacImac::updateSpaceElementMesh(std::pair<Instance*, const SpaceElement*> solarElement)
@@ -258,14 +715,62 @@ void SpacImac::updateSpaceElementMesh(std::pair<Instance*, const SpaceElement*>
 
 void SpacImac::handleEvent(const SDL_Event& e)
 {
+	// the simulation may take a few ticks to publish the effect of the event
+	m_idleTicks = 0;
 	if (e.type == SDL_QUIT) {
 		done = true;
 	}
-	else if (e.type == SDL_KEYUP) {
+	else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_ESCAPE) {
+		done = true;
+	}
+	else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_F2) {
+		setDepthPrepass(!m_depthPrepass);
+		std::clog << "Depth prepass " << (m_depthPrepass ? "enabled" : "disabled") << std::endl;
+		m_redraw = true;
+	}
+	else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_F3) {
+		measureFillRate();
+		m_redraw = true;
+	}
+	else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_F5) {
+		m_dynamicResolution.setEnabled(!m_dynamicResolution.isEnabled());
+		std::clog << "Dynamic resolution " << (m_dynamicResolution.isEnabled() ? "enabled" : "disabled") << std::endl;
+		m_redraw = true;
+	}
+	else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_F7) {
+		m_occlusionCulling = !m_occlusionCulling;
+		if (renderer)
+			renderer->setOcclusionCulling(m_occlusionCulling);
+		std::clog << "Occlusion culling " << (m_occlusionCulling ? "enabled" : "disabled") << std::endl;
+		m_redraw = true;
+	}
+	else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_F8) {
+		m_sphereImpostors = !m_sphereImpostors;
+		if (renderer)
+			renderer->setSphereImpostors(m_sphereImpostors);
+		std::clog << "Sphere impostors " << (m_sphereImpostors ? "enabled" : "disabled") << std::endl;
+		m_redraw = true;
+	}
+	else if (e.type == SDL_VIDEORESIZE)
+	{
+		resize(e.resize.w, e.resize.h);
+		m_redraw = true;
+	}
+	else if (e.type == SDL_VIDEOEXPOSE)
+	{
+		m_redraw = true;
+	}
+
+	Uint32 start = SDL_GetTicks();
+	while (!done && !m_events.push(e))
+		std::this_thread::yield();
+	m_waits.eventQueue += SDL_GetTicks() - start;
+}
+
+void SpacImac::handleSimulationEvent(const SDL_Event& e)
+{
+	if (e.type == SDL_KEYUP) {
 		switch(e.key.keysym.sym){
-		case SDLK_ESCAPE:
-			done = true;
-			break;
 		case SDLK_p:
 			if (std::abs(timeSpeed) > 0.01)
 			{
@@ -291,6 +796,9 @@ void SpacImac::handleEvent(const SDL_Event& e)
 			currentCamera++;
 			currentCamera = currentCamera % cameras.size();
 			break;
+		case SDLK_F6:
+			viewMode = ViewMode((viewMode + 1) % (GridViews + 1));
+			break;
 		default:
 			break;
 		}
@@ -314,10 +822,6 @@ void SpacImac::handleEvent(const SDL_Event& e)
 			break;
 		}
 	}
-	else if (e.type == SDL_VIDEORESIZE)
-	{
-		resize(e.resize.w, e.resize.h);
-	}
 	cameras[currentCamera]->handleEvent(e);
 }
 
@@ -354,6 +858,9 @@ void TargetCamera::update(float deltaTime)
 void TargetCamera::updateDistance()
 {
 	distance = glm::length(current->second->getSize()) * 0.0002f;
+	if (reverseZ)
+		return;
+	// without reverse-Z, the depth range is fitted to the target to avoid z-fighting
 	near = glm::length(current->second->getSize()) * 0.00002f;
 	far = glm::length(current->second->getSize()) * 2.f;
 }
@@ -0,0 +1,491 @@
+#include "terrain.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+
+#include <sys/stat.h>
+
+namespace {
+
+const uint TileCacheSize = 64;
+/**
+ * Vertices of a chunk: the grid, then the skirt of each edge
+ */
+const uint GridVertices = (Terrain::GridSize + 1) * (Terrain::GridSize + 1);
+const uint VertexCount = GridVertices + 4 * (Terrain::GridSize + 1);
+
+/**
+ * Normal of each cube face and its u and v axes, u x v being the normal
+ * so that the grids are counterclockwise seen from outside
+ */
+const glm::vec3 FaceAxes[6][3] = {
+	{glm::vec3(1, 0, 0), glm::vec3(0, 0, -1), glm::vec3(0, 1, 0)},
+	{glm::vec3(-1, 0, 0), glm::vec3(0, 0, 1), glm::vec3(0, 1, 0)},
+	{glm::vec3(0, 1, 0), glm::vec3(1, 0, 0), glm::vec3(0, 0, -1)},
+	{glm::vec3(0, -1, 0), glm::vec3(1, 0, 0), glm::vec3(0, 0, 1)},
+	{glm::vec3(0, 0, 1), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0)},
+	{glm::vec3(0, 0, -1), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0)}
+};
+
+/**
+ * Point of the unit sphere above the point (s, t) of the face, s and t in [-1, 1].
+ * The tangent spreads the grid evenly on the sphere, the faces' centers being less dense
+ */
+glm::vec3 spherePoint(uint face, float s, float t)
+{
+	const float quarterPi = glm::pi<float>() / 4;
+	return glm::normalize(FaceAxes[face][0] + std::tan(s * quarterPi) * FaceAxes[face][1]
+						  + std::tan(t * quarterPi) * FaceAxes[face][2]);
+}
+
+/**
+ * Coordinate s or t of the grid line i of the chunk at x or y
+ */
+float faceCoordinate(uint level, uint x, float i)
+{
+	return -1.f + 2.f * (x + i / Terrain::GridSize) / float(1u << level);
+}
+
+/**
+ * Length of a quad of the chunks of the level on the unit sphere
+ */
+float cellSize(uint level)
+{
+	return glm::pi<float>() / 2 / float(1u << level) / Terrain::GridSize;
+}
+
+/**
+ * Texture coordinates of the point of the unit sphere as on Geometry::sphere
+ */
+glm::vec2 sphereTexCoords(const glm::vec3& direction)
+{
+	return glm::vec2(std::atan2(direction.x, direction.z) / (2 * glm::pi<float>()) + 0.25f,
+					 std::asin(glm::clamp(direction.y, -1.f, 1.f)) / glm::pi<float>() + 0.5f);
+}
+
+/**
+ * Bilinear sample of the red channel, the tile covering [0, 1]² from its first pixel to its last,
+ * its first row being the top of the tile
+ */
+float sampleHeight(const glimac::Image& image, float u, float v)
+{
+	float x = glm::clamp(u, 0.f, 1.f) * (image.getWidth() - 1);
+	float y = (1 - glm::clamp(v, 0.f, 1.f)) * (image.getHeight() - 1);
+	uint x0 = std::min(uint(x), image.getWidth() - 1), y0 = std::min(uint(y), image.getHeight() - 1);
+	uint x1 = std::min(x0 + 1, image.getWidth() - 1), y1 = std::min(y0 + 1, image.getHeight() - 1);
+	float fx = x - x0, fy = y - y0;
+	const glm::vec4* pixels = image.getPixels();
+	float top = glm::mix(pixels[y0 * image.getWidth() + x0].r, pixels[y0 * image.getWidth() + x1].r, fx);
+	float bottom = glm::mix(pixels[y1 * image.getWidth() + x0].r, pixels[y1 * image.getWidth() + x1].r, fx);
+	return glm::mix(top, bottom, fy);
+}
+
+}
+
+bool Terrain::TileKey::operator<(const TileKey& other) const
+{
+	if (face != other.face)
+		return face < other.face;
+	if (level != other.level)
+		return level < other.level;
+	if (y != other.y)
+		return y < other.y;
+	return x < other.x;
+}
+
+Terrain::TileKey Terrain::TileKey::child(uint i) const
+{
+	return TileKey{face, level + 1, 2 * x + (i & 1), 2 * y + (i >> 1)};
+}
+
+Terrain::Terrain(const glimac::FilePath& tileRoot)
+	: tileRoot(tileRoot), frame(0), indexBuffer(0), indexCount(0), stopping(false),
+	  requests(256), results(256)
+{}
+
+bool Terrain::hasTiles(const glimac::FilePath& tileRoot)
+{
+	struct stat info;
+	return stat(tileRoot.c_str(), &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+Terrain::~Terrain()
+{
+	if (!loader)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(wakeMutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	loader->join();
+	for (std::pair<const TileKey, Chunk>& chunk : chunks)
+		releaseChunk(chunk.second);
+	glDeleteBuffers(1, &indexBuffer);
+}
+
+/**
+ * The loader thread and the indices are made on the first update, the terrains of the bodies
+ * never seen from close costing nothing
+ */
+void Terrain::update(const glm::vec3& eye, float pixelScale)
+{
+	if (!loader)
+	{
+		std::vector<GLushort> indices;
+		auto gridIndex = [](uint i, uint j) { return GLushort(j * (GridSize + 1) + i); };
+		for (uint j = 0; j < GridSize; ++j)
+		{
+			for (uint i = 0; i < GridSize; ++i)
+			{
+				GLushort quad[4] = {gridIndex(i, j), gridIndex(i + 1, j), gridIndex(i + 1, j + 1), gridIndex(i, j + 1)};
+				indices.insert(indices.end(), {quad[0], quad[1], quad[2], quad[0], quad[2], quad[3]});
+			}
+		}
+		// the edges j = 0 and i = GridSize go along u then v with the outside on their right,
+		// the edges j = GridSize and i = 0 on their left: their walls are wound the other way
+		for (uint edge = 0; edge < 4; ++edge)
+		{
+			for (uint k = 0; k < GridSize; ++k)
+			{
+				GLushort top[2], bottom[2];
+				for (uint n = 0; n < 2; ++n)
+				{
+					uint i = edge == 1 ? GridSize : edge == 3 ? 0 : k + n;
+					uint j = edge == 0 ? 0 : edge == 2 ? GridSize : k + n;
+					top[n] = gridIndex(i, j);
+					bottom[n] = GLushort(GridVertices + edge * (GridSize + 1) + k + n);
+				}
+				if (edge < 2)
+					indices.insert(indices.end(), {top[0], bottom[0], top[1], top[1], bottom[0], bottom[1]});
+				else
+					indices.insert(indices.end(), {top[0], top[1], bottom[0], top[1], bottom[1], bottom[0]});
+			}
+		}
+		indexCount = indices.size();
+		if (glimac::hasDirectStateAccess())
+		{
+			glCreateBuffers(1, &indexBuffer);
+			glNamedBufferStorage(indexBuffer, indices.size() * sizeof(GLushort), indices.data(), 0);
+		}
+		else
+		{
+			glGenBuffers(1, &indexBuffer);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		}
+		loader = std::make_unique<std::thread>(&Terrain::loaderLoop, this);
+	}
+
+	++frame;
+	std::shared_ptr<ChunkData> data;
+	while (results.pop(data))
+	{
+		upload(*data);
+		pending.erase(data->key);
+	}
+
+	drawn.clear();
+	size_t pendingCount = pending.size();
+	for (uint face = 0; face < 6; ++face)
+		select(TileKey{face, 0, 0, 0}, eye, pixelScale);
+	evict();
+	// taking the lock, the loader either waits already or will see the requests before waiting
+	if (pending.size() > pendingCount)
+	{
+		{
+			std::lock_guard<std::mutex> lock(wakeMutex);
+		}
+		wake.notify_one();
+	}
+}
+
+/**
+ * A chunk is split when the size of its quads on screen, at the nearest point of its
+ * bounding sphere, exceeds MaxPixelError and its 4 children are loaded.
+ * Until then, it is drawn and its children are requested
+ */
+void Terrain::select(const TileKey& key, const glm::vec3& eye, float pixelScale)
+{
+	std::map<TileKey, Chunk>::iterator it = chunks.find(key);
+	if (it == chunks.end())
+	{
+		request(key);
+		return;
+	}
+	it->second.lastFrame = frame;
+
+	float s = faceCoordinate(key.level, key.x, GridSize / 2.f);
+	float t = faceCoordinate(key.level, key.y, GridSize / 2.f);
+	glm::vec3 center = spherePoint(key.face, s, t);
+	float radius = 0;
+	for (uint corner = 0; corner < 4; ++corner)
+	{
+		glm::vec3 p = spherePoint(key.face, faceCoordinate(key.level, key.x, (corner & 1) * GridSize),
+								  faceCoordinate(key.level, key.y, (corner >> 1) * GridSize));
+		radius = std::max(radius, glm::length(p - center));
+	}
+	radius += HeightScale;
+	float distance = std::max(glm::length(eye - center) - radius, 1e-6f);
+
+	if (key.level < MaxLevel && cellSize(key.level) * pixelScale / distance > MaxPixelError)
+	{
+		bool childrenLoaded = true;
+		for (uint i = 0; i < 4; ++i)
+		{
+			if (!chunks.count(key.child(i)))
+			{
+				request(key.child(i));
+				childrenLoaded = false;
+			}
+		}
+		if (childrenLoaded)
+		{
+			for (uint i = 0; i < 4; ++i)
+				select(key.child(i), eye, pixelScale);
+			return;
+		}
+	}
+	drawn.push_back(&it->second);
+}
+
+void Terrain::request(const TileKey& key)
+{
+	// a full queue is retried on the next update
+	if (!pending.count(key) && requests.push(key))
+		pending.insert(key);
+}
+
+void Terrain::upload(const ChunkData& data)
+{
+	Chunk chunk;
+	chunk.lastFrame = frame;
+	GLsizeiptr size = data.vertices.size() * sizeof(glimac::Geometry::Vertex);
+	if (glimac::hasDirectStateAccess())
+	{
+		glCreateBuffers(1, &chunk.buffer);
+		glNamedBufferStorage(chunk.buffer, size, data.vertices.data(), 0);
+		glCreateVertexArrays(1, &chunk.vao);
+		glVertexArrayVertexBuffer(chunk.vao, 0, chunk.buffer, 0, sizeof(glimac::Geometry::Vertex));
+		glVertexArrayElementBuffer(chunk.vao, indexBuffer);
+		for (GLuint attribute = 0; attribute < 3; ++attribute)
+		{
+			glEnableVertexArrayAttrib(chunk.vao, attribute);
+			glVertexArrayAttribBinding(chunk.vao, attribute, 0);
+		}
+		glVertexArrayAttribFormat(chunk.vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(glimac::Geometry::Vertex, m_Position));
+		glVertexArrayAttribFormat(chunk.vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(glimac::Geometry::Vertex, m_Normal));
+		glVertexArrayAttribFormat(chunk.vao, 2, 2, GL_FLOAT, GL_FALSE, offsetof(glimac::Geometry::Vertex, m_TexCoords));
+	}
+	else
+	{
+		glGenBuffers(1, &chunk.buffer);
+		glGenVertexArrays(1, &chunk.vao);
+		glBindVertexArray(chunk.vao);
+		glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer);
+		glBufferData(GL_ARRAY_BUFFER, size, data.vertices.data(), GL_STATIC_DRAW);
+		for (GLuint attribute = 0; attribute < 3; ++attribute)
+			glEnableVertexAttribArray(attribute);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
+							  (GLvoid*) offsetof(glimac::Geometry::Vertex, m_Position));
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
+							  (GLvoid*) offsetof(glimac::Geometry::Vertex, m_Normal));
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(glimac::Geometry::Vertex),
+							  (GLvoid*) offsetof(glimac::Geometry::Vertex, m_TexCoords));
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	chunks[data.key] = chunk;
+}
+
+/**
+ * The chunks of the faces roots are always kept, so that the body can still be drawn
+ */
+void Terrain::evict()
+{
+	if (chunks.size() <= MaxChunks)
+		return;
+	std::vector<std::pair<uint, TileKey>> unused;
+	for (const std::pair<const TileKey, Chunk>& chunk : chunks)
+	{
+		if (chunk.second.lastFrame != frame && chunk.first.level > 0)
+			unused.push_back(std::make_pair(chunk.second.lastFrame, chunk.first));
+	}
+	size_t count = std::min(unused.size(), chunks.size() - MaxChunks);
+	std::partial_sort(unused.begin(), unused.begin() + count, unused.end(),
+					  [](const std::pair<uint, TileKey>& a, const std::pair<uint, TileKey>& b)
+	{
+		return a.first < b.first;
+	});
+	for (size_t i = 0; i < count; ++i)
+	{
+		std::map<TileKey, Chunk>::iterator it = chunks.find(unused[i].second);
+		releaseChunk(it->second);
+		chunks.erase(it);
+	}
+}
+
+void Terrain::releaseChunk(Chunk& chunk)
+{
+	glDeleteVertexArrays(1, &chunk.vao);
+	glDeleteBuffers(1, &chunk.buffer);
+}
+
+void Terrain::draw() const
+{
+	for (const Chunk* chunk : drawn)
+	{
+		glBindVertexArray(chunk->vao);
+		glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_SHORT, nullptr);
+	}
+	glBindVertexArray(0);
+}
+
+bool Terrain::isReady() const
+{
+	for (uint face = 0; face < 6; ++face)
+	{
+		if (!chunks.count(TileKey{face, 0, 0, 0}))
+			return false;
+	}
+	return true;
+}
+
+bool Terrain::isLoading() const
+{
+	return !pending.empty();
+}
+
+uint Terrain::drawnChunkCount() const
+{
+	return drawn.size();
+}
+
+uint Terrain::triangleCount() const
+{
+	return drawn.size() * indexCount / 3;
+}
+
+void Terrain::loaderLoop()
+{
+	TileKey key;
+	while (!stopping)
+	{
+		if (!requests.pop(key))
+		{
+			std::unique_lock<std::mutex> lock(wakeMutex);
+			wake.wait(lock, [this] { return stopping || !requests.empty(); });
+			continue;
+		}
+		std::shared_ptr<ChunkData> data = std::make_shared<ChunkData>();
+		data->key = key;
+		buildChunk(*data);
+		while (!stopping && !results.push(data))
+			std::this_thread::yield();
+	}
+}
+
+/**
+ * The tile of an ancestor covers the chunk in the square of its descendants of the chunk level
+ * where the chunk is
+ */
+void Terrain::loadHeights(const TileKey& key, std::vector<float>& heights)
+{
+	const glimac::Image* image = nullptr;
+	TileKey tile = key;
+	while (true)
+	{
+		std::map<TileKey, std::unique_ptr<glimac::Image>>::const_iterator it = tileCache.find(tile);
+		if (it == tileCache.end())
+		{
+			if (tileCache.size() >= TileCacheSize)
+				tileCache.clear();
+			glimac::FilePath path = tileRoot + std::to_string(tile.face) + std::to_string(tile.level)
+					+ (std::to_string(tile.x) + "_" + std::to_string(tile.y) + ".png");
+			std::unique_ptr<glimac::Image> loaded;
+			// most tiles don't exist, without the error of the image loader for each one
+			if (std::ifstream(path.c_str()).good())
+				loaded = glimac::loadImage(path);
+			it = tileCache.insert(std::make_pair(tile, std::move(loaded))).first;
+		}
+		image = it->second.get();
+		if (image || tile.level == 0)
+			break;
+		tile = TileKey{tile.face, tile.level - 1, tile.x / 2, tile.y / 2};
+	}
+
+	const uint size = GridSize + 3;
+	heights.assign(size * size, 0.f);
+	if (!image)
+		return;
+	float scale = float(1u << (key.level - tile.level));
+	float x0 = key.x - tile.x * scale, y0 = key.y - tile.y * scale;
+	for (uint j = 0; j < size; ++j)
+	{
+		for (uint i = 0; i < size; ++i)
+		{
+			float u = (x0 + (float(i) - 1) / GridSize) / scale;
+			float v = (y0 + (float(j) - 1) / GridSize) / scale;
+			heights[j * size + i] = sampleHeight(*image, u, v);
+		}
+	}
+}
+
+/**
+ * The normals come from the differences of the displaced positions around each vertex,
+ * the border of the heights giving the neighbours of the edges.
+ * The texture coordinates are unwrapped around the chunk center so that they don't jump
+ * across the seam of the texture
+ */
+void Terrain::buildChunk(ChunkData& data)
+{
+	const TileKey& key = data.key;
+	std::vector<float> heights;
+	loadHeights(key, heights);
+
+	const uint size = GridSize + 3;
+	std::vector<glm::vec3> positions(size * size);
+	for (uint j = 0; j < size; ++j)
+	{
+		for (uint i = 0; i < size; ++i)
+		{
+			glm::vec3 direction = spherePoint(key.face, faceCoordinate(key.level, key.x, float(i) - 1),
+											  faceCoordinate(key.level, key.y, float(j) - 1));
+			positions[j * size + i] = direction * (1 + HeightScale * heights[j * size + i]);
+		}
+	}
+
+	float centerU = sphereTexCoords(spherePoint(key.face, faceCoordinate(key.level, key.x, GridSize / 2.f),
+											  faceCoordinate(key.level, key.y, GridSize / 2.f))).x;
+	data.vertices.resize(VertexCount);
+	for (uint j = 0; j <= GridSize; ++j)
+	{
+		for (uint i = 0; i <= GridSize; ++i)
+		{
+			auto at = [&](uint di, uint dj) { return positions[(j + dj) * size + i + di]; };
+			glimac::Geometry::Vertex& vertex = data.vertices[j * (GridSize + 1) + i];
+			vertex.m_Position = at(1, 1);
+			vertex.m_Normal = glm::normalize(glm::cross(at(2, 1) - at(0, 1), at(1, 2) - at(1, 0)));
+			vertex.m_TexCoords = sphereTexCoords(glm::normalize(vertex.m_Position));
+			vertex.m_TexCoords.x -= std::round(vertex.m_TexCoords.x - centerU);
+		}
+	}
+
+	// the skirts hang deeper than the largest step to a neighbour chunk of the next coarser level
+	float skirtDepth = 2 * (cellSize(key.level) + HeightScale / float(1u << key.level));
+	for (uint edge = 0; edge < 4; ++edge)
+	{
+		for (uint k = 0; k <= GridSize; ++k)
+		{
+			uint i = edge == 1 ? GridSize : edge == 3 ? 0 : k;
+			uint j = edge == 0 ? 0 : edge == 2 ? GridSize : k;
+			glimac::Geometry::Vertex vertex = data.vertices[j * (GridSize + 1) + i];
+			vertex.m_Position *= 1 - skirtDepth;
+			data.vertices[GridVertices + edge * (GridSize + 1) + k] = vertex;
+		}
+	}
+}
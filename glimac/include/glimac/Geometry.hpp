@@ -43,6 +43,15 @@ public:
         const Image* m_pNormalMap;
     };
 
+    // Post-transform vertex cache efficiency of the index buffer, for a FIFO cache emptied
+    // before each mesh: ACMR is the mean number of vertices transformed per triangle
+    // (0.5 at best for a regular grid), ATVR the ratio of the vertices transformed
+    // to the vertices used (1 at best)
+    struct CacheStats {
+        float m_fACMR;
+        float m_fATVR;
+    };
+
 private:
     std::vector<Vertex> m_VertexBuffer;
     std::vector<unsigned int> m_IndexBuffer;
@@ -87,6 +96,24 @@ public:
 
     bool loadOBJ(const FilePath& filepath, const FilePath& mtlBasePath, bool loadTextures = true);
 
+    CacheStats getCacheStats(unsigned int cacheSize = 16) const;
+
+    // Reorder the triangles of each mesh for a post-transform vertex cache of cacheSize entries
+    // (Tipsify), then its clusters of triangles against overdraw, and finally the vertices
+    // in the order of their first use, for the locality of the vertex fetches.
+    // loadOBJ runs it on the loaded meshes, whose index order is the one of the file
+    void optimize(unsigned int cacheSize = 16);
+
+    // Indexed sphere centered on the origin, its poles on the y axis, made of discLong rows
+    // of discLat quads (the triangles of the poles having collapsed).
+    // u goes around from -x to +z and v from the south pole to the north pole,
+    // as in assets/sphere.obj
+    static Geometry sphere(float radius, unsigned int discLat, unsigned int discLong);
+
+    // Square of the xy plane from -halfSize to halfSize facing +z, made of two triangles,
+    // v going up as in the textures
+    static Geometry quad(float halfSize);
+
     const BBox3f& getBoundingBox() const {
         return m_BBox;
     }
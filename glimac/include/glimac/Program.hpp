@@ -1,11 +1,18 @@
 #pragma once
 
 #include <GL/glew.h>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "Shader.hpp"
 #include "FilePath.hpp"
+#include "ProgramBinaryCache.hpp"
 
 namespace glimac {
 
+class ProgramBuilder;
+
 class Program {
 public:
 	Program(): m_nGLId(glCreateProgram()) {
@@ -35,6 +42,9 @@ public:
 
 	bool link();
 
+	// True if the last link succeeded
+	bool isLinked() const;
+
 	const std::string getInfoLog() const;
 
 	void use() const {
@@ -54,5 +64,54 @@ Program buildProgram(const GLchar* vsSrc, const GLchar* fsSrc);
 // Load source code from files and build a GLSL program
 Program loadProgram(const FilePath& vsFile, const FilePath& fsFile);
 
+// Build a GLSL program from source code, each define being added to both stages.
+// With a cache, the program is loaded from its stored binary if possible, and stored otherwise
+Program buildProgram(const GLchar* vsSrc, const GLchar* fsSrc, const std::vector<std::string>& defines,
+	ProgramBinaryCache* cache = nullptr);
+
+// Load source code from files and build a GLSL program, each define being added to both stages
+Program loadProgram(const FilePath& vsFile, const FilePath& fsFile, const std::vector<std::string>& defines,
+	ProgramBinaryCache* cache = nullptr);
+
+// Programs compiled from the same pair of sources with different sets of
+// feature flags. The bit i of a mask enables "#define features[i]" in both
+// stages. Each permutation is built the first time it is asked then cached by mask.
+class ProgramPermutations {
+public:
+	ProgramPermutations() = default;
+
+	ProgramPermutations(const FilePath& vsFile, const FilePath& fsFile, std::vector<std::string> features,
+		ProgramBinaryCache* cache = nullptr);
+
+	// Return the program of the permutation, building it if needed
+	const Program& get(uint32_t mask);
+
+	// Start building the permutation with builder, get() must not be called before builder.finish().
+	// If the builder fails, get() builds the permutation again
+	void submit(uint32_t mask, ProgramBuilder& builder);
+
+	bool contains(uint32_t mask) const {
+		return m_Programs.find(mask) != m_Programs.end();
+	}
+
+	// Names of the features enabled by the mask
+	std::vector<std::string> getDefines(uint32_t mask) const;
+
+	size_t size() const {
+		return m_Programs.size();
+	}
+
+private:
+	FilePath m_VsFile;
+	FilePath m_FsFile;
+	std::string m_VsSource;
+	std::string m_FsSource;
+	std::vector<std::string> m_Features;
+	ProgramBinaryCache* m_pCache = nullptr;
+	std::unordered_map<uint32_t, Program> m_Programs;
+	// Permutations submitted to a builder whose link status is not checked yet
+	std::unordered_set<uint32_t> m_Submitted;
+};
+
 
 }
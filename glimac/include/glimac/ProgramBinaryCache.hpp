@@ -0,0 +1,53 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <cstdint>
+#include <string>
+#include "FilePath.hpp"
+
+namespace glimac {
+
+class Program;
+
+// On-disk cache of linked programs (glGetProgramBinary / glProgramBinary).
+// A binary is stored in <directory>/<key>.bin, the key being a hash of both
+// shader sources and of the driver (vendor, renderer and version strings),
+// so that editing a shader or updating the driver never reuses a stale binary.
+// Binaries refused by the driver are removed and the program is compiled again.
+class ProgramBinaryCache {
+public:
+	// Disabled cache, every program is compiled from its sources
+	ProgramBinaryCache() = default;
+
+	explicit ProgramBinaryCache(const FilePath& directory);
+
+	// True if a directory is set and the driver supports at least one binary format
+	bool isEnabled() const;
+
+	uint64_t computeKey(const std::string& vsSrc, const std::string& fsSrc) const;
+
+	// Load the binary stored for key into program, return false if it is missing or invalid
+	bool load(uint64_t key, Program& program);
+
+	// Save the binary of a linked program under key
+	void store(uint64_t key, const Program& program);
+
+	unsigned int getHitCount() const {
+		return m_nHitCount;
+	}
+
+	unsigned int getMissCount() const {
+		return m_nMissCount;
+	}
+
+private:
+	FilePath getFilePath(uint64_t key) const;
+
+	FilePath m_Directory;
+	mutable std::string m_DriverId; // filled on first use, a GL context is needed
+	mutable int m_nSupported = -1; // -1 until the driver is queried
+	unsigned int m_nHitCount = 0;
+	unsigned int m_nMissCount = 0;
+};
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+#include "FilePath.hpp"
+#include "Program.hpp"
+#include "ProgramBinaryCache.hpp"
+
+namespace glimac {
+
+// Compile and link a batch of programs without waiting for each of them.
+// submit() only issues the compile and link commands, no status is queried
+// until finish(), so the driver compiles in the background (on its own threads
+// with GL_KHR_parallel_shader_compile) while the application loads its assets.
+// The programs given to submit() must stay alive until finish() returns.
+class ProgramBuilder {
+public:
+	explicit ProgramBuilder(ProgramBinaryCache* cache = nullptr);
+
+	~ProgramBuilder();
+
+	// Start building program from sources, name is used in error messages
+	void submit(Program& program, const std::string& vsSrc, const std::string& fsSrc, const std::string& name);
+
+	// Start building program from files, each define being added to both stages
+	void submit(Program& program, const FilePath& vsFile, const FilePath& fsFile,
+		const std::vector<std::string>& defines = std::vector<std::string>());
+
+	// Number of programs still being built. Without GL_KHR_parallel_shader_compile
+	// the status can't be queried without blocking so nothing is reported finished before finish()
+	size_t poll() const;
+
+	// Wait for every submitted program, store the new binaries in the cache,
+	// throw std::runtime_error on the first compilation or link error
+	void finish();
+
+	size_t getSubmittedCount() const {
+		return m_nSubmittedCount;
+	}
+
+	// True if the driver compiles in parallel and poll() is meaningful
+	bool isParallel() const {
+		return m_bParallel;
+	}
+
+private:
+	ProgramBuilder(const ProgramBuilder&);
+	ProgramBuilder& operator =(const ProgramBuilder&);
+
+	struct PendingProgram {
+		Program* program;
+		GLuint vs;
+		GLuint fs;
+		uint64_t key;
+		std::string name;
+	};
+
+	void release(PendingProgram& pending);
+
+	ProgramBinaryCache* m_pCache;
+	std::vector<PendingProgram> m_Pending;
+	size_t m_nSubmittedCount = 0;
+	bool m_bParallel;
+};
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace glimac {
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// push() and pop() never block: they return false when the queue is full or empty.
+template<typename T>
+class SPSCQueue {
+public:
+	// capacity is rounded up to a power of two
+	explicit SPSCQueue(size_t capacity):
+		m_nHead(0), m_nTail(0) {
+		size_t size = 1;
+		while(size < capacity) {
+			size *= 2;
+		}
+		m_Items.resize(size);
+		m_nMask = size - 1;
+	}
+
+	// Producer side
+	bool push(const T& item) {
+		size_t tail = m_nTail.load(std::memory_order_relaxed);
+		if(tail - m_nHead.load(std::memory_order_acquire) == m_Items.size()) {
+			return false;
+		}
+		m_Items[tail & m_nMask] = item;
+		m_nTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side
+	bool pop(T& item) {
+		size_t head = m_nHead.load(std::memory_order_relaxed);
+		if(head == m_nTail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = m_Items[head & m_nMask];
+		m_nHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, true if pop() would return false
+	bool empty() const {
+		return m_nHead.load(std::memory_order_relaxed) == m_nTail.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const {
+		return m_Items.size();
+	}
+
+private:
+	SPSCQueue(const SPSCQueue&);
+	SPSCQueue& operator =(const SPSCQueue&);
+
+	std::vector<T> m_Items;
+	size_t m_nMask;
+	// on their own cache lines so that the two threads don't share them
+	alignas(64) std::atomic<size_t> m_nHead;
+	alignas(64) std::atomic<size_t> m_nTail;
+};
+
+}
@@ -2,6 +2,7 @@
 #define GLEW_STATIC
 #include <GL/glew.h>
 #include <string>
+#include <vector>
 #include "FilePath.hpp"
 
 #define GLIMAC_SHADER_SRC(str) #str
@@ -46,6 +47,12 @@ private:
 	GLuint m_nGLId;
 };
 
+// Read the source code of a shader file
+std::string loadShaderSource(const FilePath& filepath);
+
+// Insert a "#define <name>" line for each name right after the #version directive
+std::string addShaderDefines(const std::string& src, const std::vector<std::string>& defines);
+
 // Load a shader (but does not compile it)
 Shader loadShader(GLenum type, const FilePath& filepath);
 
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "common.hpp"
+
+namespace glimac {
+
+// Buffer persistently mapped (glBufferStorage with GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT)
+// and split in regionCount regions. Each frame the CPU writes the next region while the GPU
+// may still read the previous ones, a fence per region tells when it can be overwritten.
+// The time spent waiting on those fences is measured: it should stay at zero with enough regions.
+// Regions are not padded, binding a region as a uniform or storage block needs a regionSize
+// multiple of the offset alignment of the driver.
+class StreamBuffer {
+public:
+	StreamBuffer() = default;
+
+	StreamBuffer(GLenum target, GLsizeiptr regionSize, unsigned int regionCount = 3);
+
+	~StreamBuffer();
+
+	StreamBuffer(StreamBuffer&& rvalue);
+
+	StreamBuffer& operator =(StreamBuffer&& rvalue);
+
+	// True if the driver supports buffer storage (GL 4.4 or GL_ARB_buffer_storage)
+	static bool isSupported();
+
+	// Wait until the GPU released the next region and return its memory
+	void* beginFrame();
+
+	// Fence the current region, to call after the draw calls reading it
+	void endFrame();
+
+	GLuint getGLId() const {
+		return m_nGLId;
+	}
+
+	GLenum getTarget() const {
+		return m_Target;
+	}
+
+	unsigned int getRegionIndex() const {
+		return m_nRegion;
+	}
+
+	unsigned int getRegionCount() const {
+		return m_Fences.size();
+	}
+
+	GLsizeiptr getRegionSize() const {
+		return m_nRegionSize;
+	}
+
+	GLintptr getRegionOffset() const {
+		return m_nRegion * m_nRegionSize;
+	}
+
+	// Time spent waiting on the fence in the last beginFrame(), in milliseconds
+	double getLastStallTime() const {
+		return m_fLastStallTime;
+	}
+
+	double getTotalStallTime() const {
+		return m_fTotalStallTime;
+	}
+
+	unsigned int getStallCount() const {
+		return m_nStallCount;
+	}
+
+private:
+	StreamBuffer(const StreamBuffer&);
+	StreamBuffer& operator =(const StreamBuffer&);
+
+	void release();
+	void wait(unsigned int region);
+
+	GLuint m_nGLId = 0;
+	GLenum m_Target = GL_ARRAY_BUFFER;
+	GLsizeiptr m_nRegionSize = 0;
+	unsigned int m_nRegion = 0;
+	char* m_pData = nullptr;
+	std::vector<GLsync> m_Fences;
+
+	double m_fLastStallTime = 0;
+	double m_fTotalStallTime = 0;
+	unsigned int m_nStallCount = 0;
+};
+
+// Array of T streamed every frame through a StreamBuffer region. Only the elements
+// changed since the region was last written are copied: an element keeps the number
+// of the frame where it last changed and each region the number of its last upload.
+template<typename T>
+class StreamArray {
+public:
+	explicit StreamArray(GLenum target = GL_ARRAY_BUFFER, unsigned int regionCount = 3):
+		m_Target(target), m_nRegionCount(regionCount) {
+	}
+
+	size_t size() const {
+		return m_Values.size();
+	}
+
+	// Change the number of elements, the buffer is reallocated when its capacity is exceeded
+	void resize(size_t count) {
+		if(count > m_nCapacity || !m_nCapacity) {
+			m_nCapacity = count < 64 ? 64 : count * 2;
+			m_Buffer = StreamBuffer(m_Target, m_nCapacity * sizeof(T), m_nRegionCount);
+			m_RegionFrames.assign(m_nRegionCount, 0);
+			std::fill(m_Frames.begin(), m_Frames.end(), m_nFrame + 1);
+		}
+		m_Values.resize(count);
+		m_Frames.resize(count, m_nFrame + 1);
+	}
+
+	// Set an element for the next upload, flagged as changed only if it differs.
+	// Different elements may be set concurrently
+	void set(size_t i, const T& value) {
+		if(std::memcmp(&m_Values[i], &value, sizeof(T)) != 0) {
+			m_Values[i] = value;
+			m_Frames[i] = m_nFrame + 1;
+		}
+	}
+
+	const T& operator [](size_t i) const {
+		return m_Values[i];
+	}
+
+	// Write the changed elements in the region of the new frame, return their count
+	size_t upload() {
+		++m_nFrame;
+		T* region = static_cast<T*>(m_Buffer.beginFrame());
+		uint64_t regionFrame = m_RegionFrames[m_Buffer.getRegionIndex()];
+		size_t count = 0;
+		for(size_t i = 0; i < m_Values.size(); ++i) {
+			if(m_Frames[i] > regionFrame) {
+				region[i] = m_Values[i];
+				++count;
+			}
+		}
+		m_RegionFrames[m_Buffer.getRegionIndex()] = m_nFrame;
+		return count;
+	}
+
+	// Fence the region once the draw calls using it are issued
+	void endFrame() {
+		m_Buffer.endFrame();
+	}
+
+	// Index of the element 0 of the current frame in the whole buffer
+	GLuint getFirstIndex() const {
+		return m_Buffer.getRegionIndex() * m_nCapacity;
+	}
+
+	const StreamBuffer& getBuffer() const {
+		return m_Buffer;
+	}
+
+private:
+	GLenum m_Target;
+	unsigned int m_nRegionCount;
+	size_t m_nCapacity = 0;
+	StreamBuffer m_Buffer;
+	std::vector<T> m_Values;
+	std::vector<uint64_t> m_Frames;
+	std::vector<uint64_t> m_RegionFrames;
+	uint64_t m_nFrame = 0;
+};
+
+}
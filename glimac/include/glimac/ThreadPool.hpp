@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace glimac {
+
+// Fixed set of worker threads running data parallel loops.
+// parallelFor() splits [0, count) in chunks of grain elements, the workers
+// and the calling thread take the chunks until none is left, and it returns
+// when every chunk is done. Only one thread may call parallelFor() at a time.
+// The job must not touch the GL context, it is only current on the calling thread.
+class ThreadPool {
+public:
+	typedef std::function<void (size_t begin, size_t end)> Job;
+
+	// threadCount workers, 0 for one per hardware thread except the calling one
+	explicit ThreadPool(unsigned int threadCount = 0);
+
+	~ThreadPool();
+
+	void parallelFor(size_t count, size_t grain, const Job& job);
+
+	unsigned int getWorkerCount() const {
+		return m_Workers.size();
+	}
+
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator =(const ThreadPool&);
+
+	void workerLoop();
+
+	// Run the chunks of the current job until there is none left
+	void runChunks();
+
+	std::vector<std::thread> m_Workers;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_WorkAvailable;
+	std::condition_variable m_WorkDone;
+	bool m_bStop = false;
+	uint64_t m_nGeneration = 0;
+	unsigned int m_nActiveWorkers = 0;
+
+	// Current job, written under m_Mutex while no worker is active
+	const Job* m_pJob = nullptr;
+	size_t m_nCount = 0;
+	size_t m_nGrain = 1;
+	size_t m_nChunkCount = 0;
+	std::atomic<size_t> m_nNextChunk;
+	std::atomic<size_t> m_nDoneChunks;
+};
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+
+namespace glimac {
+
+// Lock-free hand over of the latest value from one producer thread to one consumer thread.
+// The producer fills back() then publish() it, the consumer calls update() to get
+// the last published value in front(). Neither side ever waits for the other,
+// values published before the consumer updates are skipped.
+template<typename T>
+class TripleBuffer {
+public:
+	TripleBuffer():
+		m_nReady(2), m_nBack(1), m_nFront(0) {
+	}
+
+	// Producer side
+	T& back() {
+		return m_Buffers[m_nBack];
+	}
+
+	void publish() {
+		unsigned int previous = m_nReady.exchange(m_nBack | FRESH, std::memory_order_acq_rel);
+		m_nBack = previous & ~FRESH;
+	}
+
+	// Consumer side, return true if a new value was published since the last call
+	bool update() {
+		if(!(m_nReady.load(std::memory_order_relaxed) & FRESH)) {
+			return false;
+		}
+		unsigned int previous = m_nReady.exchange(m_nFront, std::memory_order_acq_rel);
+		m_nFront = previous & ~FRESH;
+		return true;
+	}
+
+	const T& front() const {
+		return m_Buffers[m_nFront];
+	}
+
+private:
+	static const unsigned int FRESH = 4;
+
+	T m_Buffers[3];
+	std::atomic<unsigned int> m_nReady;
+	unsigned int m_nBack;
+	unsigned int m_nFront;
+};
+
+}
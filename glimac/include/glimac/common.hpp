@@ -15,4 +15,12 @@ struct ShapeVertex {
 	ShapeVertex(){}
 };
 
+/**
+ * Whether buffers, textures and vertex arrays can be created and edited
+ * with the direct state access functions (GL 4.5), without binding them
+ */
+inline bool hasDirectStateAccess() {
+	return GLEW_VERSION_4_5 || GLEW_ARB_direct_state_access;
+}
+
 }
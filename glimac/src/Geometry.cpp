@@ -2,9 +2,221 @@
 #include "tiny_obj_loader.h"
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <limits>
 
 namespace glimac {
 
+namespace {
+
+// Vertex with live triangles to fan around when the candidates of the last fan are exhausted:
+// the most recent one of the dead-end stack still in use, or the next one in the vertex order
+int skipDeadEnd(const std::vector<unsigned int>& liveCount, std::vector<unsigned int>& deadEnd,
+                unsigned int& cursor, unsigned int vertexEnd) {
+    while (!deadEnd.empty()) {
+        unsigned int vertex = deadEnd.back();
+        deadEnd.pop_back();
+        if (liveCount[vertex] > 0) {
+            return vertex;
+        }
+    }
+    while (cursor < vertexEnd) {
+        if (liveCount[cursor] > 0) {
+            return cursor++;
+        }
+        ++cursor;
+    }
+    return -1;
+}
+
+// Tipsify (Sander, Nehab and Barczak, Fast Triangle Reordering for Vertex Locality and Reduced Overdraw):
+// the triangles around a fanning vertex are emitted together, the next fanning vertex being
+// the candidate which will stay the longest in the cache after its own triangles are emitted.
+// A cluster starts at each jump to a vertex which isn't a candidate
+void tipsify(const unsigned int* index, unsigned int indexCount, unsigned int vertexBegin, unsigned int vertexEnd,
+             unsigned int cacheSize, std::vector<unsigned int>& triangles, std::vector<unsigned int>& clusters) {
+    unsigned int triangleCount = indexCount / 3;
+    unsigned int vertexCount = vertexEnd - vertexBegin;
+    std::vector<unsigned int> firstTriangle(vertexCount + 1, 0);
+    for (auto j = 0u; j < triangleCount * 3; ++j) {
+        ++firstTriangle[index[j] - vertexBegin + 1];
+    }
+    for (auto v = 0u; v < vertexCount; ++v) {
+        firstTriangle[v + 1] += firstTriangle[v];
+    }
+    std::vector<unsigned int> liveCount(vertexCount);
+    for (auto v = 0u; v < vertexCount; ++v) {
+        liveCount[v] = firstTriangle[v + 1] - firstTriangle[v];
+    }
+    std::vector<unsigned int> adjacency(triangleCount * 3);
+    std::vector<unsigned int> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (auto j = 0u; j < triangleCount * 3; ++j) {
+        adjacency[filled[index[j] - vertexBegin]++] = j / 3;
+    }
+
+    std::vector<unsigned int> cacheTime(vertexCount, 0);
+    std::vector<char> emitted(triangleCount, 0);
+    std::vector<unsigned int> deadEnd;
+    std::vector<unsigned int> candidates;
+    unsigned int time = cacheSize + 1;
+    unsigned int cursor = 0;
+    triangles.clear();
+    clusters.clear();
+
+    int fanning = skipDeadEnd(liveCount, deadEnd, cursor, vertexCount);
+    clusters.push_back(0);
+    while (fanning >= 0) {
+        candidates.clear();
+        for (auto t = firstTriangle[fanning]; t < firstTriangle[fanning + 1]; ++t) {
+            unsigned int triangle = adjacency[t];
+            if (emitted[triangle]) {
+                continue;
+            }
+            emitted[triangle] = 1;
+            triangles.push_back(triangle);
+            for (auto c = 0u; c < 3; ++c) {
+                unsigned int vertex = index[3 * triangle + c] - vertexBegin;
+                deadEnd.push_back(vertex);
+                candidates.push_back(vertex);
+                --liveCount[vertex];
+                if (time - cacheTime[vertex] > cacheSize) {
+                    cacheTime[vertex] = time++;
+                }
+            }
+        }
+
+        // a candidate whose triangles would push it out of the cache is only taken after those which stay in it
+        int next = -1;
+        int bestPriority = -1;
+        for (unsigned int vertex : candidates) {
+            if (liveCount[vertex] == 0) {
+                continue;
+            }
+            int priority = 0;
+            if (time - cacheTime[vertex] + 2 * liveCount[vertex] <= cacheSize) {
+                priority = time - cacheTime[vertex];
+            }
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                next = vertex;
+            }
+        }
+        if (next < 0) {
+            next = skipDeadEnd(liveCount, deadEnd, cursor, vertexCount);
+            if (next >= 0 && triangles.size() < triangleCount) {
+                clusters.push_back(triangles.size());
+            }
+        }
+        fanning = next;
+    }
+    clusters.push_back(triangles.size());
+}
+
+}
+
+Geometry::CacheStats Geometry::getCacheStats(unsigned int cacheSize) const {
+    // a vertex is in the FIFO while less than cacheSize vertices were transformed after it
+    std::vector<unsigned int> missTime(m_VertexBuffer.size(), 0);
+    std::vector<char> used(m_VertexBuffer.size(), 0);
+    unsigned int misses = 0, usedCount = 0, triangleCount = 0;
+    for (const auto& mesh: m_MeshBuffer) {
+        unsigned int meshStart = misses;
+        for (auto j = mesh.m_nIndexOffset; j < mesh.m_nIndexOffset + mesh.m_nIndexCount; ++j) {
+            unsigned int vertex = m_IndexBuffer[j];
+            if (missTime[vertex] <= meshStart || misses - missTime[vertex] >= cacheSize) {
+                missTime[vertex] = ++misses;
+            }
+            if (!used[vertex]) {
+                used[vertex] = 1;
+                ++usedCount;
+            }
+        }
+        triangleCount += mesh.m_nIndexCount / 3;
+    }
+    CacheStats stats;
+    stats.m_fACMR = triangleCount ? float(misses) / triangleCount : 0.f;
+    stats.m_fATVR = usedCount ? float(misses) / usedCount : 0.f;
+    return stats;
+}
+
+// The clusters facing away from the center of the mesh are drawn first,
+// as they are likely to hide the others (Sander, Nehab and Barczak, section 4)
+void Geometry::optimize(unsigned int cacheSize) {
+    std::vector<unsigned int> triangles, clusters, order;
+    std::vector<std::pair<float, unsigned int>> clusterKeys;
+    std::vector<unsigned int> reordered;
+    for (const auto& mesh: m_MeshBuffer) {
+        const unsigned int* index = m_IndexBuffer.data() + mesh.m_nIndexOffset;
+        unsigned int indexCount = mesh.m_nIndexCount / 3 * 3;
+        if (indexCount == 0) {
+            continue;
+        }
+        auto range = std::minmax_element(index, index + indexCount);
+        tipsify(index, indexCount, *range.first, *range.second + 1, cacheSize, triangles, clusters);
+
+        auto centroid = [&](unsigned int triangle) {
+            return (m_VertexBuffer[index[3 * triangle]].m_Position + m_VertexBuffer[index[3 * triangle + 1]].m_Position
+                    + m_VertexBuffer[index[3 * triangle + 2]].m_Position) / 3.f;
+        };
+        glm::vec3 meshCenter(0);
+        for (unsigned int triangle : triangles) {
+            meshCenter += centroid(triangle);
+        }
+        meshCenter /= float(triangles.size());
+
+        clusterKeys.clear();
+        for (auto c = 0u; c + 1 < clusters.size(); ++c) {
+            glm::vec3 center(0), normal(0);
+            float area = 0;
+            for (auto t = clusters[c]; t < clusters[c + 1]; ++t) {
+                const glm::vec3& a = m_VertexBuffer[index[3 * triangles[t]]].m_Position;
+                glm::vec3 cross = glm::cross(m_VertexBuffer[index[3 * triangles[t] + 1]].m_Position - a,
+                                             m_VertexBuffer[index[3 * triangles[t] + 2]].m_Position - a);
+                float triangleArea = glm::length(cross);
+                center += triangleArea * centroid(triangles[t]);
+                normal += cross;
+                area += triangleArea;
+            }
+            float key = 0;
+            if (area > 0 && glm::length(normal) > 0) {
+                key = glm::dot(center / area - meshCenter, glm::normalize(normal));
+            }
+            clusterKeys.emplace_back(key, c);
+        }
+        std::stable_sort(clusterKeys.begin(), clusterKeys.end(),
+            [](const std::pair<float, unsigned int>& a, const std::pair<float, unsigned int>& b) {
+                return a.first > b.first;
+            });
+
+        reordered.clear();
+        for (const auto& key: clusterKeys) {
+            for (auto t = clusters[key.second]; t < clusters[key.second + 1]; ++t) {
+                reordered.insert(reordered.end(), index + 3 * triangles[t], index + 3 * triangles[t] + 3);
+            }
+        }
+        std::copy(reordered.begin(), reordered.end(), m_IndexBuffer.begin() + mesh.m_nIndexOffset);
+    }
+
+    // the vertices are stored in the order the index buffer first reads them, the unused ones last
+    const unsigned int unset = std::numeric_limits<unsigned int>::max();
+    std::vector<unsigned int> remap(m_VertexBuffer.size(), unset);
+    unsigned int next = 0;
+    for (auto& vertex: m_IndexBuffer) {
+        if (remap[vertex] == unset) {
+            remap[vertex] = next++;
+        }
+        vertex = remap[vertex];
+    }
+    std::vector<Vertex> vertices(m_VertexBuffer.size());
+    for (auto v = 0u; v < m_VertexBuffer.size(); ++v) {
+        if (remap[v] == unset) {
+            remap[v] = next++;
+        }
+        vertices[remap[v]] = m_VertexBuffer[v];
+    }
+    m_VertexBuffer.swap(vertices);
+}
+
 void Geometry::generateNormals(unsigned int meshIndex) {
     auto indexOffset = m_MeshBuffer[meshIndex].m_nIndexOffset;
     for (auto j = 0u; j < m_MeshBuffer[meshIndex].m_nIndexCount; j += 3) {
@@ -167,7 +379,66 @@ bool Geometry::loadOBJ(const FilePath& filepath, const FilePath& mtlBasePath, bo
         indexOffset += shapes[i].mesh.indices.size();
     }
 
+    CacheStats before = getCacheStats();
+    optimize();
+    CacheStats after = getCacheStats();
+    std::clog << "Vertex cache ACMR " << before.m_fACMR << " -> " << after.m_fACMR
+              << ", ATVR " << before.m_fATVR << " -> " << after.m_fATVR << std::endl;
+
     return true;
 }
 
+Geometry Geometry::sphere(float radius, unsigned int discLat, unsigned int discLong) {
+    Geometry geometry;
+    for (auto j = 0u; j <= discLong; ++j) {
+        float theta = glm::pi<float>() * (float(j) / discLong - 0.5f);
+        for (auto i = 0u; i <= discLat; ++i) {
+            float phi = 2 * glm::pi<float>() * (float(i) / discLat - 0.25f);
+            Vertex vertex;
+            vertex.m_Normal = glm::vec3(std::sin(phi) * std::cos(theta), std::sin(theta), std::cos(phi) * std::cos(theta));
+            vertex.m_Position = radius * vertex.m_Normal;
+            vertex.m_TexCoords = glm::vec2(float(i) / discLat, float(j) / discLong);
+            geometry.m_VertexBuffer.push_back(vertex);
+        }
+    }
+
+    // counterclockwise seen from outside, without the triangle of each quad which touches a pole twice
+    for (auto j = 0u; j < discLong; ++j) {
+        unsigned int row = j * (discLat + 1), nextRow = row + discLat + 1;
+        for (auto i = 0u; i < discLat; ++i) {
+            if (j > 0) {
+                geometry.m_IndexBuffer.push_back(row + i);
+                geometry.m_IndexBuffer.push_back(row + i + 1);
+                geometry.m_IndexBuffer.push_back(nextRow + i + 1);
+            }
+            if (j + 1 < discLong) {
+                geometry.m_IndexBuffer.push_back(row + i);
+                geometry.m_IndexBuffer.push_back(nextRow + i + 1);
+                geometry.m_IndexBuffer.push_back(nextRow + i);
+            }
+        }
+    }
+
+    geometry.m_MeshBuffer.emplace_back("sphere", 0, geometry.m_IndexBuffer.size(), -1);
+    geometry.m_BBox = BBox3f(glm::vec3(-radius), glm::vec3(radius));
+    return geometry;
+}
+
+Geometry Geometry::quad(float halfSize) {
+    Geometry geometry;
+    const glm::vec2 corners[4] = {glm::vec2(0, 0), glm::vec2(1, 0), glm::vec2(1, 1), glm::vec2(0, 1)};
+    for (const glm::vec2& corner : corners) {
+        Vertex vertex;
+        vertex.m_Position = glm::vec3(halfSize * (2.f * corner - 1.f), 0);
+        vertex.m_Normal = glm::vec3(0, 0, 1);
+        vertex.m_TexCoords = corner;
+        geometry.m_VertexBuffer.push_back(vertex);
+    }
+    geometry.m_IndexBuffer = {0, 1, 2, 0, 2, 3};
+
+    geometry.m_MeshBuffer.emplace_back("quad", 0, geometry.m_IndexBuffer.size(), -1);
+    geometry.m_BBox = BBox3f(glm::vec3(-halfSize, -halfSize, 0), glm::vec3(halfSize, halfSize, 0));
+    return geometry;
+}
+
 }
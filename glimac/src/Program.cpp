@@ -1,5 +1,6 @@
 #define GLEW_STATIC
 #include "glimac/Program.hpp"
+#include "glimac/ProgramBuilder.hpp"
 #include <stdexcept>
 
 namespace glimac {
@@ -11,6 +12,12 @@ bool Program::link() {
 	return status == GL_TRUE;
 }
 
+bool Program::isLinked() const {
+	GLint status;
+	glGetProgramiv(m_nGLId, GL_LINK_STATUS, &status);
+	return status == GL_TRUE;
+}
+
 const std::string Program::getInfoLog() const {
 	GLint length;
 	glGetProgramiv(m_nGLId, GL_INFO_LOG_LENGTH, &length);
@@ -21,8 +28,9 @@ const std::string Program::getInfoLog() const {
 	return logString;
 }
 
-// Build a GLSL program from source code
-Program buildProgram(const GLchar* vsSrc, const GLchar* fsSrc) {
+namespace {
+
+Program compileAndLink(const GLchar* vsSrc, const GLchar* fsSrc, bool retrievable) {
 	Shader vs(GL_VERTEX_SHADER);
 	vs.setSource(vsSrc);
 
@@ -40,6 +48,10 @@ Program buildProgram(const GLchar* vsSrc, const GLchar* fsSrc) {
 	Program program;
 	program.attachShader(vs);
 	program.attachShader(fs);
+	if(retrievable) {
+		// some drivers only keep the binary if asked before linking
+		glProgramParameteri(program.getGLId(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 
 	if(!program.link()) {
 		throw std::runtime_error("Link error: " + program.getInfoLog());
@@ -48,6 +60,13 @@ Program buildProgram(const GLchar* vsSrc, const GLchar* fsSrc) {
 	return program;
 }
 
+}
+
+// Build a GLSL program from source code
+Program buildProgram(const GLchar* vsSrc, const GLchar* fsSrc) {
+	return compileAndLink(vsSrc, fsSrc, false);
+}
+
 // Load source code from files and build a GLSL program
 Program loadProgram(const FilePath& vsFile, const FilePath& fsFile) {
 	Shader vs = loadShader(GL_VERTEX_SHADER, vsFile);
@@ -72,4 +91,90 @@ Program loadProgram(const FilePath& vsFile, const FilePath& fsFile) {
 	return program;
 }
 
+// Build a GLSL program from source code, each define being added to both stages.
+// With a cache, the program is loaded from its stored binary if possible, and stored otherwise
+Program buildProgram(const GLchar* vsSrc, const GLchar* fsSrc, const std::vector<std::string>& defines,
+	ProgramBinaryCache* cache) {
+	std::string vs = addShaderDefines(vsSrc, defines);
+	std::string fs = addShaderDefines(fsSrc, defines);
+
+	if(!cache || !cache->isEnabled()) {
+		return compileAndLink(vs.c_str(), fs.c_str(), false);
+	}
+
+	uint64_t key = cache->computeKey(vs, fs);
+	{
+		Program program;
+		if(cache->load(key, program)) {
+			return program;
+		}
+	}
+	Program program = compileAndLink(vs.c_str(), fs.c_str(), true);
+	cache->store(key, program);
+	return program;
+}
+
+// Load source code from files and build a GLSL program, each define being added to both stages
+Program loadProgram(const FilePath& vsFile, const FilePath& fsFile, const std::vector<std::string>& defines,
+	ProgramBinaryCache* cache) {
+	std::string vsSrc = loadShaderSource(vsFile);
+	std::string fsSrc = loadShaderSource(fsFile);
+	try {
+		return buildProgram(vsSrc.c_str(), fsSrc.c_str(), defines, cache);
+	} catch(const std::runtime_error& e) {
+		throw std::runtime_error(std::string(e.what()) + " (for files " + vsFile.str() + " and " + fsFile.str() + ")");
+	}
+}
+
+ProgramPermutations::ProgramPermutations(const FilePath& vsFile, const FilePath& fsFile, std::vector<std::string> features,
+	ProgramBinaryCache* cache):
+	m_VsFile(vsFile), m_FsFile(fsFile),
+	m_VsSource(loadShaderSource(vsFile)), m_FsSource(loadShaderSource(fsFile)),
+	m_Features(std::move(features)), m_pCache(cache) {
+	if(m_Features.size() > 32) {
+		throw std::runtime_error("Too many features for a 32 bits permutation mask");
+	}
+}
+
+const Program& ProgramPermutations::get(uint32_t mask) {
+	auto it = m_Programs.find(mask);
+	if(it != m_Programs.end()) {
+		if(!m_Submitted.erase(mask) || it->second.isLinked()) {
+			return it->second;
+		}
+		// the builder failed, build it again to throw its error
+		m_Programs.erase(it);
+	}
+
+	try {
+		Program program = buildProgram(m_VsSource.c_str(), m_FsSource.c_str(), getDefines(mask), m_pCache);
+		return m_Programs.emplace(mask, std::move(program)).first->second;
+	} catch(const std::runtime_error& e) {
+		throw std::runtime_error(std::string(e.what()) + " (for files " + m_VsFile.str() + " and " + m_FsFile.str() + ", permutation " + std::to_string(mask) + ")");
+	}
+}
+
+void ProgramPermutations::submit(uint32_t mask, ProgramBuilder& builder) {
+	if(contains(mask)) {
+		return;
+	}
+	Program& program = m_Programs[mask];
+	m_Submitted.insert(mask);
+	std::vector<std::string> defines = getDefines(mask);
+	builder.submit(program,
+		addShaderDefines(m_VsSource, defines),
+		addShaderDefines(m_FsSource, defines),
+		m_VsFile.str() + " and " + m_FsFile.str() + ", permutation " + std::to_string(mask));
+}
+
+std::vector<std::string> ProgramPermutations::getDefines(uint32_t mask) const {
+	std::vector<std::string> defines;
+	for(size_t i = 0; i < m_Features.size(); ++i) {
+		if(mask & (1u << i)) {
+			defines.push_back(m_Features[i]);
+		}
+	}
+	return defines;
+}
+
 }
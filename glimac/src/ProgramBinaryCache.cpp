@@ -0,0 +1,161 @@
+#define GLEW_STATIC
+#include "glimac/ProgramBinaryCache.hpp"
+#include "glimac/Program.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace glimac {
+
+namespace {
+
+const uint32_t BINARY_MAGIC = 0x42504c47; // "GLPB"
+const uint32_t BINARY_VERSION = 1;
+
+struct BinaryHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+// 64 bits FNV-1a
+uint64_t hashBytes(uint64_t hash, const std::string& bytes) {
+	for(unsigned char c: bytes) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	// separator so that ("ab", "c") and ("a", "bc") differ
+	hash ^= 0xff;
+	hash *= 1099511628211ull;
+	return hash;
+}
+
+std::string getGLString(GLenum name) {
+	const GLubyte* str = glGetString(name);
+	return str ? std::string((const char*) str) : std::string();
+}
+
+}
+
+ProgramBinaryCache::ProgramBinaryCache(const FilePath& directory): m_Directory(directory) {
+#ifdef _WIN32
+	_mkdir(m_Directory.c_str());
+#else
+	mkdir(m_Directory.c_str(), 0755);
+#endif
+}
+
+bool ProgramBinaryCache::isEnabled() const {
+	if(m_Directory.empty()) {
+		return false;
+	}
+	if(m_nSupported < 0) {
+		GLint formatCount = 0;
+		if(GLEW_ARB_get_program_binary) {
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+		}
+		m_nSupported = formatCount > 0 ? 1 : 0;
+		if(!m_nSupported) {
+			std::clog << "Program binaries not supported by the driver, shaders cache disabled" << std::endl;
+		}
+	}
+	return m_nSupported == 1;
+}
+
+uint64_t ProgramBinaryCache::computeKey(const std::string& vsSrc, const std::string& fsSrc) const {
+	if(m_DriverId.empty()) {
+		m_DriverId = getGLString(GL_VENDOR) + "|" + getGLString(GL_RENDERER) + "|" + getGLString(GL_VERSION);
+	}
+	uint64_t hash = 14695981039346656037ull;
+	hash = hashBytes(hash, m_DriverId);
+	hash = hashBytes(hash, vsSrc);
+	hash = hashBytes(hash, fsSrc);
+	return hash;
+}
+
+bool ProgramBinaryCache::load(uint64_t key, Program& program) {
+	FilePath filepath = getFilePath(key);
+	std::ifstream input(filepath.c_str(), std::ios::binary);
+	if(!input) {
+		++m_nMissCount;
+		return false;
+	}
+
+	BinaryHeader header;
+	std::vector<char> binary;
+	bool valid = bool(input.read((char*) &header, sizeof(header)))
+		&& header.magic == BINARY_MAGIC
+		&& header.version == BINARY_VERSION
+		&& header.key == key;
+	if(valid) {
+		// a corrupt length can't be trusted with the allocation, it must fit in the file
+		std::streampos start = input.tellg();
+		input.seekg(0, std::ios::end);
+		std::streamoff remaining = input.tellg() - start;
+		input.seekg(start);
+		valid = remaining >= 0 && uint64_t(header.length) <= uint64_t(remaining);
+	}
+	if(valid) {
+		binary.resize(header.length);
+		valid = bool(input.read(binary.data(), header.length));
+	}
+	input.close();
+
+	if(valid) {
+		glProgramBinary(program.getGLId(), header.format, binary.data(), header.length);
+		GLint status;
+		glGetProgramiv(program.getGLId(), GL_LINK_STATUS, &status);
+		valid = status == GL_TRUE;
+	}
+
+	if(!valid) {
+		// truncated file, corrupt length or binary refused by the driver, it will be rebuilt
+		std::clog << "Invalid program binary " << filepath << ", removed" << std::endl;
+		std::remove(filepath.c_str());
+		++m_nMissCount;
+		return false;
+	}
+
+	++m_nHitCount;
+	return true;
+}
+
+void ProgramBinaryCache::store(uint64_t key, const Program& program) {
+	GLint length = 0;
+	glGetProgramiv(program.getGLId(), GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0) {
+		return;
+	}
+
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(program.getGLId(), length, &length, &format, binary.data());
+
+	BinaryHeader header = { BINARY_MAGIC, BINARY_VERSION, key, format, (uint32_t) length };
+	FilePath filepath = getFilePath(key);
+	std::ofstream output(filepath.c_str(), std::ios::binary | std::ios::trunc);
+	if(!output) {
+		std::cerr << "Unable to write the program binary " << filepath << std::endl;
+		return;
+	}
+	output.write((const char*) &header, sizeof(header));
+	output.write(binary.data(), length);
+}
+
+FilePath ProgramBinaryCache::getFilePath(uint64_t key) const {
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) key);
+	return m_Directory + name;
+}
+
+}
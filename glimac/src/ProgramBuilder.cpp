@@ -0,0 +1,146 @@
+#define GLEW_STATIC
+#include "glimac/ProgramBuilder.hpp"
+
+#include <stdexcept>
+
+namespace glimac {
+
+namespace {
+
+std::string getShaderInfoLog(GLuint shader) {
+	GLint length;
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+	if(length <= 0) {
+		return std::string();
+	}
+	std::string log(length, '\0');
+	glGetShaderInfoLog(shader, length, 0, &log[0]);
+	return log;
+}
+
+GLuint createShader(GLenum type, const std::string& src) {
+	GLuint shader = glCreateShader(type);
+	const char* str = src.c_str();
+	glShaderSource(shader, 1, &str, 0);
+	glCompileShader(shader);
+	return shader;
+}
+
+}
+
+ProgramBuilder::ProgramBuilder(ProgramBinaryCache* cache):
+	m_pCache(cache), m_bParallel(false) {
+#ifdef GL_KHR_parallel_shader_compile
+	if(GLEW_KHR_parallel_shader_compile) {
+		// let the driver pick its number of compiler threads
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		m_bParallel = true;
+	}
+#endif
+}
+
+ProgramBuilder::~ProgramBuilder() {
+	for(auto& pending: m_Pending) {
+		release(pending);
+	}
+}
+
+void ProgramBuilder::submit(Program& program, const std::string& vsSrc, const std::string& fsSrc, const std::string& name) {
+	++m_nSubmittedCount;
+
+	uint64_t key = 0;
+	if(m_pCache && m_pCache->isEnabled()) {
+		key = m_pCache->computeKey(vsSrc, fsSrc);
+		if(m_pCache->load(key, program)) {
+			return;
+		}
+	}
+
+	PendingProgram pending;
+	pending.program = &program;
+	pending.vs = createShader(GL_VERTEX_SHADER, vsSrc);
+	pending.fs = createShader(GL_FRAGMENT_SHADER, fsSrc);
+	pending.key = key;
+	pending.name = name;
+
+	GLuint id = program.getGLId();
+	glAttachShader(id, pending.vs);
+	glAttachShader(id, pending.fs);
+	if(m_pCache && m_pCache->isEnabled()) {
+		glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	glLinkProgram(id);
+
+	m_Pending.push_back(pending);
+}
+
+void ProgramBuilder::submit(Program& program, const FilePath& vsFile, const FilePath& fsFile,
+	const std::vector<std::string>& defines) {
+	submit(program,
+		addShaderDefines(loadShaderSource(vsFile), defines),
+		addShaderDefines(loadShaderSource(fsFile), defines),
+		vsFile.str() + " and " + fsFile.str());
+}
+
+size_t ProgramBuilder::poll() const {
+	if(!m_bParallel) {
+		return m_Pending.size();
+	}
+	size_t count = 0;
+#ifdef GL_KHR_parallel_shader_compile
+	for(const auto& pending: m_Pending) {
+		GLint completed = GL_FALSE;
+		glGetProgramiv(pending.program->getGLId(), GL_COMPLETION_STATUS_KHR, &completed);
+		if(completed != GL_TRUE) {
+			++count;
+		}
+	}
+#endif
+	return count;
+}
+
+void ProgramBuilder::finish() {
+	std::vector<PendingProgram> pendings;
+	pendings.swap(m_Pending);
+
+	std::string error;
+	for(auto& pending: pendings) {
+		GLuint id = pending.program->getGLId();
+		if(error.empty()) {
+			GLint status;
+			glGetProgramiv(id, GL_LINK_STATUS, &status);
+			if(status != GL_TRUE) {
+				// the shader logs are more helpful than the link one when a stage didn't compile
+				glGetShaderiv(pending.vs, GL_COMPILE_STATUS, &status);
+				if(status != GL_TRUE) {
+					error = "Compilation error for vertex shader (" + pending.name + "): " + getShaderInfoLog(pending.vs);
+				} else {
+					glGetShaderiv(pending.fs, GL_COMPILE_STATUS, &status);
+					if(status != GL_TRUE) {
+						error = "Compilation error for fragment shader (" + pending.name + "): " + getShaderInfoLog(pending.fs);
+					} else {
+						error = "Link error (" + pending.name + "): " + pending.program->getInfoLog();
+					}
+				}
+			} else if(m_pCache && m_pCache->isEnabled()) {
+				m_pCache->store(pending.key, *pending.program);
+			}
+		}
+		glDetachShader(id, pending.vs);
+		glDetachShader(id, pending.fs);
+		release(pending);
+	}
+
+	if(!error.empty()) {
+		throw std::runtime_error(error);
+	}
+}
+
+// Attached shaders are only flagged for deletion, they are freed with their program
+void ProgramBuilder::release(PendingProgram& pending) {
+	glDeleteShader(pending.vs);
+	glDeleteShader(pending.fs);
+	pending.vs = pending.fs = 0;
+}
+
+}
@@ -24,17 +24,47 @@ const std::string Shader::getInfoLog() const {
 	return logString;
 }
 
-Shader loadShader(GLenum type, const FilePath& filepath) {
+std::string loadShaderSource(const FilePath& filepath) {
     std::ifstream input(filepath.c_str());
     if(!input) {
         throw std::runtime_error("Unable to load the file " + filepath.str());
     }
-    
+
     std::stringstream buffer;
     buffer << input.rdbuf();
-    
+    return buffer.str();
+}
+
+std::string addShaderDefines(const std::string& src, const std::vector<std::string>& defines) {
+    if(defines.empty()) {
+        return src;
+    }
+
+    std::string block;
+    for(const auto& define: defines) {
+        block += "#define " + define + "\n";
+    }
+
+    // #version must stay the first directive of the source
+    size_t insertPos = 0;
+    size_t versionPos = src.find("#version");
+    if(versionPos != std::string::npos) {
+        size_t endOfLine = src.find('\n', versionPos);
+        insertPos = (endOfLine == std::string::npos) ? src.size() : endOfLine + 1;
+    }
+
+    std::string result = src;
+    if(insertPos == result.size() && !result.empty() && result.back() != '\n') {
+        result += '\n';
+        insertPos = result.size();
+    }
+    result.insert(insertPos, block);
+    return result;
+}
+
+Shader loadShader(GLenum type, const FilePath& filepath) {
     Shader shader(type);
-    shader.setSource(buffer.str().c_str());
+    shader.setSource(loadShaderSource(filepath).c_str());
 
     return shader;
 }
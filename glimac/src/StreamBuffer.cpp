@@ -0,0 +1,127 @@
+#define GLEW_STATIC
+#include "glimac/StreamBuffer.hpp"
+
+#include <chrono>
+#include <utility>
+
+namespace glimac {
+
+namespace {
+
+const GLbitfield STREAM_FLAGS = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+}
+
+StreamBuffer::StreamBuffer(GLenum target, GLsizeiptr regionSize, unsigned int regionCount):
+	m_Target(target), m_nRegionSize(regionSize), m_nRegion(regionCount - 1), m_Fences(regionCount, nullptr) {
+	GLsizeiptr size = m_nRegionSize * regionCount;
+	if(hasDirectStateAccess()) {
+		glCreateBuffers(1, &m_nGLId);
+		glNamedBufferStorage(m_nGLId, size, nullptr, STREAM_FLAGS);
+		m_pData = static_cast<char*>(glMapNamedBufferRange(m_nGLId, 0, size, STREAM_FLAGS));
+		return;
+	}
+	glGenBuffers(1, &m_nGLId);
+	glBindBuffer(m_Target, m_nGLId);
+	glBufferStorage(m_Target, size, nullptr, STREAM_FLAGS);
+	m_pData = static_cast<char*>(glMapBufferRange(m_Target, 0, size, STREAM_FLAGS));
+	glBindBuffer(m_Target, 0);
+}
+
+StreamBuffer::~StreamBuffer() {
+	release();
+}
+
+StreamBuffer::StreamBuffer(StreamBuffer&& rvalue):
+	m_nGLId(rvalue.m_nGLId), m_Target(rvalue.m_Target), m_nRegionSize(rvalue.m_nRegionSize),
+	m_nRegion(rvalue.m_nRegion), m_pData(rvalue.m_pData), m_Fences(std::move(rvalue.m_Fences)),
+	m_fLastStallTime(rvalue.m_fLastStallTime), m_fTotalStallTime(rvalue.m_fTotalStallTime),
+	m_nStallCount(rvalue.m_nStallCount) {
+	rvalue.m_nGLId = 0;
+	rvalue.m_pData = nullptr;
+	rvalue.m_Fences.clear();
+}
+
+StreamBuffer& StreamBuffer::operator =(StreamBuffer&& rvalue) {
+	if(this != &rvalue) {
+		release();
+		m_nGLId = rvalue.m_nGLId;
+		m_Target = rvalue.m_Target;
+		m_nRegionSize = rvalue.m_nRegionSize;
+		m_nRegion = rvalue.m_nRegion;
+		m_pData = rvalue.m_pData;
+		m_Fences = std::move(rvalue.m_Fences);
+		m_fLastStallTime = rvalue.m_fLastStallTime;
+		m_fTotalStallTime = rvalue.m_fTotalStallTime;
+		m_nStallCount = rvalue.m_nStallCount;
+		rvalue.m_nGLId = 0;
+		rvalue.m_pData = nullptr;
+		rvalue.m_Fences.clear();
+	}
+	return *this;
+}
+
+bool StreamBuffer::isSupported() {
+	return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+}
+
+void* StreamBuffer::beginFrame() {
+	m_nRegion = (m_nRegion + 1) % m_Fences.size();
+	wait(m_nRegion);
+	return m_pData + getRegionOffset();
+}
+
+void StreamBuffer::endFrame() {
+	if(m_Fences[m_nRegion]) {
+		glDeleteSync(m_Fences[m_nRegion]);
+	}
+	m_Fences[m_nRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void StreamBuffer::wait(unsigned int region) {
+	m_fLastStallTime = 0;
+	GLsync fence = m_Fences[region];
+	if(!fence) {
+		return;
+	}
+
+	GLenum result = glClientWaitSync(fence, 0, 0);
+	if(result == GL_TIMEOUT_EXPIRED) {
+		// the GPU is still reading the region: a stall, measure it
+		auto start = std::chrono::high_resolution_clock::now();
+		do {
+			result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		} while(result == GL_TIMEOUT_EXPIRED);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		m_fLastStallTime = elapsed.count();
+		m_fTotalStallTime += m_fLastStallTime;
+		++m_nStallCount;
+	}
+
+	glDeleteSync(fence);
+	m_Fences[region] = nullptr;
+}
+
+void StreamBuffer::release() {
+	for(auto fence: m_Fences) {
+		if(fence) {
+			glDeleteSync(fence);
+		}
+	}
+	m_Fences.clear();
+	if(m_nGLId) {
+		if(hasDirectStateAccess()) {
+			glUnmapNamedBuffer(m_nGLId);
+		} else {
+			glBindBuffer(m_Target, m_nGLId);
+			glUnmapBuffer(m_Target);
+			glBindBuffer(m_Target, 0);
+		}
+		glDeleteBuffers(1, &m_nGLId);
+		m_nGLId = 0;
+	}
+	m_pData = nullptr;
+}
+
+}
@@ -0,0 +1,96 @@
+#include "glimac/ThreadPool.hpp"
+
+#include <algorithm>
+
+namespace glimac {
+
+ThreadPool::ThreadPool(unsigned int threadCount):
+	m_nNextChunk(0), m_nDoneChunks(0) {
+	if(!threadCount) {
+		unsigned int hardwareThreads = std::thread::hardware_concurrency();
+		threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+	}
+	for(unsigned int i = 0; i < threadCount; ++i) {
+		m_Workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bStop = true;
+	}
+	m_WorkAvailable.notify_all();
+	for(auto& worker: m_Workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const Job& job) {
+	if(!count) {
+		return;
+	}
+	grain = std::max<size_t>(grain, 1);
+	size_t chunkCount = (count + grain - 1) / grain;
+	if(m_Workers.empty() || chunkCount == 1) {
+		job(0, count);
+		return;
+	}
+
+	{
+		// a worker woken late by the previous job may still be looking for chunks
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_WorkDone.wait(lock, [this] { return m_nActiveWorkers == 0; });
+		m_pJob = &job;
+		m_nCount = count;
+		m_nGrain = grain;
+		m_nChunkCount = chunkCount;
+		m_nNextChunk = 0;
+		m_nDoneChunks = 0;
+		++m_nGeneration;
+	}
+	m_WorkAvailable.notify_all();
+
+	runChunks();
+
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_WorkDone.wait(lock, [this] { return m_nDoneChunks == m_nChunkCount && m_nActiveWorkers == 0; });
+	m_pJob = nullptr;
+}
+
+void ThreadPool::workerLoop() {
+	uint64_t generation = 0;
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_WorkAvailable.wait(lock, [this, generation] { return m_bStop || m_nGeneration != generation; });
+			if(m_bStop) {
+				return;
+			}
+			generation = m_nGeneration;
+			++m_nActiveWorkers;
+		}
+
+		runChunks();
+
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			--m_nActiveWorkers;
+		}
+		m_WorkDone.notify_all();
+	}
+}
+
+void ThreadPool::runChunks() {
+	size_t chunk;
+	while((chunk = m_nNextChunk++) < m_nChunkCount) {
+		size_t begin = chunk * m_nGrain;
+		(*m_pJob)(begin, std::min(begin + m_nGrain, m_nCount));
+		if(++m_nDoneChunks == m_nChunkCount) {
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_WorkDone.notify_all();
+		}
+	}
+}
+
+}